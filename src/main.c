@@ -3,8 +3,14 @@
  * date: 5/15/24
  */
 
+// for O_NOATIME
+#ifdef LINUX
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
@@ -17,9 +23,25 @@
 #include <errno.h>
 #include <pwd.h>
 #include <grp.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <sys/xattr.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #ifdef LINUX
 #include <linux/limits.h>
+#include <sys/syscall.h>
 #endif
 
 #define VERSION_STRING "0.2"
@@ -27,7 +49,109 @@
 #define ARG_FLAG_RECURSIVE 'r'
 #define ARG_FLAG_HELP 'h'
 #define ARG_FLAG_VERSION 'v'
+#define ARG_FLAG_SYMBOLIC 'l'
 #define ARG_BRIEF_DESCRIPTION "--brief-description"
+#define ARG_THREADS "--threads"
+#define ARG_QUEUE_MEMORY "--queue-memory"
+#define ARG_TIMEOUT "--timeout"
+#define ARG_MAX_ENTRIES "--max-entries"
+#define ARG_CHECKPOINT "--checkpoint"
+#define ARG_RESUME "--resume"
+#define ARG_IO_PRIORITY "--io-priority"
+#define ARG_MAX_STAT_RATE "--max-stat-rate"
+#define ARG_MAX_DIR_READS "--max-dir-reads"
+#define ARG_PROGRESS "--progress"
+#define ARG_DUPLICATES "--duplicates"
+#define ARG_CHECKSUM "--checksum"
+#define ARG_SNAPSHOT "--snapshot"
+#define ARG_COMPARE "--compare"
+#define ARG_LINES "--lines"
+#define ARG_CONTENT_TYPE "--content-type"
+#define ARG_ALLOCATED "--allocated"
+#define ARG_HOLES "--holes"
+#define ARG_XATTRS "--xattrs"
+#define ARG_ACL "--acl"
+#define ARG_LABEL "--label"
+#define ARG_NSS_FILES "--nss-files"
+#define ARG_COLORS "--colors"
+#define ARG_SIZE_FORMAT "--size-format"
+#define ARG_STAT_THREADS "--stat-threads"
+#define ARG_PATHS "--paths"
+#define ARG_NULL "--null"
+
+/// "rwxrwxrwx" and its terminator
+#define PERMISSIONS_SYMBOLIC_SIZE 10
+
+/// longest rwx description and its terminator
+#define PERMISSIONS_DESCRIPTION_SIZE 32
+
+/// where --nss-files reads names from
+#define NSS_FILES_PASSWD "/etc/passwd"
+#define NSS_FILES_GROUP "/etc/group"
+
+/// sequential listings write to stdout once this much is buffered
+#define OUTPUT_FLUSH_THRESHOLD (64 << 10)
+
+/// default memory the output queue may hold with --threads
+#define QUEUE_MEMORY_DEFAULT (16 << 20)
+
+/// number of slots in the output queue. must be a power of 2
+#define QUEUE_SLOTS 1024
+
+/// buffers that may wait for the writer in sequential listings
+#define OUTPUT_WRITER_DEPTH 4
+
+/// entries read between checks for cancellation
+#define LISTING_BATCH_SIZE 256
+
+/// directories a walk keeps open below the input directory.
+/// Deeper ones are closed and opened again when needed
+#define DIR_STACK_OPEN_MAX 128
+
+/// directories with fewer entries are lstat'ed by one thread
+#define DIR_STAT_PARALLEL_MIN (16 * LISTING_BATCH_SIZE)
+
+/// directories with fewer entries aren't worth a stat thread
+#define DIR_LISTING_PIPELINE_MIN (4 * LISTING_BATCH_SIZE)
+
+/**
+ * how long to wait past --timeout for threads to reach a
+ * batch boundary before assuming they are stuck in the kernel
+ */
+#define CANCEL_GRACE_NS (500 * 1000 * 1000ULL)
+
+/// first line of every checkpoint file, followed by 1 if the
+/// scan was recursive and 0 if not
+#define CHECKPOINT_HEADER "listdir-checkpoint 2"
+
+/// finished directories are synced to the checkpoint at most this often
+#define CHECKPOINT_INTERVAL_NS (5 * 1000 * 1000 * 1000ULL)
+
+/// bytes at each end of a file hashed before reading all of it
+#define DUPLICATES_EDGE_SIZE (64 << 10)
+
+/// read size when hashing files
+#define HASH_READ_SIZE (1 << 20)
+
+/// extended attribute --checksum caches digests in
+#define CHECKSUM_XATTR "user.listdir.xxh64"
+
+
+/// bytes --content-type reads from the start of each file
+#define CONTENT_SNIFF_SIZE 512
+
+/// first line of every snapshot file
+#define SNAPSHOT_HEADER "listdir-snapshot 1\n"
+
+/// how often --progress reports
+#define PROGRESS_INTERVAL_NS (1000 * 1000 * 1000ULL)
+
+// values for ioprio_set(2), see linux/ioprio.h
+#define IO_PRIORITY_WHO_PROCESS 1
+#define IO_PRIORITY_CLASS_SHIFT 13
+#define IO_PRIORITY_CLASS_BE 2
+#define IO_PRIORITY_CLASS_IDLE 3
+#define IO_PRIORITY_VALUE(class, data) (((class) << IO_PRIORITY_CLASS_SHIFT) | (data))
 
 #define STAT_MOD_TYPE_BDEV 'b'
 #define STAT_MOD_TYPE_CDEV 'c'
@@ -57,7 +181,9 @@
 #define ANSI_COLOR_RESET   "\x1b[0m"
 
 typedef struct PathQuery {
-	char p[PATH_MAX]; // path (relative/absolute)
+	/// path (relative/absolute). Owned, children only hold
+	/// their leaf so this stays short
+	char * p;
 	
 	/**
 	 * parent path, should be a directory
@@ -76,23 +202,210 @@ typedef struct PathQuery {
 	 * the input path the user provides will always start at level
 	 * 0. Every child made after will be incremented
 	 */
-	unsigned char lvl;
+	unsigned int lvl;
+
+	/// which input directory we came from. children inherit this
+	size_t root;
+
+	/**
+	 * descriptor of this directory while a walk has it open,
+	 * -1 otherwise. Children are looked up relative to it, so
+	 * they can be reached past PATH_MAX
+	 */
+	int fd;
+
+	/**
+	 * device and inode of this path
+	 *
+	 * only filled in for directories. Used to share listings
+	 * between input paths and to catch loops
+	 */
+	dev_t dev;
+	ino_t ino;
+	unsigned char hasid : 1;
+
+	/**
+	 * lstat of this path, if we already have it
+	 *
+	 * input paths are stat'ed once while reading arguments
+	 * and carried here so we don't ask the filesystem again
+	 */
+	struct stat st;
+	unsigned char hasstat : 1;
+
+	/// true if path resolves to a directory. only valid if hasstat is set
+	unsigned char isdir : 1;
+
+	/// line counts for --lines, if we already have them
+	uint64_t lines;
+	uint64_t nonempty;
+	unsigned char haslines : 1;
+
+	/**
+	 * keep the listing of this directory (and everything
+	 * under it) after printing because another input path
+	 * will need it. children inherit this
+	 */
+	unsigned char retain : 1;
 } PathQuery;
 
+/**
+ * hash table keyed by a file's (dev, ino)
+ *
+ * open addressing with linear probing. Values are owned
+ * by whoever put them in, see IdTableRelease()
+ */
+typedef struct {
+	struct IdTableEntry {
+		dev_t dev;
+		ino_t ino;
+		void * value; // null if slot is empty
+	} * array;
+	size_t size;
+	size_t cap; // always a power of 2
+} IdTable;
+
+/**
+ * one entry read from a directory
+ */
+typedef struct {
+	char * name;
+
+	/// lstat of the entry. only valid if error is 0
+	struct stat st;
+	int error;
+
+	/// lstat was skipped because only names were needed. st
+	/// then only holds the file type, or 0 if it is only known
+	/// not to be a directory
+	unsigned char nostat : 1;
+} DirEntry;
+
+/**
+ * everything we read from a single directory, sorted by name
+ */
+typedef struct {
+	DirEntry * entries;
+	size_t size;
+
+	/// entries that are directories
+	size_t subdirs;
+
+	/// still being lstat'ed, see DirListingWait()
+	struct DirStatJob * pending;
+
+	/// we were cancelled, or reading failed, before we had all of it
+	unsigned char incomplete : 1;
+
+	/// errno of the read that failed, 0 if none did
+	int error;
+} DirListing;
+
+/// DirListingCreate() flags
+
+/// callers only need names, and to know which entries are
+/// directories. Other entries are only lstat'ed when there
+/// is no other way to tell they aren't directories
+#define DIR_LISTING_NAMES (1 << 0)
+
+/// lstat on other threads while the caller reads what is done
+#define DIR_LISTING_PIPELINE (1 << 1)
+
+/**
+ * tells everything that is scanning when to stop
+ *
+ * scanning code checks it between batches of entries so a
+ * timeout or entry budget stops every thread promptly
+ */
+typedef struct {
+	atomic_bool cancelled;
+
+	/// CLOCK_MONOTONIC time in ns to stop at. 0 for none
+	uint64_t deadline;
+
+	/// entries that may be read. 0 for no limit
+	uint64_t maxentries;
+	atomic_uint_fast64_t entries;
+
+	/// why we stopped, for the user
+	const char * reason;
+} CancelToken;
+
+/**
+ * paths of directories we didn't finish listing
+ */
+typedef struct {
+	char ** array;
+	size_t size;
+	pthread_mutex_t lock;
+} UnfinishedDirs;
+
+/**
+ * a path the user provided plus what we learned about it
+ * when we first looked at it
+ */
+typedef struct {
+	char * path;
+
+	/// lstat of path. only valid if error is 0
+	struct stat st;
+
+	/// identity of what path resolves to (follows symlinks)
+	dev_t dev;
+	ino_t ino;
+	unsigned char isdir : 1;
+
+	/// errno from lstat/stat. 0 on success
+	int error;
+
+	/**
+	 * index of the input directory this path came from and
+	 * its level under it. only a resumed scan starts below
+	 * level 0
+	 */
+	size_t root;
+	unsigned int lvl;
+} PathListItem;
+
 /**
  * there are two different arrays but the accessor functions
  * should abstract the data retrieval
  */
 typedef struct {
 	/// for files
-	char ** arrayfile;
+	PathListItem * arrayfile;
 	size_t sizefile;
 
 	/// for directories
-	char ** arraydir;
+	PathListItem * arraydir;
 	size_t sizedir;
 } PathList;
 
+/**
+ * how sizes are written. The default is BFByteGetString()
+ */
+typedef enum {
+	SIZE_FORMAT_DEFAULT = 0,
+	SIZE_FORMAT_BYTES,
+	SIZE_FORMAT_SI,
+	SIZE_FORMAT_IEC,
+	SIZE_FORMAT_FIXED_SI,
+	SIZE_FORMAT_FIXED_IEC
+} SizeFormatKind;
+
+typedef struct {
+	SizeFormatKind kind;
+
+	/// power of 1000 or 1024 for the fixed kinds
+	unsigned int unit;
+} SizeFormat;
+
+/// EiB is the largest unit a uint64_t reaches
+#define SIZE_UNIT_MAX 6
+
+/// enough for 20 digits, a decimal point and a unit
+#define SIZE_STRING_MAX 64
+
 typedef struct {
 	/**
 	 * array of input paths provided by user
@@ -102,8 +415,96 @@ typedef struct {
 	unsigned char showversion: 1;
 	unsigned char recursive : 1;
 	unsigned char briefDescription : 1;
+
+	/// show permissions as rwxr-xr-x instead of octal
+	unsigned char symbolic : 1;
+
+	/// report how far along we are on stderr
+	unsigned char progress : 1;
+
+	/// print files with identical content instead of listing
+	unsigned char duplicates : 1;
+
+	/// show a digest of every regular file's content
+	unsigned char checksum : 1;
+
+	/// file to write a tree snapshot to
+	const char * snapshot;
+
+	/// two snapshot files to compare
+	const char * compare[2];
+
+	/// show line counts of regular files
+	unsigned char lines : 1;
+
+	/// show what regular files contain, going by their first bytes
+	unsigned char contenttype : 1;
+
+	/// show bytes allocated on disk, and map holes in sparse files
+	unsigned char allocated : 1;
+	unsigned char holes : 1;
+
+	/// show xattr names and sizes, ACL presence and SELinux label
+	unsigned char xattrs : 1;
+	unsigned char acl : 1;
+	unsigned char label : 1;
+
+	/// resolve owner and group from /etc/passwd and /etc/group
+	/// directly instead of going through NSS
+	unsigned char nssfiles : 1;
+
+	/// file with colors in LS_COLORS format. LS_COLORS is
+	/// used if this is null
+	const char * colors;
+
+	/// how sizes are written in listings
+	SizeFormat sizeformat;
+
+	/// print only the full path of every entry, one per line
+	/// or, with nul, each ending in '\0'
+	unsigned char fullpaths : 1;
+	unsigned char nul : 1;
+
+	/// number of threads scanning directories. 0 or 1 is sequential
+	unsigned int threads;
+
+	/// threads that lstat the entries of one large directory
+	/// together. 0 uses threads
+	unsigned int statthreads;
+
+	/// bytes of finished output allowed to wait for the writer
+	size_t queuememory;
+
+	/// nanoseconds we may run for. 0 for no limit
+	uint64_t timeout;
+
+	/// number of entries we may read. 0 for no limit
+	uint64_t maxentries;
+
+	/// file to record progress in, and file to continue from
+	const char * checkpoint;
+	const char * resume;
+
+	/// value for ioprio_set. 0 leaves it alone
+	int ioprio;
+
+	/// lstat calls allowed per second. 0 for no limit
+	uint64_t maxstatrate;
+
+	/// directories that may be read at once. 0 for no limit
+	unsigned int maxdirreads;
 } Arguments;
 
+/**
+ * growable buffer output is rendered into before it
+ * is written to stdout
+ */
+typedef struct {
+	char * data;
+	size_t size;
+	size_t cap;
+} OutputBuffer;
+
 void help(const char * toolname) {
 	printf("usage: %s [ -<flags> ] <path>\n", toolname);
 
@@ -111,6 +512,35 @@ void help(const char * toolname) {
 	printf("  [ %c ] : see help text\n", ARG_FLAG_HELP);
 	printf("  [ %c ] : see version\n", ARG_FLAG_VERSION);
 	printf("  [ %c ] : recursive\n", ARG_FLAG_RECURSIVE);
+	printf("  [ %c ] : show permissions as rwxr-xr-x\n", ARG_FLAG_SYMBOLIC);
+	printf("  [ %s <n> ] : scan directories with n threads\n", ARG_THREADS);
+	printf("  [ %s <n> ] : lstat entries of large directories with n threads (default: %s)\n", ARG_STAT_THREADS, ARG_THREADS);
+	printf("  [ %s <size> ] : memory finished output may use while waiting to be written (default %dM)\n",
+		ARG_QUEUE_MEMORY, QUEUE_MEMORY_DEFAULT >> 20);
+	printf("  [ %s <time> ] : stop after this long (i.e. 500ms, 2s, 1m) and print what was finished\n", ARG_TIMEOUT);
+	printf("  [ %s <n> ] : stop after reading n entries and print what was finished\n", ARG_MAX_ENTRIES);
+	printf("  [ %s <file> ] : record finished directories in file so the scan can be resumed\n", ARG_CHECKPOINT);
+	printf("  [ %s <file> ] : continue the scan recorded in file. paths and %c come from the file\n", ARG_RESUME, ARG_FLAG_RECURSIVE);
+	printf("  [ %s <idle|be0-7> ] : io scheduling class (linux only)\n", ARG_IO_PRIORITY);
+	printf("  [ %s <n> ] : stat at most n entries per second\n", ARG_MAX_STAT_RATE);
+	printf("  [ %s <n> ] : read at most n directories at once\n", ARG_MAX_DIR_READS);
+	printf("  [ %s ] : print progress to stderr every second\n", ARG_PROGRESS);
+	printf("  [ %s ] : print groups of non empty files with the same content\n", ARG_DUPLICATES);
+	printf("  [ %s ] : show the xxh64 of each file, cached in the %s xattr\n", ARG_CHECKSUM, CHECKSUM_XATTR);
+	printf("  [ %s <file> ] : write a hash of every directory's tree to file, always recursive (add %s to hash content)\n", ARG_SNAPSHOT, ARG_CHECKSUM);
+	printf("  [ %s <a> <b> ] : print what differs between two snapshots\n", ARG_COMPARE);
+	printf("  [ %s ] : show lines and non empty lines of each file, with totals per directory\n", ARG_LINES);
+	printf("  [ %s ] : show what each file holds (elf, gzip, zstd, png, jpeg, pdf, text, utf-8, binary, ...)\n", ARG_CONTENT_TYPE);
+	printf("  [ %s ] : show bytes allocated on disk\n", ARG_ALLOCATED);
+	printf("  [ %s ] : show data extents and bytes in holes of sparse files\n", ARG_HOLES);
+	printf("  [ %s ] : show extended attribute names and sizes\n", ARG_XATTRS);
+	printf("  [ %s ] : mark entries that have a POSIX ACL with '+'\n", ARG_ACL);
+	printf("  [ %s ] : show the SELinux label\n", ARG_LABEL);
+	printf("  [ %s <format> ] : write sizes as bytes, si, iec, or in one unit (k, m, g, kb, mb, gb, ...)\n", ARG_SIZE_FORMAT);
+	printf("  [ %s <file> ] : read colors from file, in LS_COLORS format, instead of LS_COLORS\n", ARG_COLORS);
+	printf("  [ %s ] : read owner and group names from %s and %s once instead of NSS\n", ARG_NSS_FILES, NSS_FILES_PASSWD, NSS_FILES_GROUP);
+	printf("  [ %s ] : print only the path of each entry, one per line\n", ARG_PATHS);
+	printf("  [ %s ] : like %s, ending each path with NUL (for xargs -0)\n", ARG_NULL, ARG_PATHS);
 
 	printf("\n");
 	printf("entry types:\n");
@@ -146,6 +576,7 @@ int main(int argc, char * argv[]) {
 	memset(&args, 0, sizeof(args));
 
 	int error = ArgumentsRead(argc, argv, &args);
+	int result = 0;
 
 	if (!error) {
 		if (args.showhelp) {
@@ -155,7 +586,7 @@ int main(int argc, char * argv[]) {
 		} else if (args.briefDescription) {
 			BriefDescription();
 		} else {
-			GetInfo(&args);
+			result = GetInfo(&args);
 		}
 	}
 
@@ -164,7 +595,7 @@ int main(int argc, char * argv[]) {
 		return 1;
 	}
 
-	return 0;
+	return result;
 }
 
 /**
@@ -203,16 +634,64 @@ int RemoveTrailingForwardSlashes(char * buf) {
 	return 0;
 }
 
+/**
+ * returns "<dir>/<name>" however long it is, NULL if out of
+ * memory. "/" already ends in the separator. Free it with BFFree()
+ */
+char * PathJoin(const char * dir, const char * name) {
+	if (!dir || !name) return NULL;
+
+	size_t dlen = strlen(dir), nlen = strlen(name);
+	size_t sep = dlen && (dir[dlen - 1] != '/');
+	char * p = malloc(dlen + sep + nlen + 1);
+	if (!p) return NULL;
+
+	memcpy(p, dir, dlen);
+	if (sep) p[dlen] = '/';
+	memcpy(p + dlen + sep, name, nlen + 1);
+
+	return p;
+}
+
 int PathQueryCreate(PathQuery * p, const char * path) {
 	if (!p || !path) return 1;
 
 	memset(p, 0, sizeof(PathQuery));
-	strncpy(p->p, path, PATH_MAX);
+	p->fd = -1;
+	p->p = strndup(path, PATH_MAX - 1);
+	if (!p->p) return 1;
 	RemoveTrailingForwardSlashes(p->p);
 	
 	return 0;
 }
 
+/**
+ * creates path query for a path the user provided, reusing
+ * the stat we took while reading arguments
+ */
+int PathQueryCreateFromItem(PathQuery * p, const PathListItem * item) {
+	if (!p || !item) return 1;
+
+	if (PathQueryCreate(p, item->path)) return 1;
+
+	p->lvl = item->lvl;
+	p->root = item->root;
+
+	if (!item->error) {
+		p->st = item->st;
+		p->hasstat = true;
+		p->isdir = item->isdir;
+
+		if (item->isdir) {
+			p->dev = item->dev;
+			p->ino = item->ino;
+			p->hasid = true;
+		}
+	}
+
+	return 0;
+}
+
 /**
  * creates child path query
  *
@@ -227,9 +706,13 @@ int PathQueryCreateChild(
 	if (!p || !leaf || !c) return 1;
 
 	memset(c, 0, sizeof(PathQuery));
-	strncpy(c->p, leaf, PATH_MAX);
+	c->fd = -1;
+	c->p = strndup(leaf, PATH_MAX - 1);
+	if (!c->p) return 1;
 	c->parent = p;
 	c->lvl = p->lvl + 1;
+	c->root = p->root;
+	c->retain = p->retain;
 	
 	RemoveTrailingForwardSlashes(c->p);
 	RemoveLeadingPeriodAndForwardSlashes(c->p);
@@ -237,39 +720,133 @@ int PathQueryCreateChild(
 	return 0;
 }
 
+/// 1 if a separator goes between `q` and its children. "/"
+/// already ends in one
+static size_t PathQuerySeparatorLength(const PathQuery * q) {
+	size_t n = strlen(q->p);
+	return !n || (q->p[n - 1] != '/');
+}
+
+/// length of the full path of `p`
+static size_t PathQueryGetPathLength(const PathQuery * p) {
+	size_t len = strlen(p->p);
+	for (const PathQuery * q = p->parent; q; q = q->parent) {
+		len += strlen(q->p) + PathQuerySeparatorLength(q);
+	}
+	return len;
+}
+
+/**
+ * writes the full path of `p` into `buf`, which needs PATH_MAX
+ * bytes. Paths that don't fit are cut short and 1 is returned
+ *
+ * the length is found first so every component is copied once,
+ * straight to where it goes
+ */
 int PathQueryGetPath(const PathQuery * p, char * buf) {
 	if (!p || !buf) return 1;
 
-	char path[PATH_MAX];
-	memset(path, 0, PATH_MAX);
+	size_t len = PathQueryGetPathLength(p);
+
+	// from the leaf back, keeping only what lands in buf
+	size_t end = len;
+	for (const PathQuery * q = p; q; q = q->parent) {
+		size_t n = strlen(q->p);
+		size_t start = end - n;
+		if (start < PATH_MAX - 1) {
+			size_t fit = end < PATH_MAX - 1 ? n : PATH_MAX - 1 - start;
+			memcpy(buf + start, q->p, fit);
+		}
+		end = start;
+		if (q->parent && PathQuerySeparatorLength(q->parent)) {
+			if (--end < PATH_MAX - 1) buf[end] = '/';
+		}
+	}
+	buf[len < PATH_MAX - 1 ? len : PATH_MAX - 1] = '\0';
+
+	RemoveTrailingForwardSlashes(buf);
 
-	const PathQuery * q = p;
-	do {
-		char t[PATH_MAX];
+	return len >= PATH_MAX;
+}
 
-		// prepend current path to our main buf
-		snprintf(t, PATH_MAX, "%s/%s", q->p, path);
-		strncpy(path, t, PATH_MAX);
-	} while ((q = q->parent) != NULL);
+/**
+ * returns the full path of `p` however long it is, NULL if
+ * out of memory. Free it with BFFree()
+ */
+char * PathQueryCopyPath(const PathQuery * p) {
+	if (!p) return NULL;
+
+	size_t len = PathQueryGetPathLength(p);
+	char * buf = malloc(len + 1);
+	if (!buf) return NULL;
+
+	size_t end = len;
+	for (const PathQuery * q = p; q; q = q->parent) {
+		size_t n = strlen(q->p);
+		end -= n;
+		memcpy(buf + end, q->p, n);
+		if (q->parent && PathQuerySeparatorLength(q->parent)) {
+			buf[--end] = '/';
+		}
+	}
+	buf[len] = '\0';
 
-	RemoveTrailingForwardSlashes(path);
+	RemoveTrailingForwardSlashes(buf);
 
-	strncpy(buf, path, PATH_MAX);
+	return buf;
+}
 
-	return 0;
+/**
+ * writes a path that reaches `p` into `buf`, which needs
+ * PATH_MAX bytes. That is the full path if it fits. Otherwise
+ * it goes through the descriptor of the open parent, where
+ * /proc/self/fd has it
+ *
+ * returns 1 and leaves `buf` empty, which no file has, if
+ * neither works
+ */
+int PathQueryGetAccessPath(const PathQuery * p, char * buf) {
+	if (!p || !buf) return 1;
+	else if (!PathQueryGetPath(p, buf)) return 0;
+
+#ifdef LINUX
+	if (p->parent && (p->parent->fd >= 0) &&
+		((size_t) snprintf(buf, PATH_MAX, "/proc/self/fd/%d/%s", p->parent->fd, p->p) < PATH_MAX)) {
+		return 0;
+	}
+#endif
+
+	buf[0] = '\0';
+	return 1;
 }
 
 int PathQueryRelease(PathQuery * p) {
+	if (!p) return 1;
+
+	BFFree(p->p);
+	p->p = NULL;
+
 	return 0;
 }
 
-unsigned char PathQueryGetLevel(const PathQuery * p) {
+unsigned int PathQueryGetLevel(const PathQuery * p) {
 	if (!p) return 1;
 	return p->lvl;
 }
 
+int PathQuerySetIdentity(PathQuery * p, const struct stat * st) {
+	if (!p || !st) return 1;
+
+	p->dev = st->st_dev;
+	p->ino = st->st_ino;
+	p->hasid = true;
+
+	return 0;
+}
+
 bool PathQueryIsFile(const PathQuery * p) {
 	if (!p) return false;
+	else if (p->hasstat) return !p->isdir;
 	return BFFileSystemPathIsFile(p->p);
 }
 
@@ -278,16 +855,23 @@ size_t PathListGetSize(const PathList * paths) {
 	return paths->sizefile + paths->sizedir;
 }
 
-int PathListGetPathAtIndex(const PathList * paths, size_t index, char * buf) {
-	if (!paths || !buf) return 1;
-	else if (index >= PathListGetSize(paths)) return 1;
+const PathListItem * PathListGetItemAtIndex(const PathList * paths, size_t index) {
+	if (!paths) return NULL;
+	else if (index >= PathListGetSize(paths)) return NULL;
 
 	if (index < (paths->sizefile))
-		strncpy(buf, paths->arrayfile[index], strlen(paths->arrayfile[index]) + 1);
+		return &paths->arrayfile[index];
 	else
-		strncpy(buf,
-				paths->arraydir[index - paths->sizefile],
-				strlen(paths->arraydir[index - paths->sizefile]) + 1);
+		return &paths->arraydir[index - paths->sizefile];
+}
+
+int PathListGetPathAtIndex(const PathList * paths, size_t index, char * buf) {
+	if (!paths || !buf) return 1;
+
+	const PathListItem * item = PathListGetItemAtIndex(paths, index);
+	if (!item) return 1;
+
+	strncpy(buf, item->path, strlen(item->path) + 1);
 
 	return 0;
 }
@@ -306,6 +890,8 @@ int ArgumentsReadFlagsFromArg(const char * arg, Arguments * args) {
 			args->showhelp = true;
 		} else if (arg[i] == ARG_FLAG_VERSION) {
 			args->showversion = true;
+		} else if (arg[i] == ARG_FLAG_SYMBOLIC) {
+			args->symbolic = true;
 		}
 	}
 
@@ -343,12 +929,12 @@ int PathListRelease(PathList * paths) {
 	if (!paths) return 1;
 
 	for (int i = 0; i < paths->sizefile; i++) {
-		char * tmp = paths->arrayfile[i];
+		char * tmp = paths->arrayfile[i].path;
 		BFFree(tmp);
 	}
 
 	for (int i = 0; i < paths->sizedir; i++) {
-		char * tmp = paths->arraydir[i];
+		char * tmp = paths->arraydir[i].path;
 		BFFree(tmp);
 	}
 
@@ -358,26 +944,58 @@ int PathListRelease(PathList * paths) {
 	return 0;
 }
 
-int AddPathToArray(void ** arrayptr, size_t * size, const char * path) {
-	if (!arrayptr || !size || !path) return 1;
+int AddPathToArray(PathListItem ** arrayptr, size_t * size, const PathListItem * item) {
+	if (!arrayptr || !size || !item) return 1;
 
-	char ** array = (char **) *arrayptr;
+	PathListItem * array = *arrayptr;
 
-	array = (char **) realloc(array, sizeof(char **) * ++(*size));
+	array = (PathListItem *) realloc(array, sizeof(PathListItem) * (*size + 1));
 	if (array == NULL) {
 		printf("error: couldn't allocate more space for path array (size %ld)\n", *size);
 		return 1;
 	}
+	*arrayptr = array;
 
-	char * tmp = BFStringCopyString(path);
+	char * tmp = BFStringCopyString(item->path);
 	if (tmp == NULL) {
-		printf("error: couldn't allocate memory for string %s\n", path);
+		printf("error: couldn't allocate memory for string %s\n", item->path);
 		return 1;
 	}
 
-	array[*size - 1] = tmp;
+	array[*size] = *item;
+	array[*size].path = tmp;
+	(*size)++;
 
-	*arrayptr = array;
+	return 0;
+}
+
+/**
+ * stats `path` once and records everything the rest of
+ * the program needs to know about it
+ *
+ * only symlinks cost a second call, to find out what
+ * they resolve to
+ */
+int PathListItemCreate(PathListItem * item, const char * path) {
+	if (!item || !path) return 1;
+
+	memset(item, 0, sizeof(PathListItem));
+	item->path = (char *) path;
+
+	if (lstat(path, &item->st) == -1) {
+		item->error = errno;
+		return 0;
+	}
+
+	struct stat target = item->st;
+	if (S_ISLNK(item->st.st_mode) && (stat(path, &target) == -1)) {
+		item->error = errno;
+		return 0;
+	}
+
+	item->dev = target.st_dev;
+	item->ino = target.st_ino;
+	item->isdir = S_ISDIR(target.st_mode);
 
 	return 0;
 }
@@ -388,27 +1006,155 @@ int PathListAddPath(PathList * paths, const char * path) {
 		return 1;
 	}
 
-	void ** array = NULL;
-	size_t * size = 0;
-	if (BFFileSystemPathIsFile(path)) {
-		array = (void **) &paths->arrayfile;
-		size = &paths->sizefile;
+	PathListItem item;
+	if (PathListItemCreate(&item, path)) {
+		return 1;
+	}
+
+	// paths we couldn't stat are treated as directories
+	// so they get reported when we try to scan them
+	if (!item.error && !item.isdir) {
+		return AddPathToArray(&paths->arrayfile, &paths->sizefile, &item);
 	} else {
-		array = (void **) &paths->arraydir;
-		size = &paths->sizedir;
+		return AddPathToArray(&paths->arraydir, &paths->sizedir, &item);
 	}
+}
 
-	return AddPathToArray(array, size, path);
+int PathListItemCompare(const void * a, const void * b) {
+	return strcmp(((const PathListItem *) a)->path, ((const PathListItem *) b)->path);
 }
 
 int PathListSort(PathList * paths) {
 	if (!paths) return 1;
 
-	if (paths->arrayfile && ArraySort(paths->arrayfile, paths->sizefile)) {
-		printf("error: failed to sort file array\n");
+	if (paths->arrayfile)
+		qsort(paths->arrayfile, paths->sizefile, sizeof(PathListItem), PathListItemCompare);
+	if (paths->arraydir)
+		qsort(paths->arraydir, paths->sizedir, sizeof(PathListItem), PathListItemCompare);
+
+	// input directories are known by their position
+	for (size_t i = 0; i < paths->sizedir; i++)
+		paths->arraydir[i].root = i;
+
+	return 0;
+}
+
+/**
+ * reads a number with an optional K, M or G suffix (powers of 1024)
+ */
+int ArgumentsParseSize(const char * arg, size_t * size) {
+	if (!arg || !size) return 1;
+
+	char * end = NULL;
+	errno = 0;
+	unsigned long long n = strtoull(arg, &end, 10);
+	if (errno || (end == arg) || (arg[0] == '-')) return 1;
+
+	unsigned int shift = 0;
+	switch (*end) {
+	case 'g': case 'G': shift += 10; // fall through
+	case 'm': case 'M': shift += 10; // fall through
+	case 'k': case 'K': shift += 10; end++; // fall through
+	case '\0': break;
+	default: return 1;
+	}
+
+	if (*end != '\0') return 1;
+	if (n > (SIZE_MAX >> shift)) return 1;
+
+	*size = (size_t) n << shift;
+	return 0;
+}
+
+/**
+ * reads a plain decimal count no larger than max
+ */
+int ArgumentsParseCount(const char * arg, size_t max, size_t * count) {
+	if (!arg || !count) return 1;
+	if ((arg[0] < '0') || (arg[0] > '9')) return 1;
+
+	char * end = NULL;
+	errno = 0;
+	unsigned long long n = strtoull(arg, &end, 10);
+	if (errno || (*end != '\0') || (n > max)) return 1;
+
+	*count = (size_t) n;
+	return 0;
+}
+
+/**
+ * reads a duration into nanoseconds
+ *
+ * accepts ms, s, m and h suffixes. no suffix means seconds
+ */
+int ArgumentsParseDuration(const char * arg, uint64_t * ns) {
+	if (!arg || !ns) return 1;
+
+	char * end = NULL;
+	errno = 0;
+	double n = strtod(arg, &end);
+	if (errno || (end == arg) || (n < 0)) return 1;
+
+	double unit = 1e9;
+	if (!strcmp(end, "ms")) unit = 1e6;
+	else if (!strcmp(end, "s") || !strcmp(end, "")) unit = 1e9;
+	else if (!strcmp(end, "m")) unit = 60 * 1e9;
+	else if (!strcmp(end, "h")) unit = 3600 * 1e9;
+	else return 1;
+
+	*ns = (uint64_t) (n * unit);
+	return 0;
+}
+
+/**
+ * reads an io scheduling class: `idle`, or `be` with an
+ * optional level from 0 (highest) to 7. `be` alone is level 4
+ */
+int ArgumentsParseIoPriority(const char * arg, int * prio) {
+	if (!arg || !prio) return 1;
+
+	if (!strcmp(arg, "idle")) {
+		*prio = IO_PRIORITY_VALUE(IO_PRIORITY_CLASS_IDLE, 0);
+	} else if (!strcmp(arg, "be")) {
+		*prio = IO_PRIORITY_VALUE(IO_PRIORITY_CLASS_BE, 4);
+	} else if (!strncmp(arg, "be", 2) && (arg[2] >= '0') && (arg[2] <= '7') && !arg[3]) {
+		*prio = IO_PRIORITY_VALUE(IO_PRIORITY_CLASS_BE, arg[2] - '0');
+	} else {
 		return 1;
-	} else if (paths->arraydir && ArraySort(paths->arraydir, paths->sizedir)) {
-		printf("error: failed to sort dir array\n");
+	}
+
+	return 0;
+}
+
+/**
+ * reads a size format: `bytes`, `si`, `iec`, or a fixed unit
+ * like `k`, `m`, `g` (powers of 1024) or `kb`, `mb`, `gb`
+ * (powers of 1000)
+ */
+int ArgumentsParseSizeFormat(const char * arg, SizeFormat * format) {
+	if (!arg || !format) return 1;
+
+	if (!strcmp(arg, "bytes")) {
+		format->kind = SIZE_FORMAT_BYTES;
+		return 0;
+	} else if (!strcmp(arg, "si")) {
+		format->kind = SIZE_FORMAT_SI;
+		return 0;
+	} else if (!strcmp(arg, "iec")) {
+		format->kind = SIZE_FORMAT_IEC;
+		return 0;
+	}
+
+	const char * units = "kmgtpe";
+	const char * u = arg[0] ? strchr(units, tolower((unsigned char) arg[0])) : NULL;
+	if (!u) return 1;
+
+	format->unit = (unsigned int) (u - units) + 1;
+	if (!arg[1] || (!strcasecmp(arg + 1, "ib"))) {
+		format->kind = SIZE_FORMAT_FIXED_IEC;
+	} else if (!strcasecmp(arg + 1, "b")) {
+		format->kind = SIZE_FORMAT_FIXED_SI;
+	} else {
 		return 1;
 	}
 
@@ -421,23 +1167,162 @@ int ArgumentsRead(int argc, char * argv[], Arguments * args) {
 		return 1;
 	}
 
+	args->queuememory = QUEUE_MEMORY_DEFAULT;
+
 	for (int i = 1; i < argc; i++) {
 		if (!strcmp(argv[i], ARG_BRIEF_DESCRIPTION)) {
 			args->briefDescription = true;
 
-		// if the first arg are flags
-		} else if ((i == 1) && (argv[i][0] == '-')) {
-			if (ArgumentsReadFlagsFromArg(argv[i], args)) {
-				printf("error: couldn't read flags provided %s\n", argv[i]);
-				return 1;
-			}
-		} else {
-			if (PathListAddPath(&args->paths, argv[i])) {
-				printf("error: couldn't add path %s\n", argv[i]);
-				return 1;
-			}
-		}
-	}
+		} else if (!strcmp(argv[i], ARG_PROGRESS)) {
+			args->progress = true;
+
+		} else if (!strcmp(argv[i], ARG_DUPLICATES)) {
+			args->duplicates = true;
+
+		} else if (!strcmp(argv[i], ARG_CHECKSUM)) {
+			args->checksum = true;
+
+		} else if (!strcmp(argv[i], ARG_LINES)) {
+			args->lines = true;
+
+		} else if (!strcmp(argv[i], ARG_CONTENT_TYPE)) {
+			args->contenttype = true;
+
+		} else if (!strcmp(argv[i], ARG_ALLOCATED)) {
+			args->allocated = true;
+
+		} else if (!strcmp(argv[i], ARG_HOLES)) {
+			args->holes = true;
+
+		} else if (!strcmp(argv[i], ARG_XATTRS)) {
+			args->xattrs = true;
+
+		} else if (!strcmp(argv[i], ARG_ACL)) {
+			args->acl = true;
+
+		} else if (!strcmp(argv[i], ARG_LABEL)) {
+			args->label = true;
+
+		} else if (!strcmp(argv[i], ARG_NSS_FILES)) {
+			args->nssfiles = true;
+
+		} else if (!strcmp(argv[i], ARG_PATHS)) {
+			args->fullpaths = true;
+
+		} else if (!strcmp(argv[i], ARG_NULL)) {
+			args->fullpaths = true;
+			args->nul = true;
+
+		} else if (!strcmp(argv[i], ARG_SIZE_FORMAT)) {
+			if ((i + 1 >= argc) || ArgumentsParseSizeFormat(argv[++i], &args->sizeformat)) {
+				printf("error: %s needs bytes, si, iec or a unit like k, m, g or kb, mb, gb\n", ARG_SIZE_FORMAT);
+				return 1;
+			}
+
+		} else if (!strcmp(argv[i], ARG_COLORS)) {
+			if (i + 1 >= argc) {
+				printf("error: %s needs a file\n", ARG_COLORS);
+				return 1;
+			}
+			args->colors = argv[++i];
+
+		} else if (!strcmp(argv[i], ARG_SNAPSHOT)) {
+			if (i + 1 >= argc) {
+				printf("error: %s needs a file\n", ARG_SNAPSHOT);
+				return 1;
+			}
+			args->snapshot = argv[++i];
+
+		} else if (!strcmp(argv[i], ARG_COMPARE)) {
+			if (i + 2 >= argc) {
+				printf("error: %s needs two snapshot files\n", ARG_COMPARE);
+				return 1;
+			}
+			args->compare[0] = argv[++i];
+			args->compare[1] = argv[++i];
+
+		} else if (!strcmp(argv[i], ARG_THREADS)) {
+			size_t n = 0;
+			if ((i + 1 >= argc) || ArgumentsParseCount(argv[++i], 1024, &n)) {
+				printf("error: %s needs a thread count between 0 and 1024\n", ARG_THREADS);
+				return 1;
+			}
+			args->threads = (unsigned int) n;
+
+		} else if (!strcmp(argv[i], ARG_STAT_THREADS)) {
+			size_t n = 0;
+			if ((i + 1 >= argc) || ArgumentsParseCount(argv[++i], 1024, &n) || !n) {
+				printf("error: %s needs a thread count between 1 and 1024\n", ARG_STAT_THREADS);
+				return 1;
+			}
+			args->statthreads = (unsigned int) n;
+
+		} else if (!strcmp(argv[i], ARG_TIMEOUT)) {
+			if ((i + 1 >= argc) || ArgumentsParseDuration(argv[++i], &args->timeout) || !args->timeout) {
+				printf("error: %s needs a duration, i.e. 500ms, 2s or 1m\n", ARG_TIMEOUT);
+				return 1;
+			}
+
+		} else if (!strcmp(argv[i], ARG_MAX_ENTRIES)) {
+			size_t n = 0;
+			if ((i + 1 >= argc) || ArgumentsParseCount(argv[++i], SIZE_MAX, &n) || !n) {
+				printf("error: %s needs a number of entries\n", ARG_MAX_ENTRIES);
+				return 1;
+			}
+			args->maxentries = n;
+
+		} else if (!strcmp(argv[i], ARG_CHECKPOINT) || !strcmp(argv[i], ARG_RESUME)) {
+			const char * opt = argv[i];
+			if (i + 1 >= argc) {
+				printf("error: %s needs a file\n", opt);
+				return 1;
+			} else if (!strcmp(opt, ARG_CHECKPOINT)) {
+				args->checkpoint = argv[++i];
+			} else {
+				args->resume = argv[++i];
+			}
+
+		} else if (!strcmp(argv[i], ARG_IO_PRIORITY)) {
+			if ((i + 1 >= argc) || ArgumentsParseIoPriority(argv[++i], &args->ioprio)) {
+				printf("error: %s needs idle or be0 through be7\n", ARG_IO_PRIORITY);
+				return 1;
+			}
+
+		} else if (!strcmp(argv[i], ARG_MAX_STAT_RATE)) {
+			size_t n = 0;
+			if ((i + 1 >= argc) || ArgumentsParseCount(argv[++i], SIZE_MAX, &n) || !n) {
+				printf("error: %s needs a number of stats per second\n", ARG_MAX_STAT_RATE);
+				return 1;
+			}
+			args->maxstatrate = n;
+
+		} else if (!strcmp(argv[i], ARG_MAX_DIR_READS)) {
+			size_t n = 0;
+			if ((i + 1 >= argc) || ArgumentsParseCount(argv[++i], UINT_MAX, &n) || !n) {
+				printf("error: %s needs a number of directories\n", ARG_MAX_DIR_READS);
+				return 1;
+			}
+			args->maxdirreads = (unsigned int) n;
+
+		} else if (!strcmp(argv[i], ARG_QUEUE_MEMORY)) {
+			if ((i + 1 >= argc) || ArgumentsParseSize(argv[++i], &args->queuememory)) {
+				printf("error: %s needs a size, i.e. 512K, 64M or 1G\n", ARG_QUEUE_MEMORY);
+				return 1;
+			}
+
+		// if the first arg are flags
+		} else if ((i == 1) && (argv[i][0] == '-')) {
+			if (ArgumentsReadFlagsFromArg(argv[i], args)) {
+				printf("error: couldn't read flags provided %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			if (PathListAddPath(&args->paths, argv[i])) {
+				printf("error: couldn't add path %s\n", argv[i]);
+				return 1;
+			}
+		}
+	}
 
 	// if no path was provided by user, we will
 	// assume they want information from the current
@@ -449,6 +1334,14 @@ int ArgumentsRead(int argc, char * argv[], Arguments * args) {
 		}
 	}
 
+	if (args->checkpoint && args->resume) {
+		printf("error: %s and %s can't be used together\n", ARG_CHECKPOINT, ARG_RESUME);
+		return 1;
+	} else if ((args->duplicates || args->snapshot || args->compare[0]) && (args->checkpoint || args->resume)) {
+		printf("error: only listings can be checkpointed\n");
+		return 1;
+	}
+
 	return PathListSort(&args->paths);
 }
 
@@ -478,427 +1371,7179 @@ const char * StatModeTypeGetStringDescription(const char modtype) {
 	}
 }
 
+static size_t IdTableHash(dev_t dev, ino_t ino) {
+	uint64_t h = ((uint64_t) dev * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) ino;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return (size_t) h;
+}
+
+static struct IdTableEntry * IdTableFind(const IdTable * t, dev_t dev, ino_t ino) {
+	size_t mask = t->cap - 1;
+	size_t i = IdTableHash(dev, ino) & mask;
+	while (t->array[i].value) {
+		if (t->array[i].dev == dev && t->array[i].ino == ino)
+			break;
+		i = (i + 1) & mask;
+	}
+	return &t->array[i];
+}
+
+static int IdTableGrow(IdTable * t) {
+	IdTable n;
+	n.size = t->size;
+	n.cap = t->cap ? t->cap * 2 : 64;
+	n.array = calloc(n.cap, sizeof(struct IdTableEntry));
+	if (!n.array) return 1;
+
+	for (size_t i = 0; i < t->cap; i++) {
+		if (t->array[i].value)
+			*IdTableFind(&n, t->array[i].dev, t->array[i].ino) = t->array[i];
+	}
+
+	free(t->array);
+	*t = n;
+	return 0;
+}
+
 /**
- * buf : buffer that will hold date
- * bufsize : size of the buf
+ * returns value stored for (dev, ino) or null
  */
-int TimeGetString(const BFTime time, char * buf, size_t bufsize) {
-	if (!buf)
+void * IdTableGet(const IdTable * t, dev_t dev, ino_t ino) {
+	if (!t || !t->size) return NULL;
+	return IdTableFind(t, dev, ino)->value;
+}
+
+/**
+ * stores value for (dev, ino), replacing what was there
+ *
+ * value : must not be null
+ */
+int IdTableSet(IdTable * t, dev_t dev, ino_t ino, void * value) {
+	if (!t || !value) return 1;
+
+	// keep load factor under 1/2
+	if (((t->size + 1) * 2 > t->cap) && IdTableGrow(t))
 		return 1;
 
-	BFDateTime dt;
-	BFTimeGetDateTimeLocal(time, &dt);
+	struct IdTableEntry * e = IdTableFind(t, dev, ino);
+	if (!e->value)
+		t->size++;
+
+	e->dev = dev;
+	e->ino = ino;
+	e->value = value;
 
-	snprintf(buf, bufsize, "%02d/%02d/%02d - %02d:%02d:%02d", dt.month, dt.day, dt.year,
-			dt.hour, dt.minute, dt.second);
 	return 0;
 }
 
-const char * StatGetModeTypeColor(struct stat * st) {
-	switch (st->st_mode & S_IFMT) {
-	case S_IFBLK:	return ANSI_COLOR_RED; // STAT_MOD_TYPE_BDEV;
-	case S_IFCHR:	return ANSI_COLOR_RED; // STAT_MOD_TYPE_CDEV;
-	case S_IFDIR:	return ANSI_COLOR_MAGENTA; // STAT_MOD_TYPE_DIR;
-	case S_IFIFO:	return ANSI_COLOR_RED; // STAT_MOD_TYPE_FIFO;
-	case S_IFLNK:	return ANSI_COLOR_CYAN; // STAT_MOD_TYPE_SYMLINK;
-	case S_IFREG:	return ANSI_COLOR_GREEN; // STAT_MOD_TYPE_FILE;
-	case S_IFSOCK: 	return ANSI_COLOR_RED; // STAT_MOD_TYPE_SOCKET;
-	default: 		return ANSI_COLOR_GREEN; // STAT_MOD_TYPE_UNKNOWN;
+/**
+ * release : called for every value, can be null
+ */
+int IdTableRelease(IdTable * t, void (* release)(void *)) {
+	if (!t) return 1;
+
+	for (size_t i = 0; release && (i < t->cap); i++) {
+		if (t->array[i].value)
+			release(t->array[i].value);
 	}
+	BFFree(t->array);
+	memset(t, 0, sizeof(IdTable));
+
+	return 0;
 }
 
-// assumes out has at least PATH_MAX of bytes
-// to write to
-int GetPrintablePath(const PathQuery * in, char * out, const Arguments * args) {
-	if (!in || !out)
-		return 1;
+int OutputBufferReserve(OutputBuffer * b, size_t len) {
+	if (!b) return 1;
+	else if (b->size + len <= b->cap) return 0;
 
-	char buf[PATH_MAX];
-	if (PathQueryGetPath(in, buf)) {
-		printf("error: couldn't get path\n");
+	size_t cap = b->cap ? b->cap : 4096;
+	while (cap < b->size + len) cap *= 2;
+
+	char * data = realloc(b->data, cap);
+	if (!data) return 1;
+
+	b->data = data;
+	b->cap = cap;
+
+	return 0;
+}
+
+int OutputBufferWrite(OutputBuffer * b, const char * data, size_t len) {
+	if (!b || !data) return 1;
+	else if (OutputBufferReserve(b, len)) return 1;
+
+	memcpy(b->data + b->size, data, len);
+	b->size += len;
+
+	return 0;
+}
+
+__attribute__((format(printf, 2, 3)))
+int OutputBufferPrintf(OutputBuffer * b, const char * format, ...) {
+	if (!b || !format) return 1;
+
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(b->data + b->size, b->cap - b->size, format, ap);
+	va_end(ap);
+
+	if (len < 0) return 1;
+
+	// didn't fit, grow and do it again
+	if (b->size + len >= b->cap) {
+		if (OutputBufferReserve(b, len + 1)) return 1;
+
+		va_start(ap, format);
+		vsnprintf(b->data + b->size, b->cap - b->size, format, ap);
+		va_end(ap);
+	}
+
+	b->size += len;
+
+	return 0;
+}
+
+/**
+ * writes everything buffered to `f` and empties the buffer
+ */
+int OutputBufferFlush(OutputBuffer * b, FILE * f) {
+	if (!b || !f) return 1;
+
+	if (b->size && (fwrite(b->data, 1, b->size, f) != b->size))
 		return 1;
+	b->size = 0;
+
+	return 0;
+}
+
+int OutputBufferRelease(OutputBuffer * b) {
+	if (!b) return 1;
+
+	BFFree(b->data);
+	memset(b, 0, sizeof(OutputBuffer));
+
+	return 0;
+}
+
+/**
+ * writes finished output to stdout on a thread of its own
+ *
+ * the sequential listing hands buffers over here so writing
+ * one overlaps reading and formatting the next. At most
+ * OUTPUT_WRITER_DEPTH buffers wait, then the listing does
+ */
+typedef struct {
+	OutputBuffer slots[OUTPUT_WRITER_DEPTH];
+	size_t head;
+	size_t count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool running;
+	bool closed;
+} OutputWriter;
+
+static OutputWriter outputWriter = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+void * OutputWriterRun(void * ctx) {
+	OutputWriter * w = (OutputWriter *) ctx;
+
+	pthread_mutex_lock(&w->lock);
+	while (true) {
+		while (!w->count && !w->closed)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (!w->count)
+			break;
+
+		// the slot stays counted, so nobody refills it while
+		// we write from it
+		OutputBuffer * b = &w->slots[w->head];
+		pthread_mutex_unlock(&w->lock);
+
+		OutputBufferFlush(b, stdout);
+
+		pthread_mutex_lock(&w->lock);
+		w->head = (w->head + 1) % OUTPUT_WRITER_DEPTH;
+		w->count--;
+		pthread_cond_broadcast(&w->cond);
 	}
+	pthread_mutex_unlock(&w->lock);
 
-	// if a path query doesn't have any parents, we can
-	// assume the user explicitly provided this path.
-	// Therefore we will return the entire (relative/absolute)
-	// path
-	if (PathQueryGetLevel(in) > 0) {
-		const char * tmp = basename(buf);
-		strncpy(out, tmp, PATH_MAX);
+	return NULL;
+}
+
+/**
+ * starts the writer thread. Without one, OutputWriterSubmit()
+ * writes in the calling thread
+ */
+int OutputWriterStart(OutputWriter * w) {
+	if (!w) return 1;
+
+	w->head = 0;
+	w->count = 0;
+	w->closed = false;
+	w->running = !pthread_create(&w->thread, NULL, OutputWriterRun, w);
+
+	return 0;
+}
+
+/**
+ * queues what is in `b` to be written and leaves `b` empty
+ *
+ * the buffer is swapped with one the writer is done with, so
+ * their memory goes around instead of being freed
+ */
+int OutputWriterSubmit(OutputWriter * w, OutputBuffer * b) {
+	if (!w || !b) return 1;
+	else if (!b->size) return 0;
+	else if (!w->running) return OutputBufferFlush(b, stdout);
+
+	pthread_mutex_lock(&w->lock);
+	while (w->count == OUTPUT_WRITER_DEPTH)
+		pthread_cond_wait(&w->cond, &w->lock);
+
+	OutputBuffer * slot = &w->slots[(w->head + w->count) % OUTPUT_WRITER_DEPTH];
+	OutputBuffer spare = *slot;
+	*slot = *b;
+	*b = spare;
+	b->size = 0;
+
+	w->count++;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	return 0;
+}
+
+/**
+ * returns once everything submitted is written and flushed
+ */
+int OutputWriterDrain(OutputWriter * w) {
+	if (!w) return 1;
+
+	if (w->running) {
+		pthread_mutex_lock(&w->lock);
+		while (w->count)
+			pthread_cond_wait(&w->cond, &w->lock);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return fflush(stdout);
+}
+
+/**
+ * drains and stops the writer thread
+ */
+int OutputWriterStop(OutputWriter * w) {
+	if (!w) return 1;
+
+	OutputWriterDrain(w);
+	if (w->running) {
+		pthread_mutex_lock(&w->lock);
+		w->closed = true;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+
+		pthread_join(w->thread, NULL);
+		w->running = false;
+	}
+
+	for (size_t i = 0; i < OUTPUT_WRITER_DEPTH; i++) {
+		OutputBufferRelease(&w->slots[i]);
+	}
+
+	return 0;
+}
+
+#define HASH64_PRIME_1 0x9E3779B185EBCA87ULL
+#define HASH64_PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define HASH64_PRIME_3 0x165667B19E3779F9ULL
+#define HASH64_PRIME_4 0x85EBCA77C2B2AE63ULL
+#define HASH64_PRIME_5 0x27D4EB2F165667C5ULL
+
+/**
+ * streaming xxHash64
+ *
+ * four independent lanes over 32 byte stripes, which the
+ * compiler can keep in registers and vectorize
+ */
+typedef struct {
+	uint64_t lanes[4];
+	uint64_t total;
+	unsigned char mem[32];
+	size_t memsize;
+} Hash64;
+
+static inline uint64_t Hash64Rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t Hash64Read64(const unsigned char * p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t Hash64Read32(const unsigned char * p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t Hash64Round(uint64_t acc, uint64_t input) {
+	acc += input * HASH64_PRIME_2;
+	acc = Hash64Rotl(acc, 31);
+	return acc * HASH64_PRIME_1;
+}
+
+static inline uint64_t Hash64MergeRound(uint64_t acc, uint64_t val) {
+	acc ^= Hash64Round(0, val);
+	return (acc * HASH64_PRIME_1) + HASH64_PRIME_4;
+}
+
+void Hash64Init(Hash64 * h, uint64_t seed) {
+	memset(h, 0, sizeof(Hash64));
+	h->lanes[0] = seed + HASH64_PRIME_1 + HASH64_PRIME_2;
+	h->lanes[1] = seed + HASH64_PRIME_2;
+	h->lanes[2] = seed;
+	h->lanes[3] = seed - HASH64_PRIME_1;
+}
+
+static void Hash64Stripe(Hash64 * h, const unsigned char * p) {
+	h->lanes[0] = Hash64Round(h->lanes[0], Hash64Read64(p));
+	h->lanes[1] = Hash64Round(h->lanes[1], Hash64Read64(p + 8));
+	h->lanes[2] = Hash64Round(h->lanes[2], Hash64Read64(p + 16));
+	h->lanes[3] = Hash64Round(h->lanes[3], Hash64Read64(p + 24));
+}
+
+void Hash64Update(Hash64 * h, const void * data, size_t len) {
+	const unsigned char * p = (const unsigned char *) data;
+	h->total += len;
+
+	if (h->memsize + len < 32) {
+		memcpy(h->mem + h->memsize, p, len);
+		h->memsize += len;
+		return;
+	}
+
+	if (h->memsize) {
+		size_t fill = 32 - h->memsize;
+		memcpy(h->mem + h->memsize, p, fill);
+		Hash64Stripe(h, h->mem);
+		p += fill;
+		len -= fill;
+		h->memsize = 0;
+	}
+
+	for (; len >= 32; p += 32, len -= 32) {
+		Hash64Stripe(h, p);
+	}
+
+	memcpy(h->mem, p, len);
+	h->memsize = len;
+}
+
+uint64_t Hash64Digest(const Hash64 * h) {
+	uint64_t acc;
+	if (h->total >= 32) {
+		acc = Hash64Rotl(h->lanes[0], 1) + Hash64Rotl(h->lanes[1], 7) +
+			Hash64Rotl(h->lanes[2], 12) + Hash64Rotl(h->lanes[3], 18);
+		for (int i = 0; i < 4; i++)
+			acc = Hash64MergeRound(acc, h->lanes[i]);
 	} else {
-		if (RemoveLeadingPeriodAndForwardSlashes(buf)) {
-			printf("error: couldn't remove \"./\" from path '%s'\n", buf);
-			return 1;
-		}
-		strncpy(out, buf, PATH_MAX);
+		// no stripe was taken, lane 2 still holds the seed
+		acc = h->lanes[2] + HASH64_PRIME_5;
+	}
+	acc += h->total;
+
+	const unsigned char * p = h->mem;
+	size_t len = h->memsize;
+	for (; len >= 8; p += 8, len -= 8) {
+		acc ^= Hash64Round(0, Hash64Read64(p));
+		acc = (Hash64Rotl(acc, 27) * HASH64_PRIME_1) + HASH64_PRIME_4;
 	}
+	if (len >= 4) {
+		acc ^= (uint64_t) Hash64Read32(p) * HASH64_PRIME_1;
+		acc = (Hash64Rotl(acc, 23) * HASH64_PRIME_2) + HASH64_PRIME_3;
+		p += 4;
+		len -= 4;
+	}
+	for (; len; p++, len--) {
+		acc ^= (*p) * HASH64_PRIME_5;
+		acc = Hash64Rotl(acc, 11) * HASH64_PRIME_1;
+	}
+
+	acc ^= acc >> 33;
+	acc *= HASH64_PRIME_2;
+	acc ^= acc >> 29;
+	acc *= HASH64_PRIME_3;
+	acc ^= acc >> 32;
+
+	return acc;
+}
 
+/**
+ * hashes `len` bytes of `fd` starting at `offset`, reading
+ * `bufsize` bytes at a time
+ *
+ * returns an errno
+ */
+int Hash64ReadFile(int fd, off_t offset, off_t len, Hash64 * h, char * buf, size_t bufsize) {
+	while (len > 0) {
+		size_t want = len < (off_t) bufsize ? (size_t) len : bufsize;
+		ssize_t n = pread(fd, buf, want, offset);
+		if ((n == -1) && (errno == EINTR)) {
+			continue;
+		} else if (n <= 0) {
+			// the file shrank or can't be read
+			return n == 0 ? EIO : errno;
+		}
 
+		Hash64Update(h, buf, n);
+		offset += n;
+		len -= n;
+	}
 	return 0;
 }
 
-int PathQueryPrintPathBrief(
-	const char * path,
-	const char modetype,
-	const mode_t m, 
-	BFTime modtime,
-	const char * sizebuf,
-	const char * color,
-	const char * linkdesc
-) {
-	char dt[64];
-	TimeGetString(modtime, dt, sizeof(dt));
+uint64_t TimeGetMonotonicNanoseconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t StatGetModifiedNanoseconds(const struct stat * st) {
+#ifdef LINUX
+	return ((uint64_t) st->st_mtim.tv_sec * 1000000000ULL) + st->st_mtim.tv_nsec;
+#else
+	return ((uint64_t) st->st_mtimespec.tv_sec * 1000000000ULL) + st->st_mtimespec.tv_nsec;
+#endif
+}
+
+static uint64_t StatGetChangedNanoseconds(const struct stat * st) {
+#ifdef LINUX
+	return ((uint64_t) st->st_ctim.tv_sec * 1000000000ULL) + st->st_ctim.tv_nsec;
+#else
+	return ((uint64_t) st->st_ctimespec.tv_sec * 1000000000ULL) + st->st_ctimespec.tv_nsec;
+#endif
+}
+
+/**
+ * reads the digest cached on `path` if it was made from the
+ * file as `st` describes it
+ *
+ * the cache is "<digest> <size> <mtime ns> <ctime ns> <window ns>"
+ * in the CHECKSUM_XATTR attribute. See ChecksumCacheSet() for
+ * the last two
+ */
+bool ChecksumCacheGet(const char * path, const struct stat * st, uint64_t * digest) {
+	char value[128];
+#ifdef LINUX
+	ssize_t len = getxattr(path, CHECKSUM_XATTR, value, sizeof(value) - 1);
+#else
+	ssize_t len = getxattr(path, CHECKSUM_XATTR, value, sizeof(value) - 1, 0, 0);
+#endif
+	if (len <= 0) return false;
+	value[len] = '\0';
+
+	uint64_t d, size, mtime, ctime, window;
+	if (sscanf(value, "%" SCNx64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+		&d, &size, &mtime, &ctime, &window) != 5)
+		return false;
+
+	// only our own last write may have moved ctime past the stamp
+	uint64_t now = StatGetChangedNanoseconds(st);
+	if ((size != (uint64_t) st->st_size) || (mtime != StatGetModifiedNanoseconds(st)) ||
+		!ctime || (now < ctime) || (now - ctime > window))
+		return false;
+
+	*digest = d;
+	return true;
+}
+
+static int ChecksumCacheWrite(int fd, const struct stat * st, uint64_t digest, uint64_t ctime, uint64_t window) {
+	char value[128];
+	int len = snprintf(value, sizeof(value), "%016" PRIx64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64,
+		digest, (uint64_t) st->st_size, StatGetModifiedNanoseconds(st), ctime, window);
+
+#ifdef LINUX
+	return fsetxattr(fd, CHECKSUM_XATTR, value, len, 0);
+#else
+	return fsetxattr(fd, CHECKSUM_XATTR, value, len, 0, 0);
+#endif
+}
+
+/**
+ * caches `digest` on the file open at `fd`. Failing is fine,
+ * the file is just read again next time
+ *
+ * writing the attribute changes ctime, so it is stamped in two
+ * steps. The first write has no stamp and gets a ctime from the
+ * kernel (the server, on NFS), which fstat reads back. The second
+ * write stores that ctime, so no local clock is involved.
+ *
+ * the second write moves ctime once more. The window covers that:
+ * twice as long as the first write and fstat took, plus one tick
+ * for kernels that keep coarse timestamps. Changes any later
+ * than that miss the cache
+ */
+void ChecksumCacheSet(int fd, const struct stat * st, uint64_t digest) {
+	// a ctime that has been read gets a fine grained update on
+	// kernels with multigrain timestamps, keeping the two close
+	struct stat now;
+	if (fstat(fd, &now))
+		return;
+
+	uint64_t start = TimeGetMonotonicNanoseconds();
+	if (ChecksumCacheWrite(fd, st, digest, 0, 0) || fstat(fd, &now))
+		return;
+	uint64_t window = 2 * (TimeGetMonotonicNanoseconds() - start);
+
+#ifdef LINUX
+	struct timespec tick;
+	if (!clock_getres(CLOCK_REALTIME_COARSE, &tick))
+		window += ((uint64_t) tick.tv_sec * 1000000000ULL) + tick.tv_nsec;
+#endif
+
+	ChecksumCacheWrite(fd, st, digest, StatGetChangedNanoseconds(&now), window);
+}
+
+/**
+ * opens `path` for reading without touching its access
+ * time where we are allowed to
+ */
+int FileOpenNoAccessTime(const char * path) {
+	int fd = -1;
+#ifdef LINUX
+	// only allowed on files we own
+	fd = open(path, O_RDONLY | O_NOATIME);
+	if ((fd == -1) && (errno == EPERM))
+#endif
+		fd = open(path, O_RDONLY);
+	return fd;
+}
+
+/**
+ * opens `path` to be read start to end
+ */
+int FileOpenSequential(const char * path) {
+	int fd = FileOpenNoAccessTime(path);
+
+#ifdef LINUX
+	if (fd != -1)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	return fd;
+}
+
+/**
+ * gets the xxHash64 of the regular file at `path`, from its
+ * cache attribute when the file hasn't changed since
+ *
+ * returns an errno
+ */
+int FileGetChecksum(const char * path, const struct stat * st, uint64_t * digest) {
+	if (!path || !st || !digest) return EINVAL;
+	else if (ChecksumCacheGet(path, st, digest)) return 0;
+
+	int fd = FileOpenSequential(path);
+	if (fd == -1) return errno;
+
+	char * buf = malloc(HASH_READ_SIZE);
+	if (!buf) {
+		close(fd);
+		return ENOMEM;
+	}
+
+	Hash64 h;
+	Hash64Init(&h, 0);
+	int error = Hash64ReadFile(fd, 0, st->st_size, &h, buf, HASH_READ_SIZE);
+	BFFree(buf);
+
+	if (!error) {
+		*digest = Hash64Digest(&h);
+
+		// don't cache a digest of a file that changed while we read it
+		struct stat now;
+		if (!fstat(fd, &now) && (now.st_size == st->st_size) &&
+			(StatGetModifiedNanoseconds(&now) == StatGetModifiedNanoseconds(st)) &&
+			(StatGetChangedNanoseconds(&now) == StatGetChangedNanoseconds(st)))
+			ChecksumCacheSet(fd, st, *digest);
+	}
+	close(fd);
+
+	return error;
+}
+
+/**
+ * running count of lines in a stream of bytes
+ *
+ * lines is the number of newlines, same as `wc -l`. A line is
+ * empty when its newline comes right after another newline or
+ * at the very start
+ */
+typedef struct {
+	uint64_t lines;
+	uint64_t empty;
+	uint64_t size;
+
+	/// last byte we saw was a newline (or we saw nothing yet)
+	unsigned char newline : 1;
+} LineCount;
+
+static void LineCountScalar(LineCount * c, const unsigned char * p, size_t len) {
+	uint64_t lines = 0, empty = 0;
+	bool newline = c->newline;
+	for (size_t i = 0; i < len; i++) {
+		bool nl = p[i] == '\n';
+		lines += nl;
+		empty += nl & newline;
+		newline = nl;
+	}
+	c->lines += lines;
+	c->empty += empty;
+	c->newline = newline;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * compares 16 bytes at a time. A newline is empty when the bit
+ * before it in the mask (carried over between blocks) is also set
+ */
+__attribute__((target("sse2")))
+static void LineCountSSE2(LineCount * c, const unsigned char * p, size_t len) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	uint64_t lines = 0, empty = 0;
+	uint32_t carry = c->newline;
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+		uint32_t m = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		lines += __builtin_popcount(m);
+		empty += __builtin_popcount(m & ((m << 1) | carry));
+		carry = (m >> 15) & 1;
+	}
+
+	c->lines += lines;
+	c->empty += empty;
+	c->newline = carry;
+	LineCountScalar(c, p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void LineCountAVX2(LineCount * c, const unsigned char * p, size_t len) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	uint64_t lines = 0, empty = 0;
+	uint64_t carry = c->newline;
+
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+		uint64_t m = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		lines += __builtin_popcountll(m);
+		empty += __builtin_popcountll(m & ((m << 1) | carry));
+		carry = (m >> 31) & 1;
+	}
+
+	c->lines += lines;
+	c->empty += empty;
+	c->newline = carry;
+	LineCountScalar(c, p + i, len - i);
+}
+
+#endif
+
+typedef void (* LineCountKernel)(LineCount *, const unsigned char *, size_t);
+
+static LineCountKernel lineCountKernel = LineCountScalar;
+static pthread_once_t lineCountKernelOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * picks the widest kernel this cpu can run
+ *
+ * runs once, before the first count on any thread
+ */
+static void LineCountPickKernel(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) lineCountKernel = LineCountAVX2;
+	else if (__builtin_cpu_supports("sse2")) lineCountKernel = LineCountSSE2;
+#endif
+}
+
+void LineCountInit(LineCount * c) {
+	memset(c, 0, sizeof(LineCount));
+	c->newline = true;
+}
+
+void LineCountUpdate(LineCount * c, const void * data, size_t len) {
+	pthread_once(&lineCountKernelOnce, LineCountPickKernel);
+
+	lineCountKernel(c, (const unsigned char *) data, len);
+	c->size += len;
+}
+
+/**
+ * a last line without a newline still counts as non empty
+ */
+uint64_t LineCountGetNonEmpty(const LineCount * c) {
+	uint64_t nonempty = c->lines - c->empty;
+	if (c->size && !c->newline) nonempty++;
+	return nonempty;
+}
+
+/**
+ * counts the lines in the regular file at `path`
+ *
+ * returns an errno
+ */
+int FileGetLineCount(const char * path, const struct stat * st, LineCount * c) {
+	if (!path || !st || !c) return EINVAL;
+
+	LineCountInit(c);
+
+	int fd = FileOpenSequential(path);
+	if (fd == -1) return errno;
+
+	char * buf = malloc(HASH_READ_SIZE);
+	if (!buf) {
+		close(fd);
+		return ENOMEM;
+	}
+
+	int error = 0;
+	for (off_t offset = 0;;) {
+		ssize_t n = pread(fd, buf, HASH_READ_SIZE, offset);
+		if ((n == -1) && (errno == EINTR)) {
+			continue;
+		} else if (n == -1) {
+			error = errno;
+			break;
+		} else if (n == 0) {
+			break;
+		}
+
+		LineCountUpdate(c, buf, n);
+		offset += n;
+	}
+
+	BFFree(buf);
+	close(fd);
+
+	return error;
+}
+
+/**
+ * magic bytes at the start of a file
+ */
+typedef struct {
+	const char * name;
+	const unsigned char bytes[16]; // zero padded
+	size_t len;
+} ContentSignature;
+
+static const ContentSignature contentSignatures[] = {
+	{"elf", "\x7f" "ELF", 4},
+	{"gzip", "\x1f\x8b", 2},
+	{"zstd", "\x28\xb5\x2f\xfd", 4},
+	{"png", "\x89PNG\r\n\x1a\n", 8},
+	{"jpeg", "\xff\xd8\xff", 3},
+	{"pdf", "%PDF-", 5},
+	{"zip", "PK\x03\x04", 4},
+	{"xz", "\xfd" "7zXZ\x00", 6},
+	{"bzip2", "BZh", 3},
+	{"gif", "GIF8", 4},
+	{"macho", "\xcf\xfa\xed\xfe", 4},
+	{"macho", "\xfe\xed\xfa\xcf", 4},
+};
+
+/**
+ * true if the first `len` bytes of `head` are `sig`
+ *
+ * head must have at least 16 readable bytes
+ */
+static inline bool ContentSignatureMatches(const ContentSignature * sig, const unsigned char * head) {
+#if defined(__SSE2__)
+	__m128i a = _mm_loadu_si128((const __m128i *) head);
+	__m128i b = _mm_loadu_si128((const __m128i *) sig->bytes);
+	uint32_t want = (1u << sig->len) - 1;
+	return (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & want) == want;
+#else
+	return !memcmp(head, sig->bytes, sig->len);
+#endif
+}
+
+/**
+ * true if `p` is text: valid utf-8 without control characters
+ * other than whitespace. A sequence cut off at the end of the
+ * buffer is fine since we only read the start of the file
+ *
+ * ascii : set if there were no multibyte sequences
+ */
+static bool ContentIsText(const unsigned char * p, size_t len, bool * ascii) {
+	*ascii = true;
+	for (size_t i = 0; i < len;) {
+		unsigned char c = p[i];
+		if (c < 0x80) {
+			if ((c < 0x20) && (c != '\t') && (c != '\n') && (c != '\r') &&
+				(c != '\f') && (c != '\b') && (c != 0x1b))
+				return false;
+			else if (c == 0x7f)
+				return false;
+			i++;
+			continue;
+		}
+
+		size_t n;
+		if ((c & 0xe0) == 0xc0) n = 2;
+		else if ((c & 0xf0) == 0xe0) n = 3;
+		else if ((c & 0xf8) == 0xf0) n = 4;
+		else return false;
+
+		*ascii = false;
+		for (size_t k = 1; k < n; k++) {
+			if (i + k >= len) return true;
+			else if ((p[i + k] & 0xc0) != 0x80) return false;
+		}
+		i += n;
+	}
+	return true;
+}
+
+/**
+ * names what the first bytes of a file look like
+ *
+ * head must have at least 16 readable bytes, zero filled past `len`
+ */
+const char * ContentTypeSniff(const unsigned char * head, size_t len) {
+	if (len == 0) return "empty";
+
+	for (size_t i = 0; i < sizeof(contentSignatures) / sizeof(contentSignatures[0]); i++) {
+		if ((len >= contentSignatures[i].len) && ContentSignatureMatches(&contentSignatures[i], head))
+			return contentSignatures[i].name;
+	}
+
+	bool ascii;
+	if (ContentIsText(head, len, &ascii))
+		return ascii ? "text" : "utf-8";
+
+	return "binary";
+}
+
+/**
+ * reads the first CONTENT_SNIFF_SIZE bytes of `path` to name its content
+ *
+ * returns an errno
+ */
+int FileGetContentType(const char * path, const char ** type) {
+	if (!path || !type) return EINVAL;
+
+	int fd = FileOpenNoAccessTime(path);
+	if (fd == -1) return errno;
+
+	unsigned char head[CONTENT_SNIFF_SIZE + 16];
+	ssize_t n;
+	while (((n = pread(fd, head, CONTENT_SNIFF_SIZE, 0)) == -1) && (errno == EINTR)) {}
+	int error = n == -1 ? errno : 0;
+	close(fd);
+
+	if (error) return error;
+
+	memset(head + n, 0, sizeof(head) - n);
+	*type = ContentTypeSniff(head, n);
+
+	return 0;
+}
+
+/**
+ * walks the data extents of the file at `path` with SEEK_DATA
+ * and SEEK_HOLE
+ *
+ * extents : runs of data
+ * data : bytes in those runs. the rest of size is holes
+ *
+ * returns an errno
+ */
+int FileGetDataMap(const char * path, off_t size, uint64_t * extents, uint64_t * data) {
+	if (!path || !extents || !data) return EINVAL;
+
+	*extents = 0;
+	*data = 0;
+
+#ifdef SEEK_DATA
+	int fd = FileOpenNoAccessTime(path);
+	if (fd == -1) return errno;
+
+	int error = 0;
+	for (off_t offset = 0; offset < size;) {
+		off_t start = lseek(fd, offset, SEEK_DATA);
+		if (start == -1) {
+			// ENXIO means there is no data past offset
+			error = errno == ENXIO ? 0 : errno;
+			break;
+		}
+
+		off_t end = lseek(fd, start, SEEK_HOLE);
+		if (end == -1) {
+			error = errno;
+			break;
+		}
+
+		(*extents)++;
+		*data += end - start;
+		offset = end;
+	}
+	close(fd);
+
+	return error;
+#else
+	return ENOTSUP;
+#endif
+}
+
+/**
+ * the extended attributes of one entry, fetched only when a
+ * field asks for them
+ *
+ * on linux the entry is opened once with O_PATH and every
+ * call after goes through that fd, so the path is only
+ * resolved once
+ */
+typedef struct {
+	const char * path;
+
+	/// O_PATH fd, -1 until the first call
+	int fd;
+
+	/// older kernels give EBADF for f*xattr on O_PATH fds, but
+	/// the fd's /proc entry works there
+	char procpath[32];
+	bool useproc;
+
+	/// NUL separated names from listxattr, NULL until listed
+	char * names;
+	ssize_t nameslen;
+} XattrHandle;
+
+#define XATTR_ACL_ACCESS "system.posix_acl_access"
+#define XATTR_SELINUX "security.selinux"
+
+void XattrHandleInit(XattrHandle * h, const char * path) {
+	memset(h, 0, sizeof(XattrHandle));
+	h->path = path;
+	h->fd = -1;
+}
+
+void XattrHandleClose(XattrHandle * h) {
+	if (h->fd != -1) close(h->fd);
+	h->fd = -1;
+	BFFree(h->names);
+	h->names = NULL;
+}
+
+/**
+ * returns an errno
+ */
+int XattrHandleOpen(XattrHandle * h) {
+#ifdef LINUX
+	if (h->fd != -1) return 0;
+
+	h->fd = open(h->path, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+	if (h->fd == -1) return errno;
+	snprintf(h->procpath, sizeof(h->procpath), "/proc/self/fd/%d", h->fd);
+#endif
+	return 0;
+}
+
+/**
+ * like getxattr. Returns the size of the value or -1 with errno set
+ */
+ssize_t XattrHandleGet(XattrHandle * h, const char * name, void * value, size_t size) {
+#ifdef LINUX
+	if (XattrHandleOpen(h)) return -1;
+
+	if (!h->useproc) {
+		ssize_t len = fgetxattr(h->fd, name, value, size);
+		if ((len != -1) || (errno != EBADF)) return len;
+		h->useproc = true;
+	}
+
+	// follows the /proc link to the entry itself, even a symlink
+	return getxattr(h->procpath, name, value, size);
+#else
+	return getxattr(h->path, name, value, size, 0, XATTR_NOFOLLOW);
+#endif
+}
+
+ssize_t XattrHandleListRaw(XattrHandle * h, char * names, size_t size) {
+#ifdef LINUX
+	if (XattrHandleOpen(h)) return -1;
+
+	if (!h->useproc) {
+		ssize_t len = flistxattr(h->fd, names, size);
+		if ((len != -1) || (errno != EBADF)) return len;
+		h->useproc = true;
+	}
+
+	return listxattr(h->procpath, names, size);
+#else
+	return listxattr(h->path, names, size, XATTR_NOFOLLOW);
+#endif
+}
+
+/**
+ * fills h->names. Returns an errno
+ */
+int XattrHandleList(XattrHandle * h) {
+	if (h->names) return 0;
+
+	// the list can grow between asking its size and reading it
+	for (int tries = 0; tries < 3; tries++) {
+		ssize_t len = XattrHandleListRaw(h, NULL, 0);
+		if (len == -1) return errno;
+
+		h->names = malloc(len + 1);
+		if (!h->names) return ENOMEM;
+
+		h->nameslen = XattrHandleListRaw(h, h->names, len);
+		if (h->nameslen != -1) {
+			h->names[h->nameslen] = '\0';
+			return 0;
+		}
+
+		int error = errno;
+		BFFree(h->names);
+		h->names = NULL;
+		if (error != ERANGE) return error;
+	}
+
+	return ERANGE;
+}
+
+/**
+ * whether the entry has a POSIX access ACL beyond its mode bits
+ */
+bool XattrHandleHasAcl(XattrHandle * h) {
+#ifdef LINUX
+	return XattrHandleGet(h, XATTR_ACL_ACCESS, NULL, 0) > 0;
+#else
+	return false;
+#endif
+}
+
+/**
+ * copies the SELinux label into `buf`. Returns an errno
+ */
+int XattrHandleGetLabel(XattrHandle * h, char * buf, size_t bufsize) {
+	ssize_t len = XattrHandleGet(h, XATTR_SELINUX, buf, bufsize - 1);
+	if (len == -1) return errno;
+
+	// the kernel may or may not count the terminator
+	buf[len] = '\0';
+	return 0;
+}
+
+/// "00" through "99", so decimals are written two digits at a time
+static const char sizeDigitPairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static const uint64_t sizePowersOf10[20] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+	100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+	10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static const char * sizeUnitsIec[SIZE_UNIT_MAX + 1] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB", "EiB" };
+static const char * sizeUnitsSi[SIZE_UNIT_MAX + 1] = { "B", "kB", "MB", "GB", "TB", "PB", "EB" };
+
+/**
+ * number of decimal digits in `n`
+ *
+ * log2 from clz times log10(2) (1233 / 4096) is either right
+ * or one too many, which the table settles
+ */
+static inline unsigned int SizeGetDigits(uint64_t n) {
+	if (!n) return 1;
+	unsigned int t = ((64 - __builtin_clzll(n)) * 1233) >> 12;
+	return t + 1 - (n < sizePowersOf10[t]);
+}
+
+/**
+ * writes `n` in decimal to `buf` without a terminator. Returns
+ * the number of digits
+ */
+static inline size_t SizeWriteDecimal(char * buf, uint64_t n) {
+	size_t len = SizeGetDigits(n);
+	char * c = buf + len;
+	while (n >= 100) {
+		const char * pair = sizeDigitPairs + ((n % 100) * 2);
+		n /= 100;
+		*--c = pair[1];
+		*--c = pair[0];
+	}
+	if (n >= 10) {
+		*--c = sizeDigitPairs[(n * 2) + 1];
+		*--c = sizeDigitPairs[n * 2];
+	} else {
+		*--c = (char) ('0' + n);
+	}
+
+	return len;
+}
+
+/**
+ * writes `size` into `buf` as `format` says. buf needs
+ * SIZE_STRING_MAX bytes
+ *
+ * everything but the default is integer only. Sizes with a
+ * unit get two decimals, rounded
+ */
+int SizeGetString(uint64_t size, SizeFormat format, char * buf) {
+	if (!buf) return 1;
+
+	if (format.kind == SIZE_FORMAT_DEFAULT)
+		return BFByteGetString(size, 0, buf);
+
+	char * c = buf;
+	if (format.kind == SIZE_FORMAT_BYTES) {
+		c += SizeWriteDecimal(c, size);
+		*c = '\0';
+		return 0;
+	}
+
+	bool iec = (format.kind == SIZE_FORMAT_IEC) || (format.kind == SIZE_FORMAT_FIXED_IEC);
+	unsigned int unit = format.unit;
+	if (format.kind == SIZE_FORMAT_IEC) {
+		unit = size ? (63 - __builtin_clzll(size)) / 10 : 0;
+	} else if (format.kind == SIZE_FORMAT_SI) {
+		unit = (SizeGetDigits(size) - 1) / 3;
+	}
+	if (unit > SIZE_UNIT_MAX) unit = SIZE_UNIT_MAX;
+
+	if (!unit) {
+		c += SizeWriteDecimal(c, size);
+	} else {
+		uint64_t div = iec ? (1ULL << (10 * unit)) : sizePowersOf10[3 * unit];
+		uint64_t whole = size / div, rest = size % div;
+
+		// keep rest * 100 in range. Only the top of the range
+		// loses precision, far past the second decimal
+		if (rest > UINT64_MAX / 100) {
+			rest >>= 10;
+			div >>= 10;
+		}
+
+		uint64_t frac = ((rest * 100) + (div / 2)) / div;
+		if (frac >= 100) {
+			whole++;
+			frac -= 100;
+		}
+
+		c += SizeWriteDecimal(c, whole);
+		*c++ = '.';
+		*c++ = sizeDigitPairs[frac * 2];
+		*c++ = sizeDigitPairs[(frac * 2) + 1];
+	}
+
+	const char * name = iec ? sizeUnitsIec[unit] : sizeUnitsSi[unit];
+	*c++ = ' ';
+	size_t len = strlen(name);
+	memcpy(c, name, len + 1);
+
+	return 0;
+}
+
+/**
+ * buf : buffer that will hold date
+ * bufsize : size of the buf
+ */
+int TimeGetString(const BFTime time, char * buf, size_t bufsize) {
+	if (!buf)
+		return 1;
+
+	BFDateTime dt;
+	BFTimeGetDateTimeLocal(time, &dt);
+
+	snprintf(buf, bufsize, "%02d/%02d/%02d - %02d:%02d:%02d", dt.month, dt.day, dt.year,
+			dt.hour, dt.minute, dt.second);
+	return 0;
+}
+
+const char * StatGetModeTypeColor(struct stat * st) {
+	switch (st->st_mode & S_IFMT) {
+	case S_IFBLK:	return ANSI_COLOR_RED; // STAT_MOD_TYPE_BDEV;
+	case S_IFCHR:	return ANSI_COLOR_RED; // STAT_MOD_TYPE_CDEV;
+	case S_IFDIR:	return ANSI_COLOR_MAGENTA; // STAT_MOD_TYPE_DIR;
+	case S_IFIFO:	return ANSI_COLOR_RED; // STAT_MOD_TYPE_FIFO;
+	case S_IFLNK:	return ANSI_COLOR_CYAN; // STAT_MOD_TYPE_SYMLINK;
+	case S_IFREG:	return ANSI_COLOR_GREEN; // STAT_MOD_TYPE_FILE;
+	case S_IFSOCK: 	return ANSI_COLOR_RED; // STAT_MOD_TYPE_SOCKET;
+	default: 		return ANSI_COLOR_GREEN; // STAT_MOD_TYPE_UNKNOWN;
+	}
+}
+
+/**
+ * classes LS_COLORS can color by. Order matches colorClassKeys
+ */
+typedef enum {
+	COLOR_CLASS_FILE = 0,
+	COLOR_CLASS_DIR,
+	COLOR_CLASS_LINK,
+	COLOR_CLASS_FIFO,
+	COLOR_CLASS_SOCKET,
+	COLOR_CLASS_BDEV,
+	COLOR_CLASS_CDEV,
+	COLOR_CLASS_EXEC,
+	COLOR_CLASS_SETUID,
+	COLOR_CLASS_SETGID,
+	COLOR_CLASS_STICKY,
+	COLOR_CLASS_OTHER_WRITABLE,
+	COLOR_CLASS_STICKY_OTHER_WRITABLE,
+	COLOR_CLASS_COUNT
+} ColorClass;
+
+static const char * colorClassKeys[COLOR_CLASS_COUNT] = {
+	"fi", "di", "ln", "pi", "so", "bd", "cd", "ex", "su", "sg", "st", "ow", "tw"
+};
+
+/// extensions longer than this are only matched as suffixes
+#define COLOR_EXTENSION_MAX 32
+
+/**
+ * colors parsed from LS_COLORS or a --colors file
+ *
+ * built once at startup. "*.ext" patterns go in a hash table
+ * keyed by the lowercased extension so each entry costs one
+ * lookup. Any other "*suffix" pattern is kept in a short list
+ * that is checked first
+ */
+typedef struct {
+	/// escape sequence for each class, NULL to fall back
+	char * classes[COLOR_CLASS_COUNT];
+
+	struct ColorExtension {
+		uint64_t hash;
+		char * ext; // null if slot is empty
+		char * color;
+	} * extensions;
+	size_t size;
+	size_t cap; // always a power of 2
+
+	struct ColorSuffix {
+		char * suffix;
+		size_t len;
+		char * color;
+	} * suffixes;
+	size_t nsuffixes;
+
+	bool loaded;
+} ColorTable;
+
+static ColorTable colorTable = {0};
+
+#define COLORS_ENV "LS_COLORS"
+
+static uint64_t ColorExtensionHash(const char * ext, size_t len) {
+	Hash64 h;
+	Hash64Init(&h, 0);
+	Hash64Update(&h, ext, len);
+	return Hash64Digest(&h);
+}
+
+static struct ColorExtension * ColorTableFindExtension(const ColorTable * t, const char * ext, size_t len) {
+	if (!t->cap) return NULL;
+
+	uint64_t hash = ColorExtensionHash(ext, len);
+	size_t mask = t->cap - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		struct ColorExtension * e = &t->extensions[i];
+		if (!e->ext || ((e->hash == hash) && !strncmp(e->ext, ext, len) && (e->ext[len] == '\0')))
+			return e;
+	}
+}
+
+static int ColorTableGrow(ColorTable * t) {
+	size_t cap = t->cap ? t->cap * 2 : 64;
+	struct ColorExtension * old = t->extensions;
+	size_t oldcap = t->cap;
+
+	t->extensions = calloc(cap, sizeof(struct ColorExtension));
+	if (!t->extensions) {
+		t->extensions = old;
+		return 1;
+	}
+	t->cap = cap;
+
+	for (size_t i = 0; i < oldcap; i++) {
+		if (!old[i].ext) continue;
+		size_t mask = cap - 1, j = old[i].hash & mask;
+		while (t->extensions[j].ext) j = (j + 1) & mask;
+		t->extensions[j] = old[i];
+	}
+	BFFree(old);
+
+	return 0;
+}
+
+void ColorTableRelease(ColorTable * t) {
+	for (int i = 0; i < COLOR_CLASS_COUNT; i++)
+		BFFree(t->classes[i]);
+	for (size_t i = 0; i < t->cap; i++) {
+		BFFree(t->extensions[i].ext);
+		BFFree(t->extensions[i].color);
+	}
+	for (size_t i = 0; i < t->nsuffixes; i++) {
+		BFFree(t->suffixes[i].suffix);
+		BFFree(t->suffixes[i].color);
+	}
+	BFFree(t->extensions);
+	BFFree(t->suffixes);
+	memset(t, 0, sizeof(ColorTable));
+}
+
+/**
+ * turns the "01;34" of LS_COLORS into an escape sequence
+ */
+static char * ColorCreateSequence(const char * value, size_t len) {
+	char * color = malloc(len + 4);
+	if (color) snprintf(color, len + 4, "\x1b[%.*sm", (int) len, value);
+	return color;
+}
+
+static int ColorTableAdd(ColorTable * t, const char * key, size_t keylen, const char * value, size_t valuelen) {
+	// two letter class
+	if (key[0] != '*') {
+		for (int i = 0; i < COLOR_CLASS_COUNT; i++) {
+			if ((keylen == 2) && !strncmp(key, colorClassKeys[i], 2)) {
+				BFFree(t->classes[i]);
+				t->classes[i] = ColorCreateSequence(value, valuelen);
+				return t->classes[i] ? 0 : 1;
+			}
+		}
+
+		// lc, rc, mi, or and the rest don't apply to us
+		return 0;
+	}
+
+	key++;
+	keylen--;
+
+	const char * dot = memchr(key, '.', keylen);
+	bool isext = keylen && (key[0] == '.') && (dot == key) && !memchr(key + 1, '.', keylen - 1) &&
+		(keylen - 1 <= COLOR_EXTENSION_MAX);
+
+	if (!isext) {
+		struct ColorSuffix * s = realloc(t->suffixes, (t->nsuffixes + 1) * sizeof(struct ColorSuffix));
+		if (!s) return 1;
+		t->suffixes = s;
+		s = &t->suffixes[t->nsuffixes];
+		s->suffix = strndup(key, keylen);
+		s->len = keylen;
+		s->color = ColorCreateSequence(value, valuelen);
+		if (!s->suffix || !s->color) {
+			BFFree(s->suffix);
+			BFFree(s->color);
+			return 1;
+		}
+		t->nsuffixes++;
+		return 0;
+	}
+
+	char ext[COLOR_EXTENSION_MAX + 1];
+	size_t len = keylen - 1;
+	for (size_t i = 0; i < len; i++)
+		ext[i] = (char) tolower((unsigned char) key[1 + i]);
+	ext[len] = '\0';
+
+	if (((t->size + 1) * 2 > t->cap) && ColorTableGrow(t))
+		return 1;
+
+	// later patterns replace earlier ones, like ls
+	struct ColorExtension * e = ColorTableFindExtension(t, ext, len);
+	char * color = ColorCreateSequence(value, valuelen);
+	if (!color) return 1;
+	if (e->ext) {
+		BFFree(e->color);
+		e->color = color;
+		return 0;
+	}
+
+	e->ext = strdup(ext);
+	if (!e->ext) {
+		BFFree(color);
+		return 1;
+	}
+	e->hash = ColorExtensionHash(ext, len);
+	e->color = color;
+	t->size++;
+
+	return 0;
+}
+
+/**
+ * parses "key=value" pairs separated by ':' or new lines, the
+ * format of LS_COLORS. Lines starting with '#' are comments
+ */
+int ColorTableParse(ColorTable * t, const char * spec) {
+	if (!t || !spec) return 1;
+
+	for (const char * s = spec; *s;) {
+		size_t len = strcspn(s, ":\n");
+		const char * item = s;
+		s += len;
+		if (*s) s++;
+
+		while (len && isspace((unsigned char) *item)) {
+			item++;
+			len--;
+		}
+		while (len && isspace((unsigned char) item[len - 1])) len--;
+
+		if (!len) continue;
+		if (*item == '#') {
+			// comments run to the end of the line
+			s = item + strcspn(item, "\n");
+			if (*s) s++;
+			continue;
+		}
+
+		const char * eq = memchr(item, '=', len);
+		if (!eq || (eq == item)) continue;
+
+		if (ColorTableAdd(t, item, eq - item, eq + 1, len - (eq - item) - 1)) {
+			printf("error: couldn't add color %.*s\n", (int) len, item);
+			return 1;
+		}
+	}
+
+	t->loaded = true;
+	return 0;
+}
+
+/**
+ * reads colors from `path`, or from LS_COLORS if path is null
+ *
+ * without either the built in colors are used
+ */
+int ColorTableLoad(ColorTable * t, const char * path) {
+	if (!path) {
+		const char * spec = getenv(COLORS_ENV);
+		return (spec && *spec) ? ColorTableParse(t, spec) : 0;
+	}
+
+	FILE * f = fopen(path, "r");
+	if (!f) {
+		printf("error: couldn't open %s: %d\n", path, errno);
+		return 1;
+	}
+
+	OutputBuffer b = {0};
+	char chunk[4096];
+	size_t n;
+	int error = 0;
+	while (!error && (n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+		error = OutputBufferWrite(&b, chunk, n);
+	}
+	error = error || ferror(f) || OutputBufferWrite(&b, "", 1);
+	fclose(f);
+
+	if (error) {
+		printf("error: couldn't read %s\n", path);
+	} else {
+		error = ColorTableParse(t, b.data);
+	}
+	BFFree(b.data);
+
+	return error;
+}
+
+/**
+ * color for the entry `name` described by `st`
+ */
+const char * ColorTableGet(const ColorTable * t, struct stat * st, const char * name) {
+	if (!t->loaded) return StatGetModeTypeColor(st);
+
+	const mode_t mode = st->st_mode;
+	ColorClass c = COLOR_CLASS_FILE;
+	switch (mode & S_IFMT) {
+	case S_IFDIR:
+		if ((mode & S_ISVTX) && (mode & S_IWOTH)) c = COLOR_CLASS_STICKY_OTHER_WRITABLE;
+		else if (mode & S_IWOTH) c = COLOR_CLASS_OTHER_WRITABLE;
+		else if (mode & S_ISVTX) c = COLOR_CLASS_STICKY;
+		else c = COLOR_CLASS_DIR;
+
+		if (t->classes[c]) return t->classes[c];
+		return t->classes[COLOR_CLASS_DIR] ? t->classes[COLOR_CLASS_DIR] : StatGetModeTypeColor(st);
+	case S_IFLNK:	c = COLOR_CLASS_LINK; break;
+	case S_IFIFO:	c = COLOR_CLASS_FIFO; break;
+	case S_IFSOCK:	c = COLOR_CLASS_SOCKET; break;
+	case S_IFBLK:	c = COLOR_CLASS_BDEV; break;
+	case S_IFCHR:	c = COLOR_CLASS_CDEV; break;
+	case S_IFREG:
+		if (mode & S_ISUID) c = COLOR_CLASS_SETUID;
+		else if (mode & S_ISGID) c = COLOR_CLASS_SETGID;
+		else if (mode & (S_IXUSR | S_IXGRP | S_IXOTH)) c = COLOR_CLASS_EXEC;
+
+		if ((c != COLOR_CLASS_FILE) && t->classes[c]) return t->classes[c];
+		c = COLOR_CLASS_FILE;
+		break;
+	default:
+		break;
+	}
+
+	if (c != COLOR_CLASS_FILE) {
+		return t->classes[c] ? t->classes[c] : StatGetModeTypeColor(st);
+	}
+
+	// regular files can also be colored by their name
+	size_t namelen = strlen(name);
+	for (size_t i = 0; i < t->nsuffixes; i++) {
+		const struct ColorSuffix * s = &t->suffixes[i];
+		if ((s->len <= namelen) && !strcmp(name + namelen - s->len, s->suffix))
+			return s->color;
+	}
+
+	const char * dot = strrchr(name, '.');
+	if (dot && t->size) {
+		char ext[COLOR_EXTENSION_MAX + 1];
+		size_t len = namelen - (dot + 1 - name);
+		if (len <= COLOR_EXTENSION_MAX) {
+			for (size_t i = 0; i < len; i++)
+				ext[i] = (char) tolower((unsigned char) dot[1 + i]);
+			ext[len] = '\0';
+
+			const struct ColorExtension * e = ColorTableFindExtension(t, ext, len);
+			if (e->ext) return e->color;
+		}
+	}
+
+	return t->classes[COLOR_CLASS_FILE] ? t->classes[COLOR_CLASS_FILE] : StatGetModeTypeColor(st);
+}
+
+// assumes out has at least PATH_MAX of bytes
+// to write to
+int GetPrintablePath(const PathQuery * in, char * out, const Arguments * args) {
+	if (!in || !out)
+		return 1;
+
+	// if a path query doesn't have any parents, we can
+	// assume the user explicitly provided this path.
+	// Therefore we will return the entire (relative/absolute)
+	// path. Otherwise the leaf is all we need, and we don't
+	// have to build a path that may not fit
+	if (PathQueryGetLevel(in) > 0) {
+		const char * slash = strrchr(in->p, '/');
+		strncpy(out, slash ? slash + 1 : in->p, PATH_MAX);
+	} else {
+		char buf[PATH_MAX];
+		if (PathQueryGetPath(in, buf)) {
+			printf("error: couldn't get path\n");
+			return 1;
+		}
+
+		if (RemoveLeadingPeriodAndForwardSlashes(buf)) {
+			printf("error: couldn't remove \"./\" from path '%s'\n", buf);
+			return 1;
+		}
+		strncpy(out, buf, PATH_MAX);
+	}
+
+
+	return 0;
+}
+
+int PathQueryPrintPathBrief(
+	OutputBuffer * out,
+	const char * path,
+	const char modetype,
+	const mode_t m, 
+	const char * symbolic,
+	BFTime modtime,
+	const char * sizebuf,
+	const char * columns,
+	const char * color,
+	const char * linkdesc
+) {
+	char dt[64];
+	TimeGetString(modtime, dt, sizeof(dt));
+
+	// same cost as the octal, the string is ready made
+	if (symbolic) {
+		return OutputBufferPrintf(out, "| %-1c-%s %-21s %10s %s%s%s%s%s\n", modetype, symbolic, dt, sizebuf,
+				columns,
+				color,
+				path,
+				ANSI_COLOR_RESET,
+				strlen(linkdesc) == 0 ? "" : linkdesc);
+	}
+
+	return OutputBufferPrintf(out, "| %-1c-%03o %-21s %10s %s%s%s%s%s\n", modetype, m, dt, sizebuf,
+			columns,
+			color,
+			path,
+			ANSI_COLOR_RESET,
+			strlen(linkdesc) == 0 ? "" : linkdesc);
+}
+
+/**
+ * assuming permissions follows = ||||||R|W|X|
+ */
+#define PERMISSIONS_TRIAD_0 "---"
+#define PERMISSIONS_TRIAD_1 "--x"
+#define PERMISSIONS_TRIAD_2 "-w-"
+#define PERMISSIONS_TRIAD_3 "-wx"
+#define PERMISSIONS_TRIAD_4 "r--"
+#define PERMISSIONS_TRIAD_5 "r-x"
+#define PERMISSIONS_TRIAD_6 "rw-"
+#define PERMISSIONS_TRIAD_7 "rwx"
+
+#define PERMISSIONS_ENTRY(u, g, o) PERMISSIONS_TRIAD_##u PERMISSIONS_TRIAD_##g PERMISSIONS_TRIAD_##o,
+#define PERMISSIONS_OTHER(u, g) \
+	PERMISSIONS_ENTRY(u, g, 0) PERMISSIONS_ENTRY(u, g, 1) PERMISSIONS_ENTRY(u, g, 2) PERMISSIONS_ENTRY(u, g, 3) \
+	PERMISSIONS_ENTRY(u, g, 4) PERMISSIONS_ENTRY(u, g, 5) PERMISSIONS_ENTRY(u, g, 6) PERMISSIONS_ENTRY(u, g, 7)
+#define PERMISSIONS_GROUP(u) \
+	PERMISSIONS_OTHER(u, 0) PERMISSIONS_OTHER(u, 1) PERMISSIONS_OTHER(u, 2) PERMISSIONS_OTHER(u, 3) \
+	PERMISSIONS_OTHER(u, 4) PERMISSIONS_OTHER(u, 5) PERMISSIONS_OTHER(u, 6) PERMISSIONS_OTHER(u, 7)
+
+/**
+ * "rwxrwxrwx" for every value of the low 9 mode bits, built
+ * by the preprocessor
+ */
+static const char permissionsSymbolic[512][PERMISSIONS_SYMBOLIC_SIZE] = {
+	PERMISSIONS_GROUP(0) PERMISSIONS_GROUP(1) PERMISSIONS_GROUP(2) PERMISSIONS_GROUP(3)
+	PERMISSIONS_GROUP(4) PERMISSIONS_GROUP(5) PERMISSIONS_GROUP(6) PERMISSIONS_GROUP(7)
+};
+
+/**
+ * description of each rwx triad, padded so every entry is
+ * copied with one fixed size store
+ */
+static const char permissionsDescription[8][PERMISSIONS_DESCRIPTION_SIZE] = {
+	"",
+	"Executable",
+	"Writable",
+	"Executable, Writable",
+	"Readable",
+	"Executable, Readable",
+	"Writable, Readable",
+	"Executable, Writable, Readable"
+};
+
+/**
+ * writes `mode` as "rwxr-xr-x" into `buf`, which needs
+ * PERMISSIONS_SYMBOLIC_SIZE bytes. setuid, setgid and sticky
+ * show as s/S and t/T like ls
+ */
+void PermissionsGetSymbolic(const mode_t mode, char * buf) {
+	memcpy(buf, permissionsSymbolic[mode & 0777], PERMISSIONS_SYMBOLIC_SIZE);
+
+	if (mode & S_ISUID) buf[2] = "Ss"[!!(mode & S_IXUSR)];
+	if (mode & S_ISGID) buf[5] = "Ss"[!!(mode & S_IXGRP)];
+	if (mode & S_ISVTX) buf[8] = "Tt"[!!(mode & S_IXOTH)];
+}
+
+int PermissionsGetStringDescription(const mode_t permissions, char * buf, const size_t bufsize) {
+	if (!buf) return 1;
+
+	const char * desc = permissionsDescription[permissions & 07];
+	if (bufsize >= PERMISSIONS_DESCRIPTION_SIZE) {
+		memcpy(buf, desc, PERMISSIONS_DESCRIPTION_SIZE);
+	} else if ((size_t) snprintf(buf, bufsize, "%s", desc) >= bufsize) {
+		return 1;
+	}
+	
+	return 0;
+}
+
+/**
+ * id to name lookup read straight from a passwd or group file
+ *
+ * for hosts where NSS is only `files` this replaces getpwuid
+ * and getgrgid, which reopen and reparse the file each time
+ */
+typedef struct {
+	struct IdName {
+		uint32_t id;
+
+		/// line in the file. the first line with an id wins,
+		/// like the files backend
+		uint32_t line;
+		const char * name;
+	} * array;
+	size_t size;
+
+	/// names, NUL terminated, that array points into
+	char * pool;
+} IdNameTable;
+
+static IdNameTable userNames = {0};
+static IdNameTable groupNames = {0};
+
+int IdNameCompare(const void * a, const void * b) {
+	const struct IdName * x = a;
+	const struct IdName * y = b;
+	if (x->id != y->id) return x->id < y->id ? -1 : 1;
+	return x->line < y->line ? -1 : (x->line > y->line);
+}
+
+void IdNameTableRelease(IdNameTable * t) {
+	BFFree(t->array);
+	BFFree(t->pool);
+	memset(t, 0, sizeof(IdNameTable));
+}
+
+/**
+ * parses `len` bytes of "name:password:id:..." lines. Both
+ * passwd and group keep the id in the third field
+ */
+int IdNameTableParse(IdNameTable * t, const char * data, size_t len) {
+	if (!t || (!data && len)) return 1;
+
+	memset(t, 0, sizeof(IdNameTable));
+
+	// names are never longer than the file itself
+	size_t cap = 0;
+	for (size_t i = 0; i < len; i++)
+		cap += data[i] == '\n';
+	cap++;
+
+	t->pool = malloc(len + 1);
+	t->array = malloc(cap * sizeof(struct IdName));
+	if (!t->pool || !t->array) {
+		IdNameTableRelease(t);
+		return 1;
+	}
+
+	char * pool = t->pool;
+	uint32_t line = 0;
+	for (const char * s = data, * end = data + len; s < end; line++) {
+		const char * eol = memchr(s, '\n', end - s);
+		if (!eol) eol = end;
+
+		const char * name = s;
+		s = eol + 1;
+
+		// comments and nis "+" / "-" lines have no id
+		if ((name == eol) || (*name == '#') || (*name == '+') || (*name == '-'))
+			continue;
+
+		const char * namend = memchr(name, ':', eol - name);
+		if (!namend) continue;
+		const char * field = memchr(namend + 1, ':', eol - namend - 1);
+		if (!field) continue;
+		field++;
+
+		uint64_t id = 0;
+		const char * c = field;
+		for (; (c < eol) && (*c >= '0') && (*c <= '9') && (id <= UINT32_MAX); c++)
+			id = (id * 10) + (*c - '0');
+		if ((c == field) || (id > UINT32_MAX) || ((c < eol) && (*c != ':')))
+			continue;
+
+		size_t n = namend - name;
+		memcpy(pool, name, n);
+		pool[n] = '\0';
+
+		t->array[t->size].id = (uint32_t) id;
+		t->array[t->size].line = line;
+		t->array[t->size].name = pool;
+		t->size++;
+		pool += n + 1;
+	}
+
+	qsort(t->array, t->size, sizeof(struct IdName), IdNameCompare);
+
+	return 0;
+}
+
+/**
+ * maps the file at `path` and parses it with IdNameTableParse()
+ */
+int IdNameTableLoad(IdNameTable * t, const char * path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		printf("error: couldn't open %s: %d\n", path, errno);
+		return 1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		printf("error: couldn't stat %s: %d\n", path, errno);
+		close(fd);
+		return 1;
+	}
+
+	void * data = NULL;
+	if (st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			printf("error: couldn't map %s: %d\n", path, errno);
+			close(fd);
+			return 1;
+		}
+	}
+	close(fd);
+
+	int error = IdNameTableParse(t, data, st.st_size);
+	if (data) munmap(data, st.st_size);
+	if (error) printf("error: couldn't read %s\n", path);
+
+	return error;
+}
+
+/**
+ * returns the name for `id` or NULL
+ */
+const char * IdNameTableFind(const IdNameTable * t, uint32_t id) {
+	// first of the run of equal ids
+	size_t lo = 0, hi = t->size;
+	while (lo < hi) {
+		size_t mid = lo + ((hi - lo) / 2);
+		if (t->array[mid].id < id) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return ((lo < t->size) && (t->array[lo].id == id)) ? t->array[lo].name : NULL;
+}
+
+/**
+ * writes the name of user `uid` into `buf`, or the number if
+ * it has none
+ */
+void UserGetName(const Arguments * args, uid_t uid, char * buf, size_t bufsize) {
+	const char * name = NULL;
+	if (args->nssfiles) {
+		name = IdNameTableFind(&userNames, uid);
+	} else {
+		struct passwd * pw = getpwuid(uid);
+		if (pw) name = pw->pw_name;
+	}
+
+	if (name) snprintf(buf, bufsize, "%s", name);
+	else snprintf(buf, bufsize, "%u", (unsigned) uid);
+}
+
+/**
+ * writes the name of group `gid` into `buf`, or the number if
+ * it has none
+ */
+void GroupGetName(const Arguments * args, gid_t gid, char * buf, size_t bufsize) {
+	const char * name = NULL;
+	if (args->nssfiles) {
+		name = IdNameTableFind(&groupNames, gid);
+	} else {
+		struct group * g = getgrgid(gid);
+		if (g) name = g->gr_name;
+	}
+
+	if (name) snprintf(buf, bufsize, "%s", name);
+	else snprintf(buf, bufsize, "%u", (unsigned) gid);
+}
+
+int PathQueryPrintPathDetail(
+	OutputBuffer * out,
+	const char * path,
+	const char modetype,
+	const mode_t m,
+	BFTime modtime,
+	BFTime accesstime,
+	BFTime changetime,
+	const char * sizebuf,
+	const char * checksum,
+	const char * lines,
+	const char * contenttype,
+	const char * allocated,
+	const char * holes,
+	const Arguments * args,
+	XattrHandle * xattrs,
+	const char * color,
+	const char * linkdesc,
+	const char * fullpath,
+	uid_t owner,
+	gid_t group
+) {
+	char res[2 << 8];
+
+	OutputBufferPrintf(out, "Information for '%s'\n", path);
+	OutputBufferPrintf(out, "-----------------------------\n");
+
+	UserGetName(args, owner, res, sizeof(res));
+	OutputBufferPrintf(out, "Owner: %s\n", res);
+
+	GroupGetName(args, group, res, sizeof(res));
+	OutputBufferPrintf(out, "Group: %s\n", res);
+
+	OutputBufferPrintf(out, "Type: %s\n", StatModeTypeGetStringDescription(modetype));
+	OutputBufferPrintf(out, "Full path: %s%s%s\n", color, fullpath, ANSI_COLOR_RESET);
+	if (strlen(linkdesc) > 0)
+		OutputBufferPrintf(out, "Link: %s\n", linkdesc);
+	
+	OutputBufferPrintf(out, "Size: %s\n", sizebuf);
+	if (strlen(checksum) > 0)
+		OutputBufferPrintf(out, "Checksum: xxh64 %.16s\n", checksum);
+	if (strlen(lines) > 0)
+		OutputBufferPrintf(out, "Lines: %s\n", lines);
+	if (contenttype)
+		OutputBufferPrintf(out, "Content: %s\n", contenttype);
+	if (strlen(allocated) > 0)
+		OutputBufferPrintf(out, "Allocated: %s\n", allocated);
+	if (strlen(holes) > 0)
+		OutputBufferPrintf(out, "Data map: %s\n", holes);
+
+	TimeGetString(modtime, res, sizeof(res));
+	OutputBufferPrintf(out, "Date Modified: %s\n", res);
+
+	TimeGetString(accesstime, res, sizeof(res));
+	OutputBufferPrintf(out, "Date Access: %s\n", res);
+
+	TimeGetString(changetime, res, sizeof(res));
+	OutputBufferPrintf(out, "Date Metadata Changed: %s\n", res);
+
+	OutputBufferPrintf(out, "Permissions:\n");
+
+	// recall mode_t is an octal variable
+	PermissionsGetStringDescription((m & S_IRWXU) >> (3 * 2), res, sizeof(res));
+	OutputBufferPrintf(out, "  Owner: %s\n", res);
+
+	PermissionsGetStringDescription((m & S_IRWXG) >> (3 * 1), res, sizeof(res));
+	OutputBufferPrintf(out, "  Group: %s\n", res);
+
+	PermissionsGetStringDescription((m & S_IRWXO) >> (3 * 0), res, sizeof(res));
+	OutputBufferPrintf(out, "  Other: %s\n", res);
+
+	if (args->acl)
+		OutputBufferPrintf(out, "ACL: %s\n", XattrHandleHasAcl(xattrs) ? "yes" : "no");
+
+	if (args->label) {
+		if (XattrHandleGetLabel(xattrs, res, sizeof(res)))
+			strncpy(res, "-", sizeof(res));
+		OutputBufferPrintf(out, "Label: %s\n", res);
+	}
+
+	if (args->xattrs) {
+		if (XattrHandleList(xattrs)) {
+			OutputBufferPrintf(out, "Extended attributes: ?\n");
+		} else {
+			OutputBufferPrintf(out, "Extended attributes:%s\n", xattrs->nameslen == 0 ? " none" : "");
+			for (const char * name = xattrs->names; name < xattrs->names + xattrs->nameslen; name += strlen(name) + 1) {
+				ssize_t len = XattrHandleGet(xattrs, name, NULL, 0);
+				if (len == -1)
+					OutputBufferPrintf(out, "  %s (?)\n", name);
+				else
+					OutputBufferPrintf(out, "  %s (%zd bytes)\n", name, len);
+			}
+		}
+	}
+
+	return 0;
+}
+
+int PathQueryPrintPath(const PathQuery * path, const Arguments * args, OutputBuffer * out) {
+	if (!args || !path) return false;
+
+	if (args->fullpaths) {
+		char * p = PathQueryCopyPath(path);
+		if (!p) return 1;
+		OutputBufferWrite(out, p, strlen(p));
+		BFFree(p);
+		return OutputBufferWrite(out, args->nul ? "" : "\n", 1);
+	}
+
+	// what the column features open. Entries of a directory
+	// being walked are looked up through its descriptor,
+	// since their full path may be too long to use
+	char p[PATH_MAX];
+	PathQueryGetAccessPath(path, p);
+	const int at = (path->parent && (path->parent->fd >= 0)) ? path->parent->fd : AT_FDCWD;
+	const char * name = at == AT_FDCWD ? p : path->p;
+
+	// get info
+	struct stat st;
+
+	// see if file is a symlink
+	//
+	// for anything that isn't a symlink this is the same
+	// information stat() would give us, so this is the
+	// only syscall we make for the entry
+	if (path->hasstat) {
+		st = path->st;
+	} else if (fstatat(at, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+		int err = errno;
+		char * full = PathQueryCopyPath(path);
+		OutputBufferPrintf(out, "error: (path: %s) lstat %d\n", full ? full : path->p, err);
+		BFFree(full);
+		return 1;
+	}
+
+	// if link, then we will describe what
+	// it is pointing to. we only read the target
+	// here because both print modes show it
+	char buf[PATH_MAX];
+	char linkdesc[PATH_MAX];
+	linkdesc[0] = '\0';
+	if (S_ISLNK(st.st_mode)) {
+		ssize_t len = readlinkat(at, name, buf, sizeof(buf) - 1);
+		if (len != -1) buf[len] = '\0';
+		snprintf(linkdesc, PATH_MAX, " -> %s", len == -1 ? "?" : buf);
+	}
+
+	// get size of entry
+	// will not do recursion
+	size_t size = st.st_size;
+	char sizebuf[SIZE_STRING_MAX];
+	int error = SizeGetString(size, args->sizeformat, sizebuf);
+	if (error)
+		return error;
+
+	// digest column, only for regular files
+	char checksum[32];
+	checksum[0] = '\0';
+	if (args->checksum) {
+		uint64_t digest = 0;
+		if (!S_ISREG(st.st_mode)) {
+			snprintf(checksum, sizeof(checksum), "%-16s ", "-");
+		} else if (FileGetChecksum(p, &st, &digest)) {
+			snprintf(checksum, sizeof(checksum), "%-16s ", "?");
+		} else {
+			snprintf(checksum, sizeof(checksum), "%016" PRIx64 " ", digest);
+		}
+	}
+
+	// line counts, also only for regular files
+	char lines[64], linesdetail[64];
+	lines[0] = '\0';
+	linesdetail[0] = '\0';
+	if (args->lines) {
+		LineCount c;
+		uint64_t nlines = path->lines, nonempty = path->nonempty;
+		bool haslines = path->haslines;
+		if (S_ISREG(st.st_mode) && !haslines && !FileGetLineCount(p, &st, &c)) {
+			nlines = c.lines;
+			nonempty = LineCountGetNonEmpty(&c);
+			haslines = true;
+		}
+
+		if (haslines) {
+			snprintf(lines, sizeof(lines), "%8" PRIu64 " %8" PRIu64 " ", nlines, nonempty);
+			snprintf(linesdetail, sizeof(linesdetail), "%" PRIu64 " (%" PRIu64 " non empty)", nlines, nonempty);
+		} else {
+			const char * none = S_ISREG(st.st_mode) ? "?" : "-";
+			snprintf(lines, sizeof(lines), "%8s %8s ", none, none);
+		}
+	}
+
+	// content type column, from the first bytes of regular files
+	const char * contenttype = NULL;
+	if (args->contenttype) {
+		if (!S_ISREG(st.st_mode)) {
+			contenttype = "-";
+		} else if (FileGetContentType(p, &contenttype)) {
+			contenttype = "?";
+		}
+	}
+
+	// bytes on disk, which is less than size for sparse files
+	char allocated[SIZE_STRING_MAX];
+	allocated[0] = '\0';
+	uint64_t allocatedsize = (uint64_t) st.st_blocks * 512;
+	if (args->allocated) {
+		SizeGetString(allocatedsize, args->sizeformat, allocated);
+	}
+
+	// only files with fewer blocks than their size can have
+	// holes, so dense files cost nothing extra
+	char holes[SIZE_STRING_MAX + 24], holesdetail[2 * SIZE_STRING_MAX + 48];
+	holes[0] = '\0';
+	holesdetail[0] = '\0';
+	if (args->holes) {
+		uint64_t extents = 0, data = 0;
+		if (!S_ISREG(st.st_mode) || (allocatedsize >= (uint64_t) st.st_size)) {
+			snprintf(holes, sizeof(holes), "%5s %10s ", "-", "-");
+		} else if (FileGetDataMap(p, st.st_size, &extents, &data)) {
+			snprintf(holes, sizeof(holes), "%5s %10s ", "?", "?");
+		} else {
+			char databuf[SIZE_STRING_MAX], holebuf[SIZE_STRING_MAX];
+			SizeGetString(data, args->sizeformat, databuf);
+			SizeGetString(st.st_size - data, args->sizeformat, holebuf);
+			snprintf(holes, sizeof(holes), "%5" PRIu64 " %10s ", extents, holebuf);
+			snprintf(holesdetail, sizeof(holesdetail), "%" PRIu64 " extents, %s data, %s in holes",
+				extents, databuf, holebuf);
+		}
+	}
+
+	// get permissions
+	const mode_t m = st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO);
+
+	// Get type of item this is at path
+	const char modetype = StatGetModeType(&st);
+
+	// color we will use to print
+	const char * leaf = strrchr(path->p, '/');
+	const char * color = ColorTableGet(&colorTable, &st, leaf ? leaf + 1 : path->p);
+
+	// get printable path
+	// making sure there are no redundant characters
+	char item[PATH_MAX];
+	if (GetPrintablePath(path, item, args)) {
+		OutputBufferPrintf(out, "error: couldn't get printable path\n");
+		return 1;
+	}
+
+	// opened on first use, so entries cost nothing extra
+	// unless one of the xattr fields was asked for
+	XattrHandle xattrs;
+	XattrHandleInit(&xattrs, p);
+
+	// will only do it if the user asked for information for
+	// ONE file
+	bool shouldPrintInDetail = PathListGetSize(&args->paths) == 1 &&
+		PathQueryGetLevel(path) == 0;
+
+	if (shouldPrintInDetail) {
+		// full path is only shown in detail
+		char fullpath[PATH_MAX];
+		if (realpath(p, fullpath) == NULL) {
+			strncpy(fullpath, "?", PATH_MAX);
+		}
+
+		error = PathQueryPrintPathDetail(
+			out,
+			item,
+			modetype, m,
+			st.st_mtime,
+			st.st_atime,
+			st.st_ctime,
+			sizebuf,
+			checksum,
+			linesdetail,
+			contenttype,
+			allocated,
+			holesdetail,
+			args,
+			&xattrs,
+			color,
+			strlen(linkdesc) == 0 ? "" : linkdesc,
+			fullpath,
+			st.st_uid, st.st_gid);
+	} else {
+		char columns[256];
+		size_t len = 0;
+		if (args->allocated) {
+			len += snprintf(columns + len, sizeof(columns) - len, "%10s ", allocated);
+		}
+		len += snprintf(columns + len, sizeof(columns) - len, "%s%s%s", holes, checksum, lines);
+		if (contenttype) {
+			len += snprintf(columns + len, sizeof(columns) - len, "%-6s ", contenttype);
+		}
+		if (args->acl) {
+			len += snprintf(columns + len, sizeof(columns) - len, "%c ", XattrHandleHasAcl(&xattrs) ? '+' : ' ');
+		}
+		if (args->xattrs) {
+			if (XattrHandleList(&xattrs)) {
+				len += snprintf(columns + len, sizeof(columns) - len, "%3s ", "?");
+			} else {
+				// names are NUL terminated, so counting NULs counts them
+				int count = 0;
+				for (ssize_t i = 0; i < xattrs.nameslen; i++)
+					count += xattrs.names[i] == '\0';
+				len += snprintf(columns + len, sizeof(columns) - len, "%3d ", count);
+			}
+		}
+		if (args->label) {
+			char label[128];
+			if (XattrHandleGetLabel(&xattrs, label, sizeof(label)))
+				strncpy(label, "-", sizeof(label));
+			snprintf(columns + len, sizeof(columns) - len, "%-32s ", label);
+		}
+
+		char symbolic[PERMISSIONS_SYMBOLIC_SIZE];
+		if (args->symbolic) {
+			PermissionsGetSymbolic(st.st_mode, symbolic);
+		}
+
+		error = PathQueryPrintPathBrief(
+			out,
+			item,
+			modetype, m,
+			args->symbolic ? symbolic : NULL,
+			st.st_mtime,
+			sizebuf,
+			columns,
+			color,
+			strlen(linkdesc) == 0 ? "" : linkdesc);
+	}
+
+	XattrHandleClose(&xattrs);
+	return error;
+}
+
+/**
+ * directories whose listings are kept after they are printed
+ *
+ * an input path given more than once, or one that sits inside
+ * another input path's tree when recursing, is marked here so
+ * whoever scans it first leaves the results for the others
+ */
+static IdTable sharedDirs;
+
+/// listings of shared directories, keyed by directory (dev, ino)
+static IdTable listingCache;
+static pthread_mutex_t listingCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// flags PathQueryGetListing() reads directories with
+static int listingFlags = DIR_LISTING_PIPELINE;
+
+/**
+ * devices where a directory's link count is not 2 plus its
+ * number of sub directories
+ *
+ * btrfs and some NFS servers report 1, those are caught
+ * right away. Any other device lands here the first time a
+ * directory turns out to have more sub directories than its
+ * link count allows
+ */
+typedef struct {
+	dev_t * devs;
+	size_t size;
+	pthread_mutex_t lock;
+} LinkCountDevices;
+
+static LinkCountDevices linkCountUnreliable = {NULL, 0, PTHREAD_MUTEX_INITIALIZER};
+
+static CancelToken cancelToken;
+
+static UnfinishedDirs unfinishedDirs = {NULL, 0, PTHREAD_MUTEX_INITIALIZER};
+
+int CancelTokenCreate(CancelToken * t, uint64_t timeout, uint64_t maxentries) {
+	if (!t) return 1;
+
+	atomic_init(&t->cancelled, false);
+	atomic_init(&t->entries, 0);
+	t->deadline = timeout ? TimeGetMonotonicNanoseconds() + timeout : 0;
+	t->maxentries = maxentries;
+	t->reason = NULL;
+
+	return 0;
+}
+
+void CancelTokenCancel(CancelToken * t, const char * reason) {
+	if (!atomic_exchange(&t->cancelled, true))
+		t->reason = reason;
+}
+
+/**
+ * true once we should stop. call at batch boundaries
+ */
+bool CancelTokenIsCancelled(CancelToken * t) {
+	if (atomic_load_explicit(&t->cancelled, memory_order_relaxed))
+		return true;
+
+	if (t->deadline && (TimeGetMonotonicNanoseconds() >= t->deadline)) {
+		CancelTokenCancel(t, "timed out");
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * asks for up to `want` entries out of the entry budget
+ *
+ * returns how many may be read. cancels the token once
+ * the budget runs out
+ */
+size_t CancelTokenTakeEntries(CancelToken * t, size_t want) {
+	if (CancelTokenIsCancelled(t)) return 0;
+	else if (!t->maxentries) return want;
+
+	uint64_t before = atomic_fetch_add(&t->entries, want);
+	if (before + want < t->maxentries) return want;
+
+	CancelTokenCancel(t, "reached entry limit");
+	return before >= t->maxentries ? 0 : (size_t) (t->maxentries - before);
+}
+
+/**
+ * remembers that the directory at `path` wasn't finished
+ */
+int UnfinishedDirsAdd(UnfinishedDirs * u, const char * path) {
+	if (!u || !path) return 1;
+
+	char * p = BFStringCopyString(path);
+	if (!p) return 1;
+
+	pthread_mutex_lock(&u->lock);
+	char ** arr = realloc(u->array, sizeof(char *) * (u->size + 1));
+	if (arr) {
+		u->array = arr;
+		u->array[u->size++] = p;
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	if (!arr) BFFree(p);
+
+	return arr == NULL;
+}
+
+static int UnfinishedDirsCompare(const void * a, const void * b) {
+	return strcmp(*(const char **) a, *(const char **) b);
+}
+
+/**
+ * writes the marker telling the reader the listing is partial
+ */
+int UnfinishedDirsPrint(UnfinishedDirs * u, const CancelToken * t, FILE * f) {
+	if (!u || !t || !f) return 1;
+
+	pthread_mutex_lock(&u->lock);
+	qsort(u->array, u->size, sizeof(char *), UnfinishedDirsCompare);
+
+	// without a cancel, directories failed part way through
+	const char * reason = t->reason;
+	if (!reason) {
+		reason = atomic_load(&t->cancelled) ? "cancelled" : "couldn't read every directory";
+	}
+	fprintf(f, "\nlisting incomplete: %s\n", reason);
+	if (u->size) {
+		fprintf(f, "directories not finished:\n");
+		for (size_t i = 0; i < u->size; i++) {
+			fprintf(f, "  %s\n", u->array[i]);
+		}
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	return 0;
+}
+
+int UnfinishedDirsRelease(UnfinishedDirs * u) {
+	if (!u) return 1;
+
+	for (size_t i = 0; i < u->size; i++) {
+		BFFree(u->array[i]);
+	}
+	BFFree(u->array);
+	u->array = NULL;
+	u->size = 0;
+
+	return 0;
+}
+
+/**
+ * token bucket shared by every scanning thread
+ *
+ * tokens refill at `rate` per second up to a tenth of a second's
+ * worth. Taking more than is there puts the bucket in debt and the
+ * caller sleeps until it's paid off, so threads take turns
+ */
+typedef struct {
+	uint64_t rate; // per second. 0 for no limit
+	double tokens;
+	double burst;
+
+	/// CLOCK_MONOTONIC time in ns tokens were last added
+	uint64_t last;
+	pthread_mutex_t lock;
+} RateLimiter;
+
+/**
+ * caps how many threads may do something at once
+ */
+typedef struct {
+	unsigned int max; // 0 for no limit
+	unsigned int used;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} Semaphore;
+
+/// paces lstat calls for --max-stat-rate
+static RateLimiter statLimiter = {0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+/// bounds open directories for --max-dir-reads
+static Semaphore dirReadSlots = {0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+int RateLimiterCreate(RateLimiter * l, uint64_t rate) {
+	if (!l) return 1;
+
+	l->rate = rate;
+	l->burst = rate > 10 ? (double) rate / 10 : 1;
+	l->tokens = l->burst;
+	l->last = TimeGetMonotonicNanoseconds();
+
+	return 0;
+}
+
+/**
+ * takes up to `want` tokens, sleeping for them if we have to
+ *
+ * returns how many were taken, which is never more than the
+ * burst so one caller can't hold the others off for long. Sleeps
+ * end early at the cancel deadline
+ */
+size_t RateLimiterTake(RateLimiter * l, size_t want) {
+	if (!l || !l->rate || !want) return want;
+
+	if (want > l->burst)
+		want = (size_t) l->burst;
+
+	pthread_mutex_lock(&l->lock);
+	uint64_t now = TimeGetMonotonicNanoseconds();
+	l->tokens += (double) (now - l->last) * l->rate / 1e9;
+	if (l->tokens > l->burst)
+		l->tokens = l->burst;
+	l->last = now;
+
+	l->tokens -= want;
+	double debt = -l->tokens;
+	pthread_mutex_unlock(&l->lock);
+
+	if (debt > 0) {
+		uint64_t wait = (uint64_t) (debt * 1e9 / l->rate);
+		if (cancelToken.deadline && (now + wait > cancelToken.deadline))
+			wait = cancelToken.deadline > now ? cancelToken.deadline - now : 0;
+
+		struct timespec ts;
+		ts.tv_sec = wait / 1000000000ULL;
+		ts.tv_nsec = wait % 1000000000ULL;
+		while ((nanosleep(&ts, &ts) == -1) && (errno == EINTR)) {}
+	}
+
+	return want;
+}
+
+int SemaphoreCreate(Semaphore * s, unsigned int max) {
+	if (!s) return 1;
+	s->max = max;
+	s->used = 0;
+	return 0;
+}
+
+void SemaphoreAcquire(Semaphore * s) {
+	if (!s || !s->max) return;
+
+	pthread_mutex_lock(&s->lock);
+	while (s->used >= s->max)
+		pthread_cond_wait(&s->cond, &s->lock);
+	s->used++;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void SemaphoreRelease(Semaphore * s) {
+	if (!s || !s->max) return;
+
+	pthread_mutex_lock(&s->lock);
+	s->used--;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * sets the I/O scheduling class of this process. threads
+ * started after this inherit it
+ */
+int SetIoPriority(int prio) {
+#ifdef LINUX
+	if (syscall(SYS_ioprio_set, IO_PRIORITY_WHO_PROCESS, 0, prio) == -1) {
+		printf("error: couldn't set io priority (%s)\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+#else
+	printf("error: %s is only supported on linux\n", ARG_IO_PRIORITY);
+	return 1;
+#endif
+}
+
+/**
+ * what one thread has scanned
+ *
+ * only the owning thread writes to it and it sits on its own
+ * cache line, so counting is as cheap as a plain add. The
+ * progress thread reads every slot and sums them
+ */
+typedef struct {
+	_Alignas(64) atomic_uint_fast64_t dirs;
+	atomic_uint_fast64_t entries;
+	atomic_uint_fast64_t bytes;
+
+	/// sub directories found, used to guess how much is left
+	atomic_uint_fast64_t subdirs;
+} ProgressCounters;
+
+/**
+ * prints how far along we are to stderr every PROGRESS_INTERVAL_NS
+ */
+typedef struct {
+	/// one per thread that scans
+	ProgressCounters * slots;
+	size_t nslots;
+
+	/// number of input directories
+	uint64_t roots;
+	bool recursive;
+
+	/// CLOCK_MONOTONIC time in ns we started
+	uint64_t start;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+} Progress;
+
+static Progress progress = {NULL, 0, 0, false, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false};
+
+/// this thread's slot in `progress`. null when not reporting
+static _Thread_local ProgressCounters * progressCounters;
+
+/**
+ * adds to a counter only this thread writes to
+ */
+static void ProgressAdd(atomic_uint_fast64_t * v, uint64_t n) {
+	atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * makes the calling thread count into slot `slot`
+ */
+void ProgressAttach(Progress * p, size_t slot) {
+	progressCounters = (p && (slot < p->nslots)) ? &p->slots[slot] : NULL;
+}
+
+static void ProgressGetDuration(uint64_t s, char * buf, size_t bufsize) {
+	if (s >= 3600) snprintf(buf, bufsize, "%" PRIu64 "h%02" PRIu64 "m", s / 3600, (s / 60) % 60);
+	else if (s >= 60) snprintf(buf, bufsize, "%" PRIu64 "m%02" PRIu64 "s", s / 60, s % 60);
+	else snprintf(buf, bufsize, "%" PRIu64 "s", s);
+}
+
+/**
+ * sums every slot and prints one line
+ *
+ * the eta assumes directories we haven't reached branch like the
+ * ones we have: with f sub directories found per directory scanned,
+ * each pending directory grows into 1 / (1 - f) directories. While f
+ * is 1 or more the tree still looks unbounded, so we only give the
+ * time the directories already found will take
+ *
+ * `entryrate` is ignored once finished
+ */
+static void ProgressReport(Progress * p, double dirrate, uint64_t entryrate, bool finished) {
+	uint64_t dirs = 0, entries = 0, bytes = 0, subdirs = 0;
+	for (size_t i = 0; i < p->nslots; i++) {
+		dirs += atomic_load_explicit(&p->slots[i].dirs, memory_order_relaxed);
+		entries += atomic_load_explicit(&p->slots[i].entries, memory_order_relaxed);
+		bytes += atomic_load_explicit(&p->slots[i].bytes, memory_order_relaxed);
+		subdirs += atomic_load_explicit(&p->slots[i].subdirs, memory_order_relaxed);
+	}
+
+	char eta[32] = "?";
+	uint64_t known = p->roots + (p->recursive ? subdirs : 0);
+	double pending = known > dirs ? (double) (known - dirs) : 0;
+	double f = (p->recursive && dirs) ? (double) subdirs / dirs : 0;
+	if (finished) {
+		// the last interval is mostly empty, so the final
+		// line gives the rate over the whole run instead
+		uint64_t elapsed = TimeGetMonotonicNanoseconds() - p->start;
+		entryrate = elapsed ? (uint64_t) (entries * 1e9 / elapsed) : entries;
+		ProgressGetDuration(elapsed / 1000000000ULL, eta, sizeof(eta));
+	} else if ((f < 1) && (dirrate > 0)) {
+		ProgressGetDuration((uint64_t) (pending / (1 - f) / dirrate), eta, sizeof(eta));
+	} else if (dirrate > 0) {
+		eta[0] = '>';
+		ProgressGetDuration((uint64_t) (pending / dirrate), eta + 1, sizeof(eta) - 1);
+	}
+
+	char sizebuf[64];
+	BFByteGetString(bytes, 0, sizebuf);
+	fprintf(stderr, "progress: %" PRIu64 " dirs, %" PRIu64 " entries, %s, %" PRIu64 " entries/s, %s %s\n",
+		dirs, entries, sizebuf, entryrate, finished ? "took" : "eta", eta);
+}
+
+void * ProgressReporter(void * ctx) {
+	Progress * p = (Progress *) ctx;
+
+	uint64_t last = p->start;
+	uint64_t lastdirs = 0, lastentries = 0;
+	double dirrate = 0;
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->stop) {
+		// condition variables wait on the wall clock
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		uint64_t ns = (uint64_t) ts.tv_nsec + PROGRESS_INTERVAL_NS;
+		ts.tv_sec += ns / 1000000000ULL;
+		ts.tv_nsec = ns % 1000000000ULL;
+
+		pthread_cond_timedwait(&p->cond, &p->lock, &ts);
+
+		uint64_t now = TimeGetMonotonicNanoseconds();
+		if (p->stop || (now - last < PROGRESS_INTERVAL_NS))
+			continue;
+
+		uint64_t dirs = 0, entries = 0;
+		for (size_t i = 0; i < p->nslots; i++) {
+			dirs += atomic_load_explicit(&p->slots[i].dirs, memory_order_relaxed);
+			entries += atomic_load_explicit(&p->slots[i].entries, memory_order_relaxed);
+		}
+
+		// smooth the directory rate, it is bursty
+		double secs = (double) (now - last) / 1e9;
+		double rate = (dirs - lastdirs) / secs;
+		dirrate = dirrate > 0 ? (0.7 * dirrate) + (0.3 * rate) : rate;
+
+		ProgressReport(p, dirrate, (uint64_t) ((entries - lastentries) / secs), false);
+
+		last = now;
+		lastdirs = dirs;
+		lastentries = entries;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+/**
+ * starts reporting for `nslots` scanning threads
+ */
+int ProgressStart(Progress * p, size_t nslots, uint64_t roots, bool recursive) {
+	if (!p || !nslots) return 1;
+
+	void * slots = NULL;
+	if (posix_memalign(&slots, 64, sizeof(ProgressCounters) * nslots))
+		return 1;
+	memset(slots, 0, sizeof(ProgressCounters) * nslots);
+
+	p->slots = (ProgressCounters *) slots;
+	p->nslots = nslots;
+	p->roots = roots;
+	p->recursive = recursive;
+	p->start = TimeGetMonotonicNanoseconds();
+	p->stop = false;
+
+	if (pthread_create(&p->thread, NULL, ProgressReporter, p)) {
+		BFFree(p->slots);
+		p->slots = NULL;
+		p->nslots = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * stops the reporter and prints where we ended up
+ */
+int ProgressStop(Progress * p) {
+	if (!p || !p->slots) return 0;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = true;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+
+	ProgressReport(p, 0, 0, true);
+
+	progressCounters = NULL;
+	BFFree(p->slots);
+	p->slots = NULL;
+	p->nslots = 0;
+
+	return 0;
+}
+
+/**
+ * compares paths so that a directory sorts right before
+ * everything inside of it ('/' orders before any other byte)
+ */
+static int PathCompareByComponent(const unsigned char * x, const unsigned char * y) {
+	for (; *x && (*x == *y); x++, y++) {}
+
+	int cx = *x == '/' ? 1 : *x;
+	int cy = *y == '/' ? 1 : *y;
+	return cx - cy;
+}
+
+/**
+ * journal of a scan so it can be picked up where it stopped
+ *
+ * the header says whether the scan is recursive, so a resumed
+ * scan goes as deep as the one it continues. Every record is
+ * appended as a line:
+ *
+ *   R <root> <lvl> <len> <path>              input directory
+ *   P <root> <lvl> <len> <path>              sub directory still to list
+ *   D <root> <entries> <bytes> <len> <path>  directory whose section was written
+ *   A <dirs> <entries> <bytes>               totals from earlier runs
+ *   E                                        scan finished
+ *
+ * a directory is pending while it has an R or P record but no D
+ * record. A directory's D record goes out together with the P
+ * records of its sub directories, and only after its section has
+ * been written to stdout, so the file never claims more than what
+ * was printed
+ */
+typedef struct {
+	int fd; // -1 when we aren't checkpointing
+
+	/// records whose output may not be written yet
+	OutputBuffer records;
+
+	/// CLOCK_MONOTONIC time in ns of the last sync
+	uint64_t lastsync;
+
+	/// everything finished so far, including earlier runs
+	atomic_uint_fast64_t dirs;
+	atomic_uint_fast64_t entries;
+	atomic_uint_fast64_t bytes;
+} Checkpoint;
+
+static Checkpoint checkpoint = {.fd = -1};
+
+/**
+ * one R or P record read back from a checkpoint
+ */
+typedef struct {
+	char * path;
+	size_t root;
+	unsigned int lvl;
+} CheckpointDir;
+
+static int CheckpointDirCompare(const void * a, const void * b) {
+	const CheckpointDir * x = (const CheckpointDir *) a;
+	const CheckpointDir * y = (const CheckpointDir *) b;
+	if (x->root != y->root)
+		return x->root < y->root ? -1 : 1;
+
+	int cmp = PathCompareByComponent((const unsigned char *) x->path, (const unsigned char *) y->path);
+	return cmp ? cmp : strcmp(x->path, y->path);
+}
+
+static int CheckpointWriteAll(int fd, const char * data, size_t size) {
+	while (size) {
+		ssize_t n = write(fd, data, size);
+		if ((n == -1) && (errno == EINTR)) {
+			continue;
+		} else if (n <= 0) {
+			return 1;
+		}
+		data += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int CheckpointAddPath(OutputBuffer * b, char type, size_t root, unsigned int lvl, const char * path) {
+	return OutputBufferPrintf(b, "%c %zu %u %zu %s\n", type, root, lvl, strlen(path), path);
+}
+
+/**
+ * starts a new checkpoint in `file` for the directories in `paths`
+ */
+int CheckpointCreate(Checkpoint * c, const char * file, const PathList * paths, bool recursive) {
+	if (!c || !file || !paths) return 1;
+
+	OutputBuffer b;
+	memset(&b, 0, sizeof(b));
+	OutputBufferPrintf(&b, "%s %d\n", CHECKPOINT_HEADER, recursive ? 1 : 0);
+	for (size_t i = 0; i < paths->sizedir; i++) {
+		CheckpointAddPath(&b, 'R', paths->arraydir[i].root, 0, paths->arraydir[i].path);
+	}
+
+	int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	int error = (fd == -1) || CheckpointWriteAll(fd, b.data, b.size) || fsync(fd);
+	OutputBufferRelease(&b);
+
+	if (error) {
+		printf("error: couldn't write checkpoint %s (%s)\n", file, strerror(errno));
+		if (fd != -1) close(fd);
+		return 1;
+	}
+
+	c->fd = fd;
+	c->lastsync = TimeGetMonotonicNanoseconds();
+	return 0;
+}
+
+/**
+ * reads a space, `len` bytes of string and the newline after it
+ *
+ * paths below deep directories can be longer than PATH_MAX, so
+ * there is no limit other than what malloc will give us
+ */
+static char * ReadCountedString(FILE * f, size_t len) {
+	if ((len == 0) || (len == SIZE_MAX) || (fgetc(f) != ' '))
+		return NULL;
+
+	char * path = malloc(len + 1);
+	if (!path) return NULL;
+
+	if ((fread(path, 1, len, f) != len) || (fgetc(f) != '\n')) {
+		BFFree(path);
+		return NULL;
+	}
+	path[len] = '\0';
+
+	return path;
+}
+
+/**
+ * reads the checkpoint in `file` and fills `pending` with every
+ * directory that still has to be listed, in listing order
+ *
+ * recursive : set to whether the scan being resumed was
+ *
+ * the file is rewritten to hold only the pending directories and
+ * the totals so far, then kept open to record the resumed scan
+ */
+int CheckpointResume(Checkpoint * c, const char * file, PathList * pending, bool * recursive) {
+	if (!c || !file || !pending || !recursive) return 1;
+
+	FILE * f = fopen(file, "r");
+	if (!f) {
+		printf("error: couldn't open checkpoint %s (%s)\n", file, strerror(errno));
+		return 1;
+	}
+
+	char header[64];
+	int flag = -1;
+	char end = 0;
+	if (!fgets(header, sizeof(header), f) ||
+		(sscanf(header, CHECKPOINT_HEADER " %d%c", &flag, &end) != 2) || (end != '\n') || (flag < 0) || (flag > 1)) {
+		printf("error: %s is not a checkpoint\n", file);
+		fclose(f);
+		return 1;
+	}
+	*recursive = flag;
+
+	CheckpointDir * dirs = NULL, * done = NULL;
+	size_t ndirs = 0, ndone = 0, capdirs = 0, capdone = 0;
+	uint64_t totaldirs = 0, totalentries = 0, totalbytes = 0;
+
+	// a crash can leave the last record half written. Everything
+	// before the first record we can't read is still good, but
+	// if more follows it the file is damaged
+	bool damaged = false;
+	int error = 0;
+	int type;
+	while ((type = fgetc(f)) != EOF) {
+		CheckpointDir d;
+		memset(&d, 0, sizeof(d));
+		uint64_t n[3];
+		size_t len = 0;
+
+		if (type == 'E') {
+			if (fgetc(f) != '\n') {
+				damaged = true;
+				break;
+			}
+			continue;
+		} else if (type == 'A') {
+			if ((fscanf(f, " %" SCNu64 " %" SCNu64 " %" SCNu64, &n[0], &n[1], &n[2]) != 3) || (fgetc(f) != '\n')) {
+				damaged = true;
+				break;
+			}
+			totaldirs += n[0];
+			totalentries += n[1];
+			totalbytes += n[2];
+			continue;
+		} else if ((type == 'R') || (type == 'P')) {
+			if ((fscanf(f, " %zu %u %zu", &d.root, &d.lvl, &len) != 3) || !(d.path = ReadCountedString(f, len))) {
+				damaged = true;
+				break;
+			}
+		} else if (type == 'D') {
+			if ((fscanf(f, " %zu %" SCNu64 " %" SCNu64 " %zu", &d.root, &n[1], &n[2], &len) != 4)
+				|| !(d.path = ReadCountedString(f, len))) {
+				damaged = true;
+				break;
+			}
+			totaldirs++;
+			totalentries += n[1];
+			totalbytes += n[2];
+		} else {
+			damaged = true;
+			break;
+		}
+
+		CheckpointDir ** arr = type == 'D' ? &done : &dirs;
+		size_t * size = type == 'D' ? &ndone : &ndirs;
+		size_t * cap = type == 'D' ? &capdone : &capdirs;
+		if (*size == *cap) {
+			size_t newcap = *cap ? *cap * 2 : 256;
+			CheckpointDir * tmp = realloc(*arr, sizeof(CheckpointDir) * newcap);
+			if (!tmp) {
+				BFFree(d.path);
+				error = 1;
+				break;
+			}
+			*arr = tmp;
+			*cap = newcap;
+		}
+		(*arr)[(*size)++] = d;
+	}
+
+	// the rest of the line the bad record is on, then anything
+	// after it
+	if (damaged) {
+		int ch;
+		while (((ch = fgetc(f)) != EOF) && (ch != '\n')) {}
+		damaged = (ch != EOF) && (fgetc(f) != EOF);
+	}
+	fclose(f);
+
+	if (damaged || error) {
+		printf(damaged ? "error: checkpoint %s is damaged\n" : "error: couldn't read checkpoint %s\n", file);
+		for (size_t i = 0; i < ndirs; i++)
+			BFFree(dirs[i].path);
+		for (size_t i = 0; i < ndone; i++)
+			BFFree(done[i].path);
+		BFFree(dirs);
+		BFFree(done);
+		return 1;
+	}
+
+	// whatever is listed but not done is pending. Sorting puts
+	// them in the order they would have been listed
+	qsort(dirs, ndirs, sizeof(CheckpointDir), CheckpointDirCompare);
+	qsort(done, ndone, sizeof(CheckpointDir), CheckpointDirCompare);
+
+	OutputBuffer b;
+	memset(&b, 0, sizeof(b));
+	OutputBufferPrintf(&b, "%s %d\n", CHECKPOINT_HEADER, flag);
+	OutputBufferPrintf(&b, "A %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", totaldirs, totalentries, totalbytes);
+
+	for (size_t i = 0; !error && (i < ndirs); i++) {
+		if ((i > 0) && !CheckpointDirCompare(&dirs[i - 1], &dirs[i]))
+			continue;
+		else if (bsearch(&dirs[i], done, ndone, sizeof(CheckpointDir), CheckpointDirCompare))
+			continue;
+
+		PathListItem item;
+		if (PathListItemCreate(&item, dirs[i].path)) {
+			error = 1;
+			break;
+		}
+		item.root = dirs[i].root;
+		item.lvl = dirs[i].lvl;
+		error = AddPathToArray(&pending->arraydir, &pending->sizedir, &item);
+
+		CheckpointAddPath(&b, dirs[i].lvl ? 'P' : 'R', dirs[i].root, dirs[i].lvl, dirs[i].path);
+	}
+
+	for (size_t i = 0; i < ndirs; i++)
+		BFFree(dirs[i].path);
+	for (size_t i = 0; i < ndone; i++)
+		BFFree(done[i].path);
+	BFFree(dirs);
+	BFFree(done);
+
+	// swap in the compacted file so it doesn't grow run after run
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	int fd = -1;
+	if (!error) {
+		fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+		error = (fd == -1) || CheckpointWriteAll(fd, b.data, b.size) || fsync(fd) || rename(tmp, file);
+	}
+	OutputBufferRelease(&b);
+
+	if (error) {
+		printf("error: couldn't rewrite checkpoint %s (%s)\n", file, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp);
+		}
+		return 1;
+	}
+
+	c->fd = fd;
+	c->lastsync = TimeGetMonotonicNanoseconds();
+	atomic_store(&c->dirs, totaldirs);
+	atomic_store(&c->entries, totalentries);
+	atomic_store(&c->bytes, totalbytes);
+
+	return 0;
+}
+
+/**
+ * writes the records for a directory we fully listed into `b`:
+ * one for each sub directory we will list next (if recursing)
+ * and one saying this directory is done
+ */
+int CheckpointAddDir(
+	Checkpoint * c,
+	OutputBuffer * b,
+	size_t root,
+	unsigned int lvl,
+	const char * path,
+	const DirListing * listing,
+	bool recursive
+) {
+	if (!c || !b || !path || !listing) return 1;
+	else if (c->fd == -1) return 0;
+
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < listing->size; i++) {
+		const DirEntry * e = &listing->entries[i];
+		// entries read without lstat have their type from
+		// d_type but no size. Directories are always lstat'ed
+		if (e->error) {
+			continue;
+		} else if (S_ISREG(e->st.st_mode)) {
+			bytes += e->nostat ? 0 : e->st.st_size;
+		} else if (recursive && S_ISDIR(e->st.st_mode)) {
+			char * child = PathJoin(path, e->name);
+			if (!child) return 1;
+			CheckpointAddPath(b, 'P', root, lvl + 1, child);
+			BFFree(child);
+		}
+	}
+
+	OutputBufferPrintf(b, "D %zu %zu %" PRIu64 " %zu %s\n", root, listing->size, bytes, strlen(path), path);
+
+	atomic_fetch_add(&c->dirs, 1);
+	atomic_fetch_add(&c->entries, listing->size);
+	atomic_fetch_add(&c->bytes, bytes);
+
+	return 0;
+}
+
+/**
+ * queues records to go out with the next sync
+ *
+ * only call this once the output the records describe has been
+ * handed to stdout
+ */
+int CheckpointAppend(Checkpoint * c, const char * data, size_t size) {
+	if (!c || (c->fd == -1) || !size) return 0;
+	return OutputBufferWrite(&c->records, data, size);
+}
+
+/**
+ * true if CheckpointSync() would write now
+ */
+bool CheckpointIsDue(const Checkpoint * c) {
+	if (!c || (c->fd == -1)) return false;
+	return TimeGetMonotonicNanoseconds() - c->lastsync >= CHECKPOINT_INTERVAL_NS;
+}
+
+/**
+ * writes queued records to the checkpoint file
+ *
+ * stdout is flushed first. Unless `force` is set this does
+ * nothing if we synced less than CHECKPOINT_INTERVAL_NS ago
+ */
+int CheckpointSync(Checkpoint * c, bool force) {
+	if (!c || (c->fd == -1)) return 0;
+
+	uint64_t now = TimeGetMonotonicNanoseconds();
+	if (!force && (now - c->lastsync < CHECKPOINT_INTERVAL_NS))
+		return 0;
+	c->lastsync = now;
+
+	if (!c->records.size)
+		return 0;
+
+	// stdout may be a pipe or terminal, where fsync doesn't apply
+	fflush(stdout);
+	fsync(STDOUT_FILENO);
+
+	int error = CheckpointWriteAll(c->fd, c->records.data, c->records.size) || fsync(c->fd);
+	if (error) {
+		fprintf(stderr, "error: couldn't write checkpoint (%s)\n", strerror(errno));
+	}
+	c->records.size = 0;
+
+	return error;
+}
+
+/**
+ * syncs what is left and closes the checkpoint. A finished
+ * scan is marked so resuming it lists nothing
+ */
+int CheckpointClose(Checkpoint * c, bool finished) {
+	if (!c || (c->fd == -1)) return 0;
+
+	if (finished)
+		OutputBufferWrite(&c->records, "E\n", 2);
+
+	int error = CheckpointSync(c, true);
+	close(c->fd);
+	c->fd = -1;
+	OutputBufferRelease(&c->records);
+
+	return error;
+}
+
+bool LinkCountIsReliable(LinkCountDevices * u, dev_t dev) {
+	bool reliable = true;
+	pthread_mutex_lock(&u->lock);
+	for (size_t i = 0; reliable && (i < u->size); i++)
+		reliable = u->devs[i] != dev;
+	pthread_mutex_unlock(&u->lock);
+
+	return reliable;
+}
+
+void LinkCountSetUnreliable(LinkCountDevices * u, dev_t dev) {
+	pthread_mutex_lock(&u->lock);
+	bool found = false;
+	for (size_t i = 0; !found && (i < u->size); i++)
+		found = u->devs[i] == dev;
+
+	dev_t * arr = found ? NULL : realloc(u->devs, sizeof(dev_t) * (u->size + 1));
+	if (arr) {
+		arr[u->size++] = dev;
+		u->devs = arr;
+	}
+	pthread_mutex_unlock(&u->lock);
+}
+
+void LinkCountRelease(LinkCountDevices * u) {
+	pthread_mutex_lock(&u->lock);
+	BFFree(u->devs);
+	u->devs = NULL;
+	u->size = 0;
+	pthread_mutex_unlock(&u->lock);
+}
+
+static int DirEntryCompare(const void * a, const void * b) {
+	// same order as alphasort
+	return strcoll(((const DirEntry *) a)->name, ((const DirEntry *) b)->name);
+}
+
+/**
+ * the entries of one directory, for several threads to lstat
+ *
+ * chunks of LISTING_BATCH_SIZE are handed out in order and each
+ * thread only writes the entries of the chunks it took, so the
+ * array needs no lock
+ *
+ * with DIR_LISTING_PIPELINE the job runs on its own threads and
+ * the listing can be printed while it does, see DirListingWait()
+ */
+typedef struct DirStatJob {
+	DirListing * l;
+	const char * path;
+
+	/// the directory's descriptor, entries are lstat'ed relative
+	/// to it. -1 to go by `path`
+	int fd;
+	size_t n;
+	size_t nchunks;
+	int flags;
+
+	/// sub directories the link count promises, if it can be trusted
+	bool haslinks;
+	uint64_t expected;
+	dev_t dev;
+
+	atomic_size_t next;
+	atomic_bool stopped;
+
+	/// entries each chunk got through. Short if we were cancelled
+	size_t * done;
+
+	atomic_uint_fast64_t bytes;
+	atomic_uint_fast64_t subdirs;
+
+	/// entries done, and how many of those the progress
+	/// counters have. Only the thread that owns the listing
+	/// has counters, so it reports for everyone
+	atomic_size_t stated;
+	size_t reported;
+
+	/// the run of finished chunks from the start. `ready`
+	/// entries of it can be read. It is closed by a chunk
+	/// that was cut short, nothing after one is kept
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char * finished;
+	size_t readychunks;
+	size_t ready;
+	bool closed;
+
+	pthread_t * threads;
+	unsigned int started;
+	unsigned int helpers;
+} DirStatJob;
+
+/// threads that may help lstat large directories, on top
+/// of the ones listing them. Shared by every directory
+static atomic_uint statHelpersFree;
+
+/**
+ * records that `chunk` got through `done` entries and moves
+ * the ready run along
+ */
+static void DirStatJobFinishChunk(DirStatJob * job, size_t chunk, size_t done) {
+	pthread_mutex_lock(&job->lock);
+	job->done[chunk] = done;
+	job->finished[chunk] = true;
+	while (!job->closed && (job->readychunks < job->nchunks) && job->finished[job->readychunks]) {
+		size_t c = job->readychunks++;
+		job->ready += job->done[c];
+
+		// only the last chunk may be short without a cancel
+		if ((job->done[c] < LISTING_BATCH_SIZE) && (c + 1 < job->nchunks))
+			job->closed = true;
+	}
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void DirStatJobChunk(DirStatJob * job, size_t chunk) {
+	const size_t start = chunk * LISTING_BATCH_SIZE;
+	const size_t end = start + LISTING_BATCH_SIZE < job->n ? start + LISTING_BATCH_SIZE : job->n;
+
+	char p[PATH_MAX];
+	uint64_t bytes = 0;
+	size_t i = start;
+	while ((i < end) && !atomic_load_explicit(&job->stopped, memory_order_relaxed)) {
+		size_t batch = RateLimiterTake(&statLimiter, end - i);
+		if (statLimiter.rate && CancelTokenIsCancelled(&cancelToken))
+			batch = 0;
+		else
+			batch = CancelTokenTakeEntries(&cancelToken, batch);
+
+		if (!batch) {
+			atomic_store(&job->stopped, true);
+			break;
+		}
+
+		for (size_t last = i + batch; i < last; i++) {
+			DirEntry * e = &job->l->entries[i];
+
+			// directories are still lstat'ed, callers need
+			// their identity to recurse
+			bool known = (e->st.st_mode != 0) && !S_ISDIR(e->st.st_mode);
+			bool alldirs = job->haslinks &&
+				(atomic_load_explicit(&job->subdirs, memory_order_relaxed) == job->expected);
+			if ((job->flags & DIR_LISTING_NAMES) && (known || (!e->st.st_mode && alldirs))) {
+				e->nostat = true;
+				continue;
+			}
+
+			int res;
+			if (job->fd >= 0) {
+				res = fstatat(job->fd, e->name, &e->st, AT_SYMLINK_NOFOLLOW);
+			} else if ((size_t) snprintf(p, PATH_MAX, "%s/%s", job->path, e->name) >= PATH_MAX) {
+				// cut short it could name some other file
+				res = -1;
+				errno = ENAMETOOLONG;
+			} else {
+				res = lstat(p, &e->st);
+			}
+
+			if (res == -1) {
+				e->error = errno;
+			} else if (S_ISREG(e->st.st_mode)) {
+				bytes += e->st.st_size;
+			} else if (S_ISDIR(e->st.st_mode)) {
+				atomic_fetch_add_explicit(&job->subdirs, 1, memory_order_relaxed);
+			}
+		}
+
+		atomic_fetch_add_explicit(&job->stated, batch, memory_order_relaxed);
+	}
+
+	atomic_fetch_add_explicit(&job->bytes, bytes, memory_order_relaxed);
+	DirStatJobFinishChunk(job, chunk, i - start);
+}
+
+static void DirStatJobReport(DirStatJob * job) {
+	if (progressCounters) {
+		size_t stated = atomic_load_explicit(&job->stated, memory_order_relaxed);
+		ProgressAdd(&progressCounters->entries, stated - job->reported);
+		job->reported = stated;
+	}
+}
+
+void * DirStatWorker(void * ctx) {
+	DirStatJob * job = (DirStatJob *) ctx;
+
+	size_t chunk;
+	while (!atomic_load_explicit(&job->stopped, memory_order_relaxed) &&
+		((chunk = atomic_fetch_add(&job->next, 1)) < job->nchunks)) {
+		DirStatJobChunk(job, chunk);
+		DirStatJobReport(job);
+	}
+
+	// chunks nobody will take now still have to be
+	// finished, or the ready run could wait on them
+	while ((chunk = atomic_fetch_add(&job->next, 1)) < job->nchunks) {
+		DirStatJobFinishChunk(job, chunk, 0);
+	}
+
+	return NULL;
+}
+
+/**
+ * takes up to `want` helpers from statHelpersFree
+ */
+static unsigned int DirStatReserveHelpers(unsigned int want) {
+	unsigned int avail = atomic_load(&statHelpersFree);
+	while (avail && want) {
+		unsigned int take = avail < want ? avail : want;
+		if (atomic_compare_exchange_weak(&statHelpersFree, &avail, avail - take))
+			return take;
+	}
+
+	return 0;
+}
+
+static void DirStatJobRelease(DirStatJob * job) {
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->cond);
+	BFFree(job->done);
+	BFFree(job->finished);
+	BFFree(job->threads);
+	BFFree(job);
+}
+
+/**
+ * waits for the stat threads of `l`, if it has any, and
+ * settles its size
+ *
+ * l->size becomes the run of entries from the start that got
+ * done. Anything after a chunk we were cancelled in is dropped
+ */
+int DirListingFinish(DirListing * l) {
+	if (!l || !l->pending) return 0;
+
+	DirStatJob * job = l->pending;
+	for (unsigned int i = 0; i < job->started; i++) {
+		pthread_join(job->threads[i], NULL);
+	}
+	atomic_fetch_add(&statHelpersFree, job->helpers);
+
+	l->size = job->ready;
+	l->incomplete = l->incomplete || (l->size < job->n);
+
+	uint64_t subdirs = atomic_load(&job->subdirs);
+	if (l->incomplete) {
+		subdirs = 0;
+		for (size_t i = 0; i < l->size; i++) {
+			const DirEntry * e = &l->entries[i];
+			subdirs += !e->error && !e->nostat && S_ISDIR(e->st.st_mode);
+		}
+	}
+	l->subdirs = subdirs;
+
+	// more sub directories than links means the count can't
+	// be trusted anywhere on this device
+	if (job->haslinks && (atomic_load(&job->subdirs) > job->expected)) {
+		LinkCountSetUnreliable(&linkCountUnreliable, job->dev);
+	}
+
+	DirStatJobReport(job);
+	if (progressCounters) {
+		ProgressAdd(&progressCounters->dirs, 1);
+		ProgressAdd(&progressCounters->bytes, atomic_load(&job->bytes));
+		ProgressAdd(&progressCounters->subdirs, subdirs);
+	}
+
+	// drop names we never got to
+	for (size_t i = l->size; i < job->n; i++) {
+		BFFree(l->entries[i].name);
+	}
+
+	l->pending = NULL;
+	DirStatJobRelease(job);
+
+	return 0;
+}
+
+/**
+ * returns how many entries of `l` from the start can be read,
+ * waiting until that is more than `i` or the listing ends
+ *
+ * the caller should only come back once it has gone
+ * through what it was given
+ */
+size_t DirListingWait(const DirListing * l, size_t i) {
+	if (!l) return 0;
+	else if (!l->pending) return l->size;
+
+	DirStatJob * job = l->pending;
+	pthread_mutex_lock(&job->lock);
+	while ((i >= job->ready) && !job->closed && (job->readychunks < job->nchunks))
+		pthread_cond_wait(&job->cond, &job->lock);
+	size_t ready = job->ready;
+	pthread_mutex_unlock(&job->lock);
+
+	DirStatJobReport(job);
+
+	return ready;
+}
+
+/**
+ * lstat's the `n` entries of `l`, sharing chunks with helper
+ * threads when there are at least DIR_STAT_PARALLEL_MIN of them
+ *
+ * fd : the directory's descriptor, or -1 to go by `path`
+ *
+ * async : the lstat's happen on threads of their own and this
+ * returns right away. DirListingFinish() must be called once
+ * the listing has been read
+ */
+int DirListingStat(DirListing * l, int fd, const char * path, size_t n, int flags, const struct stat * dirst, bool haslinks, bool async) {
+	DirStatJob * job = calloc(1, sizeof(DirStatJob));
+	if (!job) return 1;
+
+	job->l = l;
+	job->fd = fd;
+	job->path = path;
+	job->n = n;
+	job->nchunks = (n + LISTING_BATCH_SIZE - 1) / LISTING_BATCH_SIZE;
+	job->flags = flags;
+	job->haslinks = haslinks;
+	job->expected = haslinks ? dirst->st_nlink - 2 : 0;
+	job->dev = haslinks ? dirst->st_dev : 0;
+	atomic_init(&job->next, 0);
+	atomic_init(&job->stopped, false);
+	atomic_init(&job->bytes, 0);
+	atomic_init(&job->subdirs, 0);
+	atomic_init(&job->stated, 0);
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cond, NULL);
+
+	job->done = calloc(job->nchunks + 1, sizeof(size_t));
+	job->finished = calloc(job->nchunks + 1, sizeof(unsigned char));
+	if (!job->done || !job->finished) {
+		DirStatJobRelease(job);
+		return 1;
+	}
+	l->pending = job;
+
+	if (n >= DIR_STAT_PARALLEL_MIN) {
+		size_t want = job->nchunks - 1;
+		job->helpers = DirStatReserveHelpers(want > UINT_MAX ? UINT_MAX : (unsigned int) want);
+	}
+
+	// the stage thread isn't a helper, it stands in for us
+	unsigned int nthreads = job->helpers + (async ? 1 : 0);
+	job->threads = nthreads ? calloc(nthreads, sizeof(pthread_t)) : NULL;
+	for (; job->threads && (job->started < nthreads); job->started++) {
+		if (pthread_create(&job->threads[job->started], NULL, DirStatWorker, job))
+			break;
+	}
+
+	// couldn't get a thread of its own, so do it here
+	if (!async || !job->started) {
+		DirStatWorker(job);
+		return DirListingFinish(l);
+	}
+
+	return 0;
+}
+
+/**
+ * reads every entry in the directory open at `fd`, or at `path`
+ * if `fd` is -1, and lstat's them
+ *
+ * entries are lstat'ed relative to `fd`, so it must stay open
+ * until DirListingFinish()
+ *
+ * work is done in batches of LISTING_BATCH_SIZE. If the scan gets
+ * cancelled in between, the listing is marked incomplete and
+ * holds what was read so far
+ *
+ * flags : DIR_LISTING_NAMES skips lstat where it can. d_type
+ * settles most entries. Where it is missing, a directory's link
+ * count (2 plus its sub directories on ext4, xfs and most
+ * others) says when every sub directory has been found, so the
+ * rest need no lstat. A leaf directory needs none at all
+ *
+ * DIR_LISTING_PIPELINE returns once the names are read when
+ * there are at least DIR_LISTING_PIPELINE_MIN of them. Read
+ * the entries through DirListingWait() and call
+ * DirListingFinish() after
+ */
+int DirListingCreateFromFd(DirListing * l, int fd, const char * path, int flags) {
+	if (!l || !path) return 1;
+
+	memset(l, 0, sizeof(DirListing));
+
+	// the stream gets its own open file, reading it doesn't
+	// move `fd` along
+	SemaphoreAcquire(&dirReadSlots);
+	DIR * d = NULL;
+	if (fd < 0) {
+		d = opendir(path);
+	} else {
+		int own = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if ((own != -1) && !(d = fdopendir(own))) {
+			close(own);
+		}
+	}
+
+	if (!d) {
+		SemaphoreRelease(&dirReadSlots);
+		return 1;
+	}
+
+	// no path walk, the directory is already open
+	struct stat dirst;
+	bool haslinks = !fstat(dirfd(d), &dirst);
+	if (haslinks && (dirst.st_nlink < 2)) {
+		LinkCountSetUnreliable(&linkCountUnreliable, dirst.st_dev);
+		haslinks = false;
+	} else if (haslinks) {
+		haslinks = LinkCountIsReliable(&linkCountUnreliable, dirst.st_dev);
+	}
+
+	size_t cap = 0;
+	size_t n = 0;
+	struct dirent * ent = NULL;
+	while (true) {
+		if (((n % LISTING_BATCH_SIZE) == 0) && CancelTokenIsCancelled(&cancelToken)) {
+			l->incomplete = true;
+			break;
+		}
+
+		// NULL with errno set is a failed read (EIO, ESTALE
+		// on a bad mount), not the end of the directory
+		errno = 0;
+		if ((ent = readdir(d)) == NULL) {
+			l->error = errno;
+			break;
+		}
+
+		const char * name = ent->d_name;
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			continue;
+
+		if (n == cap) {
+			size_t grow = cap ? cap * 2 : 64;
+			DirEntry * arr = realloc(l->entries, sizeof(DirEntry) * grow);
+			if (!arr) {
+				l->error = ENOMEM;
+				break;
+			}
+			l->entries = arr;
+			cap = grow;
+		}
+
+		DirEntry * e = &l->entries[n];
+		memset(e, 0, sizeof(DirEntry));
+		e->name = BFStringCopyString(name);
+		if (!e->name) {
+			l->error = ENOMEM;
+			break;
+		}
+#ifdef DT_UNKNOWN
+		// only kept until the lstat below replaces it
+		e->st.st_mode = ent->d_type == DT_UNKNOWN ? 0 : DTTOIF(ent->d_type);
+#endif
+		n++;
+	}
+	closedir(d);
+
+	if (l->error) {
+		l->incomplete = true;
+	}
+	SemaphoreRelease(&dirReadSlots);
+
+	if (n) qsort(l->entries, n, sizeof(DirEntry), DirEntryCompare);
+
+	// stat in batches, taking from the rate limit and
+	// entry budget as we go
+	bool async = (flags & DIR_LISTING_PIPELINE) && (n >= DIR_LISTING_PIPELINE_MIN);
+	if (DirListingStat(l, fd, path, n, flags, &dirst, haslinks, async)) {
+		l->incomplete = true;
+		for (size_t i = 0; i < n; i++) {
+			BFFree(l->entries[i].name);
+		}
+	}
+
+	return 0;
+}
+
+/// DirListingCreateFromFd() for the directory at `path`
+int DirListingCreate(DirListing * l, const char * path, int flags) {
+	return DirListingCreateFromFd(l, -1, path, flags);
+}
+
+int DirListingRelease(DirListing * l) {
+	if (!l) return 1;
+
+	DirListingFinish(l);
+
+	for (size_t i = 0; i < l->size; i++) {
+		BFFree(l->entries[i].name);
+	}
+	BFFree(l->entries);
+	memset(l, 0, sizeof(DirListing));
+
+	return 0;
+}
+
+static void DirListingReleaseValue(void * value) {
+	DirListingRelease((DirListing *) value);
+	BFFree(value);
+}
+
+/**
+ * true if `dir` is a directory we are already inside of
+ */
+bool PathQueryIsOwnAncestor(const PathQuery * dir) {
+	if (!dir || !dir->hasid) return false;
+
+	for (const PathQuery * q = dir->parent; q; q = q->parent) {
+		if (q->hasid && (q->dev == dir->dev) && (q->ino == dir->ino))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * returns the listing for `dir`, reading it if no other
+ * input path has already done so
+ *
+ * local : holds the listing if it isn't kept in the cache
+ *
+ * returns null if the directory couldn't be read
+ */
+const DirListing * PathQueryGetListing(PathQuery * dir, const char * path, DirListing * local) {
+	if (!dir || !path || !local) return NULL;
+
+	memset(local, 0, sizeof(DirListing));
+	if (!dir->hasid) {
+		return DirListingCreateFromFd(local, dir->fd, path, listingFlags) ? NULL : local;
+	}
+
+	// another input path may have already read this directory
+	pthread_mutex_lock(&listingCacheLock);
+	DirListing * listing = IdTableGet(&listingCache, dir->dev, dir->ino);
+	if (!dir->retain && IdTableGet(&sharedDirs, dir->dev, dir->ino))
+		dir->retain = true;
+	pthread_mutex_unlock(&listingCacheLock);
+
+	if (listing) {
+		return listing;
+	} else if (DirListingCreateFromFd(local, dir->fd, path, listingFlags)) {
+		return NULL;
+	} else if (!dir->retain) {
+		return local;
+	}
+
+	// only whole listings are kept
+	DirListingFinish(local);
+	if (local->incomplete) {
+		return local;
+	}
+
+	DirListing * keep = malloc(sizeof(DirListing));
+	if (!keep) return local;
+	*keep = *local;
+
+	// someone else could have read it while we did
+	pthread_mutex_lock(&listingCacheLock);
+	listing = IdTableGet(&listingCache, dir->dev, dir->ino);
+	if (!listing && !IdTableSet(&listingCache, dir->dev, dir->ino, keep)) {
+		listing = keep;
+		keep = NULL;
+	}
+	pthread_mutex_unlock(&listingCacheLock);
+
+	if (!listing) {
+		// couldn't cache it, we still own it
+		*local = *keep;
+		BFFree(keep);
+		return local;
+	} else if (keep) {
+		BFFree(keep);
+	} else {
+		memset(local, 0, sizeof(DirListing));
+	}
+
+	return listing;
+}
+
+/**
+ * writes "<path>/<name>" for every entry, each ending in '\n' or
+ * '\0'. Nothing needs the entries' lstat
+ *
+ * an entry costs two copies straight into `out`
+ */
+int PathQueryPrintListingPaths(
+	const char * path,
+	const DirListing * listing,
+	const Arguments * args,
+	OutputBuffer * out,
+	OutputWriter * writer
+) {
+	if (!path || !listing || !args || !out) return 1;
+
+	// the whole path goes in front of every name however long
+	// it is. "/" already ends in the separator
+	const size_t plen = strlen(path);
+	const size_t sep = plen && (path[plen - 1] != '/');
+	const char end = args->nul ? '\0' : '\n';
+
+	size_t ready = 0;
+	for (size_t i = 0;; i++) {
+		if ((i >= ready) && ((ready = DirListingWait(listing, i)) <= i))
+			break;
+
+		if (writer && ((i % LISTING_BATCH_SIZE) == 0) && (out->size >= OUTPUT_FLUSH_THRESHOLD)) {
+			OutputWriterSubmit(writer, out);
+		}
+
+		const char * name = listing->entries[i].name;
+		size_t len = strlen(name);
+		if (OutputBufferReserve(out, plen + sep + len + 1)) return 1;
+
+		char * d = out->data + out->size;
+		memcpy(d, path, plen);
+		if (sep) d[plen] = '/';
+		memcpy(d + plen + sep, name, len);
+		d[plen + sep + len] = end;
+		out->size += plen + sep + len + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * writes the section for `dir` into `out`: an optional label
+ * followed by one line per entry
+ */
+int PathQueryPrintListing(
+	const PathQuery * dir,
+	const char * path,
+	const DirListing * listing,
+	const Arguments * args,
+	OutputBuffer * out,
+	OutputWriter * writer
+) {
+	if (!dir || !path || !listing || !args || !out) return 1;
+
+	if (args->fullpaths) {
+		return PathQueryPrintListingPaths(path, listing, args, out, writer);
+	}
+
+	// sub directories are labeled so the reader knows
+	// what is being listed
+	bool shouldLabel = (PathListGetSize(&args->paths) > 1) ||
+		(PathQueryGetLevel(dir) > 0);
+
+	if (shouldLabel) {
+		OutputBufferPrintf(out, "\n%s:\n", path);
+	}
+
+	uint64_t lines = 0, nonempty = 0;
+	size_t counted = 0;
+	size_t ready = 0;
+	for (size_t i = 0;; i++) {
+		// entries may still be getting lstat'ed
+		if ((i >= ready) && ((ready = DirListingWait(listing, i)) <= i))
+			break;
+
+		// long listings go out in pieces, so writing overlaps
+		// with the rest of the listing
+		if (writer && ((i % LISTING_BATCH_SIZE) == 0) && (out->size >= OUTPUT_FLUSH_THRESHOLD)) {
+			OutputWriterSubmit(writer, out);
+		}
+
+		const DirEntry * e = &listing->entries[i];
+
+		PathQuery child;
+		if (PathQueryCreateChild(dir, &child, e->name)) {
+			OutputBufferPrintf(out, "error: couldn't create path query for %s/%s\n", path, e->name);
+			continue;
+		}
+
+		// entries read without lstat get one from the printer
+		// if it needs more than the name
+		if (!e->error && !e->nostat) {
+			child.st = e->st;
+			child.hasstat = true;
+			child.isdir = S_ISDIR(e->st.st_mode);
+		}
+
+		// counted here so the directory gets a total
+		LineCount c;
+		char p[PATH_MAX];
+		if (args->lines && !e->error && S_ISREG(e->st.st_mode) &&
+			!PathQueryGetAccessPath(&child, p) && !FileGetLineCount(p, &e->st, &c)) {
+			child.lines = c.lines;
+			child.nonempty = LineCountGetNonEmpty(&c);
+			child.haslines = true;
+
+			lines += child.lines;
+			nonempty += child.nonempty;
+			counted++;
+		}
+
+		if (PathQueryPrintPath(&child, args, out)) {
+			OutputBufferPrintf(out, "error: path couldn't be worked on %s/%s\n", path, e->name);
+		}
+
+		PathQueryRelease(&child);
+	}
+
+	if (args->lines) {
+		OutputBufferPrintf(out, "  %" PRIu64 " lines, %" PRIu64 " non empty in %zu file%s\n", lines, nonempty, counted, counted == 1 ? "" : "s");
+	}
+
+	return 0;
+}
+
+/**
+ * a directory whose sub directories are still to be walked
+ *
+ * only the sub directory entries outlive the listing, so a frame
+ * stays small no matter how big the directory was
+ */
+typedef struct DirFrame {
+	/// query for this directory, unused by the input directory.
+	/// The frame owns the descriptor in `dir->fd`
+	PathQuery own;
+	PathQuery * dir;
+
+	/// names point into `names`
+	DirEntry * subdirs;
+	char * names;
+	size_t size;
+
+	/// next sub directory to walk
+	size_t next;
+} DirFrame;
+
+/**
+ * the directories between the input directory and the one
+ * being walked. Frames are allocated one by one since children
+ * point at their parent's query, and are kept for reuse
+ */
+typedef struct {
+	DirFrame ** frames;
+	size_t depth;
+	size_t capacity;
+
+	/// frames past the first with a descriptor open, and
+	/// the first of them that may be
+	size_t open;
+	size_t lowest;
+} DirStack;
+
+/// returns an empty frame on top of `stack`, NULL if out of memory
+DirFrame * DirStackPush(DirStack * stack) {
+	if (!stack) return NULL;
+
+	if (stack->depth == stack->capacity) {
+		size_t capacity = stack->capacity ? stack->capacity * 2 : 64;
+		DirFrame ** frames = realloc(stack->frames, capacity * sizeof(DirFrame *));
+		if (!frames) return NULL;
+		memset(frames + stack->capacity, 0, (capacity - stack->capacity) * sizeof(DirFrame *));
+		stack->frames = frames;
+		stack->capacity = capacity;
+	}
+
+	DirFrame * f = stack->frames[stack->depth];
+	if (!f) {
+		f = malloc(sizeof(DirFrame));
+		if (!f) return NULL;
+		stack->frames[stack->depth] = f;
+	}
+
+	memset(f, 0, sizeof(DirFrame));
+	stack->depth++;
+
+	return f;
+}
+
+/// closes the descriptor of frame `i`
+static void DirStackClose(DirStack * stack, size_t i) {
+	PathQuery * dir = stack->frames[i]->dir;
+	if (!dir || (dir->fd < 0)) return;
+
+	close(dir->fd);
+	dir->fd = -1;
+	if (i) stack->open--;
+}
+
+/**
+ * opens the directory of the top frame relative to its parent's
+ * descriptor, so no path is walked and none has to fit in
+ * PATH_MAX. The input directory is opened by its path
+ *
+ * ancestors closed to stay under DIR_STACK_OPEN_MAX are opened
+ * again on the way. Sub directories are never followed if they
+ * turned into symlinks
+ *
+ * returns 1 if it couldn't be, the frame is then read by path
+ */
+int DirStackOpen(DirStack * stack) {
+	if (!stack || !stack->depth) return 1;
+
+	size_t top = stack->depth - 1;
+	if (stack->frames[top]->dir->fd >= 0) return 0;
+
+	size_t i = top;
+	while (i && (stack->frames[i]->dir->fd < 0)) {
+		i--;
+	}
+
+	if (stack->frames[i]->dir->fd < 0) {
+		char * p = PathQueryCopyPath(stack->frames[i]->dir);
+		if (!p) return 1;
+		stack->frames[i]->dir->fd = open(p, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		BFFree(p);
+		if (stack->frames[i]->dir->fd < 0) return 1;
+		if (i) stack->open++;
+	}
+
+	if (!stack->lowest || (i + 1 < stack->lowest)) {
+		stack->lowest = i + 1;
+	}
+
+	for (i++; i <= top; i++) {
+		PathQuery * dir = stack->frames[i]->dir;
+		dir->fd = openat(stack->frames[i - 1]->dir->fd, dir->p, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (dir->fd < 0) return 1;
+		stack->open++;
+
+		// the one we just came from may be needed again
+		// soonest, so the shallowest go first
+		while ((stack->open > DIR_STACK_OPEN_MAX) && (stack->lowest + 1 < i)) {
+			DirStackClose(stack, stack->lowest++);
+		}
+	}
+
+	return 0;
+}
+
+void DirStackPop(DirStack * stack) {
+	if (!stack || !stack->depth) return;
+
+	DirStackClose(stack, stack->depth - 1);
+	DirFrame * f = stack->frames[--stack->depth];
+	if (stack->lowest > stack->depth) {
+		stack->lowest = stack->depth;
+	}
+	if (f->dir == &f->own) {
+		PathQueryRelease(&f->own);
+	}
+	BFFree(f->subdirs);
+	BFFree(f->names);
+	memset(f, 0, sizeof(DirFrame));
+}
+
+void DirStackRelease(DirStack * stack) {
+	if (!stack) return;
+
+	while (stack->depth) {
+		DirStackPop(stack);
+	}
+	for (size_t i = 0; i < stack->capacity; i++) {
+		BFFree(stack->frames[i]);
+	}
+	BFFree(stack->frames);
+	memset(stack, 0, sizeof(DirStack));
+}
+
+/**
+ * keeps the sub directories of `listing` in `frame`
+ *
+ * we stop once all of them are found, so leaf directories
+ * aren't walked again
+ */
+int DirFrameSetSubdirs(DirFrame * frame, const DirListing * listing) {
+	if (!frame || !listing) return 1;
+
+	size_t found = 0, bytes = 0, end = 0;
+	for (; (found < listing->subdirs) && (end < listing->size); end++) {
+		const DirEntry * e = &listing->entries[end];
+		if (e->error || !S_ISDIR(e->st.st_mode))
+			continue;
+		found++;
+		bytes += strlen(e->name) + 1;
+	}
+
+	if (!found) return 0;
+
+	frame->subdirs = malloc(found * sizeof(DirEntry));
+	frame->names = malloc(bytes);
+	if (!frame->subdirs || !frame->names) {
+		BFFree(frame->subdirs);
+		BFFree(frame->names);
+		frame->subdirs = NULL;
+		frame->names = NULL;
+		return 1;
+	}
+
+	char * n = frame->names;
+	for (size_t i = 0; i < end; i++) {
+		const DirEntry * e = &listing->entries[i];
+		if (e->error || !S_ISDIR(e->st.st_mode))
+			continue;
+
+		size_t len = strlen(e->name) + 1;
+		memcpy(n, e->name, len);
+
+		DirEntry * d = &frame->subdirs[frame->size++];
+		*d = *e;
+		d->name = n;
+		n += len;
+	}
+
+	return 0;
+}
+
+/**
+ * prints the section for `dir` alone. With recursion, its sub
+ * directories are left in `frame` for the caller to walk
+ */
+int PathQueryPrintDirSection(PathQuery * dir, const Arguments * args, OutputBuffer * out, DirFrame * frame) {
+	if (!dir || !args || !out || !frame) return 1;
+
+	// only printed, the directory is read through its
+	// descriptor when it has one
+	char * p = PathQueryCopyPath(dir);
+	if (!p) return 1;
+
+	if (CancelTokenIsCancelled(&cancelToken)) {
+		UnfinishedDirsAdd(&unfinishedDirs, p);
+		BFFree(p);
+		return 0;
+	}
+
+	DirListing local;
+	const DirListing * listing = PathQueryGetListing(dir, p, &local);
+	if (!listing) {
+		OutputBufferPrintf(out, "error: couldn't scan dir %s\n", p);
+		BFFree(p);
+		return 1;
+	}
+
+	PathQueryPrintListing(dir, p, listing, args, out, &outputWriter);
+	DirListingFinish(&local);
+
+	// what we have is printed but we won't go any deeper
+	if (listing->incomplete) {
+		if (listing->error) {
+			OutputBufferPrintf(out, "error: couldn't read all of dir %s (%s)\n", p, strerror(listing->error));
+		}
+		UnfinishedDirsAdd(&unfinishedDirs, p);
+		DirListingRelease(&local);
+		BFFree(p);
+		return 0;
+	}
+
+	// goes to the checkpoint once `out` has been written
+	CheckpointAddDir(&checkpoint, &checkpoint.records, dir->root, dir->lvl, p, listing, args->recursive);
+
+	if (out->size >= OUTPUT_FLUSH_THRESHOLD) {
+		OutputWriterSubmit(&outputWriter, out);
+
+		// the checkpoint may only say what stdout already has
+		if (CheckpointIsDue(&checkpoint)) {
+			OutputWriterDrain(&outputWriter);
+			CheckpointSync(&checkpoint, false);
+		}
+	}
+
+	if (args->recursive && DirFrameSetSubdirs(frame, listing)) {
+		OutputBufferPrintf(out, "error: couldn't keep sub directories of %s\n", p);
+	}
+
+	DirListingRelease(&local);
+	BFFree(p);
+
+	return 0;
+}
+
+/**
+ * prints `dir` and, with recursion, every directory below it
+ *
+ * like `ls -R`, every sub directory gets its own section after
+ * its parent's. The walk keeps its own stack on the heap so deep
+ * trees cost a frame per level rather than a C stack frame
+ */
+int PathQueryPrintDir(PathQuery * dir, const Arguments * args, OutputBuffer * out) {
+	if (!dir || !args || !out) return 1;
+
+	DirStack stack = {0};
+	DirFrame * f = DirStackPush(&stack);
+	if (!f) return 1;
+
+	// without a descriptor the walk goes by path
+	f->dir = dir;
+	DirStackOpen(&stack);
+	int error = PathQueryPrintDirSection(dir, args, out, f);
+
+	while (!error && stack.depth) {
+		DirFrame * top = stack.frames[stack.depth - 1];
+		if (top->next >= top->size) {
+			DirStackPop(&stack);
+			continue;
+		}
+
+		const DirEntry * e = &top->subdirs[top->next++];
+
+		const char * fail = NULL;
+		DirFrame * child = DirStackPush(&stack);
+		if (!child || PathQueryCreateChild(top->dir, &child->own, e->name)) {
+			fail = "error: couldn't create path query for %s/%s\n";
+		} else {
+			child->dir = &child->own;
+			child->dir->st = e->st;
+			child->dir->hasstat = true;
+			child->dir->isdir = true;
+			PathQuerySetIdentity(child->dir, &e->st);
+
+			if (PathQueryIsOwnAncestor(child->dir)) {
+				fail = "error: %s/%s loops back to a parent directory\n";
+			} else {
+				DirStackOpen(&stack);
+				if (PathQueryPrintDirSection(child->dir, args, out, child))
+					fail = "error: path couldn't be worked on %s/%s\n";
+			}
+		}
+
+		if (fail) {
+			char * p = PathQueryCopyPath(top->dir);
+			OutputBufferPrintf(out, fail, p ? p : "?", e->name);
+			BFFree(p);
+			if (child) DirStackPop(&stack);
+		}
+	}
+
+	DirStackRelease(&stack);
+
+	return error;
+}
+
+/**
+ * a finished directory section waiting to be written
+ *
+ * (parent, index) is the block's sequence key: it is the index'th
+ * sub directory of the directory whose block has serial `parent`.
+ * Input directories have parent 0 and are indexed in the order
+ * they are listed
+ */
+typedef struct {
+	char * data;
+	size_t size;
+
+	uint64_t serial;
+	uint64_t parent;
+	uint64_t index;
+
+	/// number of sub directory blocks that follow this one
+	uint64_t nchildren;
+
+	/// checkpoint records to write once data is on stdout
+	OutputBuffer records;
+} OutputBlock;
+
+/**
+ * bounded multi producer, single consumer queue of output blocks
+ *
+ * producers claim slots with a compare and swap on `head`. Each
+ * slot's sequence number tells whether it's free or full, so
+ * neither side takes a lock unless it has to sleep
+ *
+ * the queue counts the bytes of every block from the moment it is
+ * pushed until the consumer releases it. The traversal uses that
+ * to stop starting new directories while too much output is
+ * waiting on a slow reader
+ */
+typedef struct {
+	struct BlockQueueSlot {
+		atomic_size_t seq;
+		OutputBlock * block;
+	} * slots;
+	size_t mask;
+
+	/// next slot producers fill
+	atomic_size_t head;
+
+	/// next slot the consumer reads. only the consumer touches this
+	size_t tail;
+
+	/// bytes pushed and not yet released by the consumer
+	atomic_size_t bytes;
+
+	/// set once no more blocks will come
+	atomic_bool closed;
+
+	/// only used when a side has to wait
+	atomic_int sleepers;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} BlockQueue;
+
+int BlockQueueCreate(BlockQueue * q, size_t slots) {
+	if (!q || !slots || (slots & (slots - 1))) return 1;
+
+	memset(q, 0, sizeof(BlockQueue));
+	q->slots = calloc(slots, sizeof(struct BlockQueueSlot));
+	if (!q->slots) return 1;
+
+	for (size_t i = 0; i < slots; i++) {
+		atomic_init(&q->slots[i].seq, i);
+	}
+
+	q->mask = slots - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->bytes, 0);
+	atomic_init(&q->closed, false);
+	atomic_init(&q->sleepers, 0);
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	return 0;
+}
+
+int BlockQueueRelease(BlockQueue * q) {
+	if (!q) return 1;
+
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+	BFFree(q->slots);
+
+	return 0;
+}
+
+/**
+ * wakes whoever sleeps in BlockQueueWait
+ *
+ * only takes the lock if someone is actually sleeping. The fence
+ * keeps the caller's store to the slot ahead of the sleepers load,
+ * pairing with the one in BlockQueueWait
+ */
+static void BlockQueueWake(BlockQueue * q) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&q->sleepers)) {
+		pthread_mutex_lock(&q->lock);
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+
+/**
+ * waits until `ready(q)` is true
+ *
+ * spins for a little first since the other side is usually
+ * about to make progress. sleepers is raised before the
+ * condition is checked under the lock so a wake can't be lost
+ */
+static void BlockQueueWait(BlockQueue * q, bool (* ready)(BlockQueue *)) {
+	for (int i = 0; i < 64; i++) {
+		if (ready(q)) return;
+		sched_yield();
+	}
+
+	atomic_fetch_add(&q->sleepers, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	pthread_mutex_lock(&q->lock);
+	while (!ready(q)) {
+		pthread_cond_wait(&q->cond, &q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+	atomic_fetch_sub(&q->sleepers, 1);
+}
+
+static bool BlockQueueHasFreeSlot(BlockQueue * q) {
+	size_t pos = atomic_load(&q->head);
+	return atomic_load(&q->slots[pos & q->mask].seq) >= pos;
+}
+
+/**
+ * hands `block` to the consumer. blocks while every slot is taken
+ *
+ * the queue owns block after this
+ */
+int BlockQueuePush(BlockQueue * q, OutputBlock * block) {
+	if (!q || !block) return 1;
+
+	atomic_fetch_add(&q->bytes, block->size);
+
+	size_t pos = atomic_load(&q->head);
+	while (true) {
+		struct BlockQueueSlot * slot = &q->slots[pos & q->mask];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak(&q->head, &pos, pos + 1)) {
+				slot->block = block;
+				atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+				break;
+			}
+		} else if (dif < 0) {
+			// every slot is taken
+			BlockQueueWait(q, BlockQueueHasFreeSlot);
+			pos = atomic_load(&q->head);
+		} else {
+			pos = atomic_load(&q->head);
+		}
+	}
+
+	BlockQueueWake(q);
+
+	return 0;
+}
+
+static bool BlockQueueHasBlockOrClosed(BlockQueue * q) {
+	struct BlockQueueSlot * slot = &q->slots[q->tail & q->mask];
+	return (atomic_load(&slot->seq) == q->tail + 1) || atomic_load(&q->closed);
+}
+
+/**
+ * takes the next block. only one thread may call this
+ *
+ * returns null once the queue is closed and empty
+ */
+OutputBlock * BlockQueuePop(BlockQueue * q) {
+	if (!q) return NULL;
+
+	while (true) {
+		struct BlockQueueSlot * slot = &q->slots[q->tail & q->mask];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+		if (seq == q->tail + 1) {
+			OutputBlock * block = slot->block;
+			atomic_store_explicit(&slot->seq, q->tail + q->mask + 1, memory_order_release);
+			q->tail++;
+			return block;
+		} else if (atomic_load(&q->closed)) {
+			// a producer may have slipped one in before closing
+			if (atomic_load_explicit(&slot->seq, memory_order_acquire) != q->tail + 1)
+				return NULL;
+		} else {
+			BlockQueueWait(q, BlockQueueHasBlockOrClosed);
+		}
+	}
+}
+
+/**
+ * tells the consumer that nothing else will be pushed
+ */
+int BlockQueueClose(BlockQueue * q) {
+	if (!q) return 1;
+
+	atomic_store(&q->closed, true);
+	BlockQueueWake(q);
+
+	return 0;
+}
+
+/**
+ * call once the consumer is done with a block it popped
+ */
+int BlockQueueReleaseBlock(BlockQueue * q, OutputBlock * block) {
+	if (!q || !block) return 1;
+
+	atomic_fetch_sub(&q->bytes, block->size);
+	BlockQueueWake(q);
+
+	BFFree(block->data);
+	OutputBufferRelease(&block->records);
+	BFFree(block);
+
+	return 0;
+}
+
+/**
+ * moves what is in `out` into a new block
+ *
+ * out is left empty
+ */
+OutputBlock * OutputBlockCreate(OutputBuffer * out) {
+	if (!out) return NULL;
+
+	OutputBlock * block = calloc(1, sizeof(OutputBlock));
+	if (!block) return NULL;
+
+	block->data = out->data;
+	block->size = out->size;
+	memset(out, 0, sizeof(OutputBuffer));
+
+	return block;
+}
+
+/**
+ * a directory waiting to be scanned by one of the threads
+ */
+typedef struct DirTask {
+	/// directory we were found in. we hold a reference to it
+	struct DirTask * parent;
+	atomic_uint refs;
+
+	/// our block's serial, handed out when we are scanned
+	uint64_t serial;
+
+	/// which sub directory of parent we are (or which input path)
+	uint64_t index;
+
+	/**
+	 * where we fall in the order of a sequential listing
+	 *
+	 * [key, key + span) holds us and everything below us, cut
+	 * from the parent's range. Once a range is too small to
+	 * split, children aren't exact and keep the range of the
+	 * closest parent that was
+	 */
+	uint64_t key;
+	uint64_t span;
+	unsigned char exact : 1;
+
+	dev_t dev;
+	ino_t ino;
+	unsigned int lvl;
+	unsigned char retain : 1;
+
+	/// input directory we came from and the level it started at
+	size_t root;
+	unsigned int base;
+
+	char path[];
+} DirTask;
+
+/**
+ * count : number of tasks index can go up to under the same parent
+ */
+DirTask * DirTaskCreate(
+	DirTask * parent,
+	uint64_t index,
+	uint64_t count,
+	const char * path,
+	const struct stat * st
+) {
+	if (!path) return NULL;
+
+	size_t len = strlen(path);
+	DirTask * t = malloc(sizeof(DirTask) + len + 1);
+	if (!t) return NULL;
+
+	memcpy(t->path, path, len + 1);
+	t->parent = parent;
+	atomic_init(&t->refs, 1);
+	t->serial = 0;
+	t->index = index;
+
+	// the parent's key is its own, the rest is split evenly
+	uint64_t first = parent ? parent->key + 1 : 0;
+	uint64_t room = parent ? parent->span - 1 : UINT64_MAX;
+	if ((!parent || parent->exact) && (index < count) && (room / count > 0)) {
+		t->span = room / count;
+		t->key = first + (index * t->span);
+		t->exact = true;
+	} else {
+		t->key = parent->key;
+		t->span = parent->span;
+		t->exact = false;
+	}
+
+	t->dev = st ? st->st_dev : 0;
+	t->ino = st ? st->st_ino : 0;
+	t->lvl = parent ? parent->lvl + 1 : 0;
+	t->retain = parent ? parent->retain : false;
+	t->root = parent ? parent->root : index;
+	t->base = parent ? parent->base : 0;
+
+	if (parent)
+		atomic_fetch_add(&parent->refs, 1);
+
+	return t;
+}
+
+void DirTaskRelease(DirTask * t) {
+	while (t && (atomic_fetch_sub(&t->refs, 1) == 1)) {
+		DirTask * parent = t->parent;
+		free(t);
+		t = parent;
+	}
+}
+
+/**
+ * true if `t` is a directory that one of its parents already is
+ */
+bool DirTaskIsOwnAncestor(const DirTask * t) {
+	for (const DirTask * q = t->parent; q; q = q->parent) {
+		if ((q->dev == t->dev) && (q->ino == t->ino))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * orders tasks the way a sequential `-r` listing would print them
+ *
+ * the keys settle it unless a task isn't exact and its range
+ * overlaps the other's. Then we walk both up to their closest
+ * common parent and compare the index of the branch each one
+ * is on
+ */
+int DirTaskCompare(const DirTask * a, const DirTask * b) {
+	if (a->exact && b->exact) {
+		return (a->key > b->key) - (a->key < b->key);
+	} else if (a->key + a->span <= b->key) {
+		return -1;
+	} else if (b->key + b->span <= a->key) {
+		return 1;
+	}
+
+	const DirTask * x = a;
+	const DirTask * y = b;
+
+	while (x->lvl > y->lvl) x = x->parent;
+	while (y->lvl > x->lvl) y = y->parent;
+
+	// one is inside the other. parents come first
+	if (x == y)
+		return (a->lvl > b->lvl) - (a->lvl < b->lvl);
+
+	while (x->parent != y->parent) {
+		x = x->parent;
+		y = y->parent;
+	}
+
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+/**
+ * state shared by the scanning threads and the writer
+ */
+typedef struct {
+	const Arguments * args;
+
+	/**
+	 * directories waiting to be scanned
+	 *
+	 * binary heap ordered by DirTaskCompare() so the directory
+	 * the writer needs next is never stuck behind later ones
+	 */
+	DirTask ** tasks;
+	size_t ntasks;
+	size_t cap;
+
+	/// tasks in the heap plus tasks being worked on
+	size_t outstanding;
+
+	/// sequence key of the block the writer is waiting for
+	uint64_t expectparent;
+	uint64_t expectindex;
+
+	/// threads waiting for the writer to catch up
+	unsigned int gated;
+
+	/// serials handed to blocks. 0 is reserved for input paths' parent
+	atomic_uint_fast64_t nextserial;
+
+	/// output that may wait on the writer before we stop starting directories
+	size_t maxbytes;
+
+	/// task each worker is on, indexed by worker. null when idle
+	DirTask ** running;
+
+	/// workers that haven't returned yet
+	size_t live;
+	size_t nworkers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/// finished sections on their way to the writer
+	BlockQueue queue;
+} Traversal;
+
+static void TraversalHeapUp(Traversal * tr, size_t i) {
+	while (i > 0) {
+		size_t p = (i - 1) / 2;
+		if (DirTaskCompare(tr->tasks[p], tr->tasks[i]) <= 0)
+			break;
+
+		DirTask * tmp = tr->tasks[p];
+		tr->tasks[p] = tr->tasks[i];
+		tr->tasks[i] = tmp;
+		i = p;
+	}
+}
+
+static void TraversalHeapDown(Traversal * tr, size_t i) {
+	while (true) {
+		size_t l = (2 * i) + 1;
+		size_t r = l + 1;
+		size_t m = i;
+
+		if ((l < tr->ntasks) && (DirTaskCompare(tr->tasks[l], tr->tasks[m]) < 0)) m = l;
+		if ((r < tr->ntasks) && (DirTaskCompare(tr->tasks[r], tr->tasks[m]) < 0)) m = r;
+		if (m == i)
+			break;
+
+		DirTask * tmp = tr->tasks[m];
+		tr->tasks[m] = tr->tasks[i];
+		tr->tasks[i] = tmp;
+		i = m;
+	}
+}
+
+/**
+ * adds tasks to be scanned
+ */
+int TraversalPush(Traversal * tr, DirTask ** tasks, size_t count) {
+	if (!tr || (count && !tasks)) return 1;
+
+	pthread_mutex_lock(&tr->lock);
+	if (tr->ntasks + count > tr->cap) {
+		size_t cap = tr->cap ? tr->cap : 64;
+		while (cap < tr->ntasks + count) cap *= 2;
+
+		DirTask ** arr = realloc(tr->tasks, sizeof(DirTask *) * cap);
+		if (!arr) {
+			pthread_mutex_unlock(&tr->lock);
+			return 1;
+		}
+		tr->tasks = arr;
+		tr->cap = cap;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		tr->tasks[tr->ntasks++] = tasks[i];
+		TraversalHeapUp(tr, tr->ntasks - 1);
+	}
+	tr->outstanding += count;
+
+	pthread_cond_broadcast(&tr->cond);
+	pthread_mutex_unlock(&tr->lock);
+
+	return 0;
+}
+
+/**
+ * true if `t` holds the block the writer is waiting for
+ *
+ * caller must hold tr->lock
+ */
+static bool TraversalIsExpected(const Traversal * tr, const DirTask * t) {
+	uint64_t parent = t->parent ? t->parent->serial : 0;
+	return (parent == tr->expectparent) && (t->index == tr->expectindex);
+}
+
+/**
+ * returns the next directory to scan, or null once
+ * every directory has been scanned
+ *
+ * while more than tr->maxbytes of output waits on the writer, only
+ * the directory the writer needs next may start. Anything else
+ * would just pile up more output
+ */
+DirTask * TraversalPop(Traversal * tr, size_t worker) {
+	DirTask * t = NULL;
+
+	pthread_mutex_lock(&tr->lock);
+	while (true) {
+		if (tr->ntasks) {
+			// once cancelled, tasks finish right away so let them through
+			bool full = atomic_load(&tr->queue.bytes) > tr->maxbytes;
+			if (!full || TraversalIsExpected(tr, tr->tasks[0]) ||
+				CancelTokenIsCancelled(&cancelToken))
+				break;
+		} else if (!tr->outstanding) {
+			break;
+		}
+
+		tr->gated++;
+		pthread_cond_wait(&tr->cond, &tr->lock);
+		tr->gated--;
+	}
+
+	if (tr->ntasks) {
+		t = tr->tasks[0];
+		tr->tasks[0] = tr->tasks[--tr->ntasks];
+		TraversalHeapDown(tr, 0);
+
+		// parents are always given a serial before their
+		// children are queued, so it's safe to read here
+		t->serial = atomic_fetch_add(&tr->nextserial, 1);
+		tr->running[worker] = t;
+	}
+	pthread_mutex_unlock(&tr->lock);
+
+	return t;
+}
+
+/**
+ * call when a task from TraversalPop is finished
+ */
+void TraversalTaskDone(Traversal * tr, size_t worker, DirTask * t) {
+	pthread_mutex_lock(&tr->lock);
+	tr->running[worker] = NULL;
+	if (--tr->outstanding == 0) {
+		pthread_cond_broadcast(&tr->cond);
+	}
+	pthread_mutex_unlock(&tr->lock);
+
+	DirTaskRelease(t);
+}
+
+/**
+ * scans one directory, queues its section and queues its
+ * sub directories as new tasks
+ *
+ * a block is always queued, even on error, since the writer
+ * waits for every task's block
+ */
+int TraversalScan(Traversal * tr, DirTask * t) {
+	const Arguments * args = tr->args;
+	OutputBuffer out, records;
+	memset(&out, 0, sizeof(out));
+	memset(&records, 0, sizeof(records));
+
+	DirTask ** children = NULL;
+	size_t nchildren = 0;
+
+	PathQuery dir;
+	DirListing local;
+	memset(&local, 0, sizeof(local));
+	memset(&dir, 0, sizeof(dir));
+	const DirListing * listing = NULL;
+	bool cancelled = CancelTokenIsCancelled(&cancelToken);
+	if (cancelled) {
+		// the writer still gets an (empty) block from us
+		UnfinishedDirsAdd(&unfinishedDirs, t->path);
+	} else if (PathQueryCreate(&dir, t->path)) {
+		OutputBufferPrintf(&out, "error: couldn't create the path struct\n");
+	} else {
+		dir.lvl = t->base + t->lvl;
+		dir.root = t->root;
+		dir.retain = t->retain;
+		if (t->dev || t->ino) {
+			dir.dev = t->dev;
+			dir.ino = t->ino;
+			dir.hasid = true;
+		}
+
+		listing = PathQueryGetListing(&dir, t->path, &local);
+	}
+
+	if (!listing && !cancelled) {
+		OutputBufferPrintf(&out, "error: couldn't scan dir %s\n", t->path);
+		if (t->lvl == 0)
+			OutputBufferPrintf(&out, "error: code - 1, path couldn't be worked on %s\n", t->path);
+	} else if (listing) {
+		// identity may have been found while getting the listing
+		t->retain = dir.retain;
+		if (dir.hasid) {
+			t->dev = dir.dev;
+			t->ino = dir.ino;
+		}
+
+		PathQueryPrintListing(&dir, t->path, listing, args, &out, NULL);
+		DirListingFinish(&local);
+
+		if (listing->incomplete) {
+			if (listing->error) {
+				OutputBufferPrintf(&out, "error: couldn't read all of dir %s (%s)\n", t->path, strerror(listing->error));
+			}
+			UnfinishedDirsAdd(&unfinishedDirs, t->path);
+			listing = NULL;
+		} else {
+			CheckpointAddDir(&checkpoint, &records, t->root, dir.lvl, t->path, listing, args->recursive);
+		}
+	}
+
+	size_t found = 0;
+	for (size_t i = 0; listing && args->recursive && (found < listing->subdirs) && (i < listing->size); i++) {
+		const DirEntry * e = &listing->entries[i];
+		if (e->error || !S_ISDIR(e->st.st_mode))
+			continue;
+		found++;
+
+		// tasks go by path, so one that doesn't fit can't be
+		// walked here. Its parent is left unfinished instead
+		char path[PATH_MAX];
+		size_t plen = strlen(t->path);
+		const char * sep = plen && (t->path[plen - 1] == '/') ? "" : "/";
+		if ((size_t) snprintf(path, PATH_MAX, "%s%s%s", t->path, sep, e->name) >= PATH_MAX) {
+			OutputBufferPrintf(&out, "error: %s%s%s is too long to walk with --threads\n", t->path, sep, e->name);
+			UnfinishedDirsAdd(&unfinishedDirs, t->path);
+			continue;
+		}
+
+		DirTask ** arr = realloc(children, sizeof(DirTask *) * (nchildren + 1));
+		DirTask * c = arr ? DirTaskCreate(t, nchildren, listing->subdirs, path, &e->st) : NULL;
+		if (arr) children = arr;
+
+		if (!c) {
+			OutputBufferPrintf(&out, "error: path couldn't be worked on %s\n", path);
+		} else if (DirTaskIsOwnAncestor(c)) {
+			OutputBufferPrintf(&out, "error: %s loops back to a parent directory\n", path);
+			DirTaskRelease(c);
+		} else {
+			children[nchildren++] = c;
+		}
+	}
+
+	DirListingRelease(&local);
+	PathQueryRelease(&dir);
+
+	OutputBlock * block = OutputBlockCreate(&out);
+	if (!block) {
+		OutputBufferRelease(&out);
+		OutputBufferRelease(&records);
+		for (size_t i = 0; i < nchildren; i++)
+			DirTaskRelease(children[i]);
+		BFFree(children);
+		return 1;
+	}
+
+	block->serial = t->serial;
+	block->parent = t->parent ? t->parent->serial : 0;
+	block->index = t->index;
+	block->nchildren = nchildren;
+	block->records = records;
+
+	// children go in before our block so the writer
+	// never waits on a task that doesn't exist yet
+	if (nchildren && TraversalPush(tr, children, nchildren)) {
+		for (size_t i = 0; i < nchildren; i++)
+			DirTaskRelease(children[i]);
+		block->nchildren = 0;
+	}
+	BFFree(children);
+
+	return BlockQueuePush(&tr->queue, block);
+}
+
+typedef struct {
+	Traversal * tr;
+
+	/// our slot in tr->running
+	size_t worker;
+} WorkerArgs;
+
+void * TraversalWorker(void * ctx) {
+	WorkerArgs * wargs = (WorkerArgs *) ctx;
+	Traversal * tr = wargs->tr;
+
+	if (tr->args->progress) {
+		ProgressAttach(&progress, wargs->worker + 1);
+	}
+
+	DirTask * t = NULL;
+	while ((t = TraversalPop(tr, wargs->worker)) != NULL) {
+		if (TraversalScan(tr, t)) {
+			fprintf(stderr, "error: couldn't queue output for %s\n", t->path);
+		}
+		TraversalTaskDone(tr, wargs->worker, t);
+	}
+
+	pthread_mutex_lock(&tr->lock);
+	tr->live--;
+	pthread_cond_broadcast(&tr->cond);
+	pthread_mutex_unlock(&tr->lock);
+
+	return NULL;
+}
+
+/**
+ * waits for every worker to return, cancelling the scan once
+ * `deadline` (CLOCK_MONOTONIC ns) passes
+ *
+ * returns false if workers are still out CANCEL_GRACE_NS after
+ * the deadline. They are most likely stuck in a syscall on a
+ * hung mount and won't see the cancellation
+ */
+bool TraversalWaitForWorkers(Traversal * tr, uint64_t deadline) {
+	bool cancelled = false;
+
+	pthread_mutex_lock(&tr->lock);
+	while (tr->live) {
+		uint64_t until = cancelled ? deadline + CANCEL_GRACE_NS : deadline;
+		uint64_t now = TimeGetMonotonicNanoseconds();
+
+		if (now >= until) {
+			if (cancelled)
+				break;
+
+			CancelTokenCancel(&cancelToken, "timed out");
+			cancelled = true;
+
+			// wake anyone waiting on the writer
+			pthread_cond_broadcast(&tr->cond);
+			continue;
+		}
+
+		// condition variables wait on the wall clock
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		uint64_t ns = (uint64_t) ts.tv_nsec + (until - now);
+		ts.tv_sec += ns / 1000000000ULL;
+		ts.tv_nsec = ns % 1000000000ULL;
+
+		pthread_cond_timedwait(&tr->cond, &tr->lock, &ts);
+	}
+	bool done = tr->live == 0;
+	pthread_mutex_unlock(&tr->lock);
+
+	return done;
+}
+
+/**
+ * marks every directory that is waiting or being scanned as unfinished
+ */
+void TraversalAddUnfinished(Traversal * tr) {
+	pthread_mutex_lock(&tr->lock);
+	for (size_t i = 0; i < tr->ntasks; i++) {
+		UnfinishedDirsAdd(&unfinishedDirs, tr->tasks[i]->path);
+	}
+	for (size_t i = 0; i < tr->nworkers; i++) {
+		if (tr->running[i])
+			UnfinishedDirsAdd(&unfinishedDirs, tr->running[i]->path);
+	}
+	pthread_mutex_unlock(&tr->lock);
+}
+
+/**
+ * blocks that came in before the writer needed them,
+ * keyed by their (parent, index) sequence key
+ */
+typedef struct {
+	OutputBlock ** array;
+	size_t size;
+	size_t cap; // always a power of 2
+} PendingBlocks;
+
+static size_t PendingBlocksSlot(const PendingBlocks * p, uint64_t parent, uint64_t index) {
+	size_t mask = p->cap - 1;
+	size_t i = IdTableHash((dev_t) parent, (ino_t) index) & mask;
+	while (p->array[i] && ((p->array[i]->parent != parent) || (p->array[i]->index != index)))
+		i = (i + 1) & mask;
+	return i;
+}
+
+int PendingBlocksAdd(PendingBlocks * p, OutputBlock * block) {
+	if (!p || !block) return 1;
+
+	if ((p->size + 1) * 2 > p->cap) {
+		PendingBlocks n;
+		n.size = p->size;
+		n.cap = p->cap ? p->cap * 2 : 64;
+		n.array = calloc(n.cap, sizeof(OutputBlock *));
+		if (!n.array) return 1;
+
+		for (size_t i = 0; i < p->cap; i++) {
+			if (p->array[i])
+				n.array[PendingBlocksSlot(&n, p->array[i]->parent, p->array[i]->index)] = p->array[i];
+		}
+		BFFree(p->array);
+		*p = n;
+	}
+
+	p->array[PendingBlocksSlot(p, block->parent, block->index)] = block;
+	p->size++;
+
+	return 0;
+}
+
+/**
+ * removes and returns the block with the key, or null
+ */
+OutputBlock * PendingBlocksTake(PendingBlocks * p, uint64_t parent, uint64_t index) {
+	if (!p || !p->size) return NULL;
+
+	size_t mask = p->cap - 1;
+	size_t i = PendingBlocksSlot(p, parent, index);
+	OutputBlock * block = p->array[i];
+	if (!block) return NULL;
+
+	p->array[i] = NULL;
+	p->size--;
+
+	// put back whatever was probing past us
+	for (size_t j = (i + 1) & mask; p->array[j]; j = (j + 1) & mask) {
+		OutputBlock * b = p->array[j];
+		p->array[j] = NULL;
+		p->array[PendingBlocksSlot(p, b->parent, b->index)] = b;
+	}
+
+	return block;
+}
+
+/**
+ * where the writer is in the tree: we have written `next`
+ * of the `count` sub directories of block `serial`
+ */
+typedef struct {
+	uint64_t serial;
+	uint64_t next;
+	uint64_t count;
+} WriterFrame;
+
+typedef struct {
+	Traversal * tr;
+
+	/// number of input directories
+	uint64_t nroots;
+} WriterArgs;
+
+/**
+ * the only thread that writes to stdout while scanning in parallel
+ *
+ * blocks arrive in whatever order the workers finish. They are held
+ * until every block before them, in the order a sequential listing
+ * would print, has been written
+ */
+void * TraversalWriter(void * ctx) {
+	WriterArgs * wargs = (WriterArgs *) ctx;
+	Traversal * tr = wargs->tr;
+
+	PendingBlocks pending;
+	memset(&pending, 0, sizeof(pending));
+
+	// one frame per directory level we are inside of
+	size_t depth = 1, cap = 64;
+	WriterFrame * stack = malloc(sizeof(WriterFrame) * cap);
+	if (!stack) {
+		fprintf(stderr, "error: couldn't allocate writer stack\n");
+		return NULL;
+	}
+	stack[0].serial = 0;
+	stack[0].next = 0;
+	stack[0].count = wargs->nroots;
+
+	while (depth) {
+		WriterFrame * top = &stack[depth - 1];
+		if (top->next == top->count) {
+			depth--;
+			continue;
+		}
+
+		OutputBlock * block = PendingBlocksTake(&pending, top->serial, top->next);
+		while (!block) {
+			block = BlockQueuePop(&tr->queue);
+			if (!block) {
+				break;
+			} else if ((block->parent != top->serial) || (block->index != top->next)) {
+				if (PendingBlocksAdd(&pending, block)) {
+					fprintf(stderr, "error: couldn't hold output block\n");
+					BlockQueueReleaseBlock(&tr->queue, block);
+				}
+				block = NULL;
+			}
+		}
+
+		// queue closed under us, nothing else will come
+		if (!block)
+			break;
+
+		fwrite(block->data, 1, block->size, stdout);
+		CheckpointAppend(&checkpoint, block->records.data, block->records.size);
+		CheckpointSync(&checkpoint, false);
+
+		top->next++;
+		if (block->nchildren) {
+			if (depth == cap) {
+				WriterFrame * arr = realloc(stack, sizeof(WriterFrame) * cap * 2);
+				if (!arr) {
+					fprintf(stderr, "error: couldn't grow writer stack\n");
+					BlockQueueReleaseBlock(&tr->queue, block);
+					break;
+				}
+				stack = arr;
+				cap *= 2;
+			}
+			stack[depth].serial = block->serial;
+			stack[depth].next = 0;
+			stack[depth].count = block->nchildren;
+			depth++;
+		}
+
+		BlockQueueReleaseBlock(&tr->queue, block);
+
+		// let workers know what we need now
+		pthread_mutex_lock(&tr->lock);
+		while (depth && (stack[depth - 1].next == stack[depth - 1].count))
+			depth--;
+		if (depth) {
+			tr->expectparent = stack[depth - 1].serial;
+			tr->expectindex = stack[depth - 1].next;
+		}
+		if (tr->gated)
+			pthread_cond_broadcast(&tr->cond);
+		pthread_mutex_unlock(&tr->lock);
+	}
+	fflush(stdout);
+
+	// anything left over could not be placed, write it rather than lose it
+	OutputBlock * block = NULL;
+	for (size_t i = 0; i < pending.cap; i++) {
+		if (pending.array[i]) {
+			fwrite(pending.array[i]->data, 1, pending.array[i]->size, stdout);
+			BlockQueueReleaseBlock(&tr->queue, pending.array[i]);
+		}
+	}
+	while ((block = BlockQueuePop(&tr->queue)) != NULL) {
+		fwrite(block->data, 1, block->size, stdout);
+		BlockQueueReleaseBlock(&tr->queue, block);
+	}
+	fflush(stdout);
+
+	BFFree(pending.array);
+	BFFree(stack);
+
+	return NULL;
+}
+
+/**
+ * lists the input paths using `args->threads` scanning threads
+ * and one thread writing to stdout
+ *
+ * output is the same as the sequential listing
+ */
+int GetInfoParallel(const Arguments * args) {
+	Traversal tr;
+	memset(&tr, 0, sizeof(tr));
+	tr.args = args;
+	tr.maxbytes = args->queuememory;
+	atomic_init(&tr.nextserial, 1);
+	pthread_mutex_init(&tr.lock, NULL);
+	pthread_cond_init(&tr.cond, NULL);
+
+	if (BlockQueueCreate(&tr.queue, QUEUE_SLOTS)) {
+		printf("error: couldn't create output queue\n");
+		return 1;
+	}
+
+	// files first, same as sequential
+	OutputBuffer out;
+	memset(&out, 0, sizeof(out));
+	for (size_t i = 0; i < args->paths.sizefile; i++) {
+		PathQuery path;
+		if (PathQueryCreateFromItem(&path, &args->paths.arrayfile[i]))
+			continue;
+
+		int err = PathQueryPrintPath(&path, args, &out);
+		if (err) {
+			OutputBufferPrintf(&out, "error: code - %d, path couldn't be worked on %s\n",
+				err, args->paths.arrayfile[i].path);
+		}
+		PathQueryRelease(&path);
+	}
+	OutputBufferFlush(&out, stdout);
+	OutputBufferRelease(&out);
+
+	DirTask ** roots = calloc(args->paths.sizedir + 1, sizeof(DirTask *));
+	size_t nroots = 0;
+	for (size_t i = 0; roots && (i < args->paths.sizedir); i++) {
+		const PathListItem * item = &args->paths.arraydir[i];
+		struct stat st;
+		st.st_dev = item->dev;
+		st.st_ino = item->ino;
+
+		DirTask * t = DirTaskCreate(NULL, nroots, args->paths.sizedir, item->path, item->error ? NULL : &st);
+		if (!t) continue;
+
+		t->root = item->root;
+		t->base = item->lvl;
+		roots[nroots++] = t;
+	}
+	TraversalPush(&tr, roots, nroots);
+	BFFree(roots);
+
+	WriterArgs wargs;
+	wargs.tr = &tr;
+	wargs.nroots = nroots;
+
+	pthread_t writer;
+	if (pthread_create(&writer, NULL, TraversalWriter, &wargs)) {
+		printf("error: couldn't start writer thread\n");
+		BlockQueueRelease(&tr.queue);
+		return 1;
+	}
+
+	unsigned int nthreads = args->threads ? args->threads : 1;
+	pthread_t * workers = calloc(nthreads, sizeof(pthread_t));
+	WorkerArgs * workerargs = calloc(nthreads, sizeof(WorkerArgs));
+	tr.running = calloc(nthreads, sizeof(DirTask *));
+	tr.nworkers = nthreads;
+
+	unsigned int started = 0;
+	for (; workers && workerargs && tr.running && (started < nthreads); started++) {
+		workerargs[started].tr = &tr;
+		workerargs[started].worker = started;
+
+		pthread_mutex_lock(&tr.lock);
+		tr.live++;
+		pthread_mutex_unlock(&tr.lock);
+
+		if (pthread_create(&workers[started], NULL, TraversalWorker, &workerargs[started])) {
+			pthread_mutex_lock(&tr.lock);
+			tr.live--;
+			pthread_mutex_unlock(&tr.lock);
+			break;
+		}
+	}
+
+	// do the work ourselves if no thread could start
+	if ((started == 0) && tr.running) {
+		WorkerArgs self = {&tr, 0};
+		tr.live = 1;
+		TraversalWorker(&self);
+	}
+
+	if (args->timeout && !TraversalWaitForWorkers(&tr, cancelToken.deadline)) {
+		// some worker is stuck. write everything that was
+		// finished and leave without waiting on it
+		TraversalAddUnfinished(&tr);
+		BlockQueueClose(&tr.queue);
+		pthread_join(writer, NULL);
+
+		UnfinishedDirsPrint(&unfinishedDirs, &cancelToken, stdout);
+		CheckpointClose(&checkpoint, false);
+		fflush(stdout);
+		_exit(1);
+	}
+
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	BFFree(workers);
+	BFFree(workerargs);
+
+	BlockQueueClose(&tr.queue);
+	pthread_join(writer, NULL);
+
+	BlockQueueRelease(&tr.queue);
+	BFFree(tr.running);
+	BFFree(tr.tasks);
+	pthread_mutex_destroy(&tr.lock);
+	pthread_cond_destroy(&tr.cond);
+
+	return 0;
+}
+
+/**
+ * lists the input paths one after another on this thread
+ */
+int GetInfoSequential(const Arguments * args) {
+	OutputBuffer out;
+	memset(&out, 0, sizeof(out));
+	OutputWriterStart(&outputWriter);
+
+	for (int i = 0; i < PathListGetSize(&args->paths); i++) {
+		const PathListItem * item = PathListGetItemAtIndex(&args->paths, i);
+		if (!item) {
+			OutputBufferPrintf(&out, "error: couldn't get path at index\n");
+			continue;
+		}
+
+		const char * currpath = item->path;
+		PathQuery path;
+		if (PathQueryCreateFromItem(&path, item)) {
+			OutputBufferPrintf(&out, "error: couldn't create the path struct\n");
+			continue;
+		}
+
+		int err = 0;
+		if (PathQueryIsFile(&path)) {
+			err = PathQueryPrintPath(&path, args, &out);
+		} else {
+			err = PathQueryPrintDir(&path, args, &out);
+		}
+
+		if (err) {
+			OutputBufferPrintf(&out, "error: code - %d, path couldn't be worked on %s\n", err, currpath);
+		}
+
+		PathQueryRelease(&path);
+	}
+
+	OutputWriterSubmit(&outputWriter, &out);
+	OutputWriterStop(&outputWriter);
+	OutputBufferRelease(&out);
+	CheckpointSync(&checkpoint, true);
+
+	return 0;
+}
+
+typedef struct {
+	char * canon;
+	const PathListItem * item;
+} CanonicalPath;
+
+static int CanonicalPathCompare(const void * a, const void * b) {
+	return PathCompareByComponent(
+		(const unsigned char *) ((const CanonicalPath *) a)->canon,
+		(const unsigned char *) ((const CanonicalPath *) b)->canon);
+}
+
+/**
+ * true if canonical path `a` is a proper ancestor of `b`
+ */
+static bool PathIsAncestor(const char * a, const char * b) {
+	size_t la = strlen(a);
+	if (strncmp(a, b, la) || (b[la] == '\0'))
+		return false;
+
+	return (b[la] == '/') || (a[la - 1] == '/');
+}
+
+/**
+ * fills `shared` with the identity of every input directory
+ * that will be listed more than once
+ *
+ * that is a directory given twice (under any spelling) or,
+ * when recursing, one that is inside another input directory
+ */
+int PathListMarkSharedDirs(const PathList * paths, bool recursive, IdTable * shared) {
+	if (!paths || !shared) return 1;
+	else if (paths->sizedir < 2) return 0;
+
+	IdTable seen;
+	memset(&seen, 0, sizeof(seen));
+
+	CanonicalPath * canon = NULL;
+	size_t ncanon = 0;
+	if (recursive) {
+		canon = (CanonicalPath *) malloc(sizeof(CanonicalPath) * paths->sizedir);
+	}
+
+	for (size_t i = 0; i < paths->sizedir; i++) {
+		const PathListItem * item = &paths->arraydir[i];
+		if (item->error || !item->isdir)
+			continue;
+
+		// the pointer is only used as a flag
+		if (IdTableGet(&seen, item->dev, item->ino)) {
+			IdTableSet(shared, item->dev, item->ino, (void *) item);
+			continue;
+		}
+		IdTableSet(&seen, item->dev, item->ino, (void *) item);
+
+		if (canon) {
+			canon[ncanon].canon = realpath(item->path, NULL);
+			canon[ncanon].item = item;
+			if (canon[ncanon].canon) ncanon++;
+		}
+	}
+
+	if (canon) {
+		qsort(canon, ncanon, sizeof(CanonicalPath), CanonicalPathCompare);
+
+		// ancestors sort right before their descendants so
+		// we only need the chain of ancestors of the current path
+		size_t depth = 0;
+		const char ** stack = (const char **) malloc(sizeof(char *) * (ncanon + 1));
+		for (size_t i = 0; stack && (i < ncanon); i++) {
+			while (depth && !PathIsAncestor(stack[depth - 1], canon[i].canon))
+				depth--;
+
+			if (depth) {
+				IdTableSet(shared, canon[i].item->dev, canon[i].item->ino, (void *) canon[i].item);
+			}
+			stack[depth++] = canon[i].canon;
+		}
+		BFFree(stack);
+	}
+
+	for (size_t i = 0; i < ncanon; i++) {
+		BFFree(canon[i].canon);
+	}
+	BFFree(canon);
+	IdTableRelease(&seen, NULL);
+
+	return 0;
+}
+
+/**
+ * a file (inode) that may have the same content as another
+ *
+ * hardlinks share one of these so their data is read once
+ */
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+
+	/// first path we saw it under, used to read it
+	const char * path;
+
+	/// hash of the head and tail, then of everything
+	uint64_t partial;
+	uint64_t full;
+
+	/// which group of identical content this is in
+	size_t group;
+	int error;
+} DupInode;
+
+static void DupInodeReleaseValue(void * value) {
+	BFFree(value);
+}
+
+typedef struct {
+	char * path;
+	DupInode * inode;
+} DupFile;
+
+/**
+ * everything the duplicate finder has collected
+ */
+typedef struct {
+	DupFile * files;
+	size_t nfiles;
+	size_t capfiles;
+
+	/// maps (dev, ino) to a DupInode
+	IdTable inodes;
+
+	/// directories we already walked
+	IdTable seen;
+
+	bool recursive;
+} DupFinder;
+
+int DupFinderAddFile(DupFinder * d, const char * path, const struct stat * st) {
+	if (!d || !path || !st) return 1;
+
+	DupInode * inode = IdTableGet(&d->inodes, st->st_dev, st->st_ino);
+	if (!inode) {
+		inode = calloc(1, sizeof(DupInode));
+		if (!inode) return 1;
+
+		inode->dev = st->st_dev;
+		inode->ino = st->st_ino;
+		inode->size = st->st_size;
+		if (IdTableSet(&d->inodes, st->st_dev, st->st_ino, inode)) {
+			BFFree(inode);
+			return 1;
+		}
+	}
+
+	if (d->nfiles == d->capfiles) {
+		size_t cap = d->capfiles ? d->capfiles * 2 : 1024;
+		DupFile * arr = realloc(d->files, sizeof(DupFile) * cap);
+		if (!arr) return 1;
+		d->files = arr;
+		d->capfiles = cap;
+	}
+
+	char * copy = BFStringCopyString(path);
+	if (!copy) return 1;
+
+	if (!inode->path)
+		inode->path = copy;
+
+	d->files[d->nfiles].path = copy;
+	d->files[d->nfiles].inode = inode;
+	d->nfiles++;
+
+	return 0;
+}
+
+/**
+ * a directory DupFinderWalk() is part way through
+ */
+typedef struct {
+	char * path;
+	DirListing listing;
+
+	/// next entry to go through
+	size_t next;
+} DupFrame;
+
+/**
+ * lists the directory at `path` on top of `frames`, unless
+ * it was walked already. Takes `path`
+ */
+static int DupFinderEnter(DupFinder * d, DupFrame ** frames, size_t * depth, size_t * capacity, char * path, dev_t dev, ino_t ino) {
+	// overlapping inputs and bind mount loops are walked once
+	if (IdTableGet(&d->seen, dev, ino)) {
+		BFFree(path);
+		return 0;
+	}
+	IdTableSet(&d->seen, dev, ino, (void *) d);
+
+	if (*depth == *capacity) {
+		size_t cap = *capacity ? *capacity * 2 : 64;
+		DupFrame * arr = realloc(*frames, sizeof(DupFrame) * cap);
+		if (!arr) {
+			fprintf(stderr, "error: couldn't scan dir %s\n", path);
+			BFFree(path);
+			return 1;
+		}
+		*frames = arr;
+		*capacity = cap;
+	}
+
+	DupFrame * f = &(*frames)[*depth];
+	if (DirListingCreate(&f->listing, path, 0)) {
+		fprintf(stderr, "error: couldn't scan dir %s\n", path);
+		BFFree(path);
+		return 1;
+	} else if (f->listing.incomplete) {
+		if (f->listing.error) {
+			fprintf(stderr, "error: couldn't read all of dir %s (%s)\n", path, strerror(f->listing.error));
+		}
+		UnfinishedDirsAdd(&unfinishedDirs, path);
+	}
+
+	f->path = path;
+	f->next = 0;
+	(*depth)++;
+
+	return 0;
+}
+
+/**
+ * adds every non empty regular file in `path` (and below it
+ * when recursing)
+ *
+ * directories go on a stack of our own, each with the entries
+ * it has left, so files are added in the same order as
+ * recursing would and deep trees can't overflow the C stack
+ */
+int DupFinderWalk(DupFinder * d, const char * path, dev_t dev, ino_t ino) {
+	if (!d || !path) return 1;
+
+	DupFrame * frames = NULL;
+	size_t depth = 0, capacity = 0;
+
+	char * root = BFStringCopyString(path);
+	int error = root ? DupFinderEnter(d, &frames, &depth, &capacity, root, dev, ino) : 1;
+
+	while (depth) {
+		DupFrame * top = &frames[depth - 1];
+		if (top->next >= top->listing.size) {
+			DirListingRelease(&top->listing);
+			BFFree(top->path);
+			depth--;
+			continue;
+		}
+
+		const DirEntry * e = &top->listing.entries[top->next++];
+		if (e->error)
+			continue;
+
+		bool file = S_ISREG(e->st.st_mode) && (e->st.st_size > 0);
+		if (!file && !(d->recursive && S_ISDIR(e->st.st_mode)))
+			continue;
+
+		char * p = PathJoin(top->path, e->name);
+		if (!p) {
+			fprintf(stderr, "error: couldn't scan %s/%s\n", top->path, e->name);
+		} else if (file) {
+			DupFinderAddFile(d, p, &e->st);
+			BFFree(p);
+		} else {
+			// may move the frames, `e` isn't used after
+			DupFinderEnter(d, &frames, &depth, &capacity, p, e->st.st_dev, e->st.st_ino);
+		}
+	}
+
+	BFFree(frames);
+
+	return error;
+}
+
+/**
+ * hashes the first and last DUPLICATES_EDGE_SIZE bytes, or the
+ * whole file if `full` is set
+ *
+ * a file no bigger than two edges is covered completely by the
+ * partial hash, so it doubles as the full hash
+ */
+int DupInodeHash(DupInode * inode, bool full, char * buf, size_t bufsize) {
+	if (!inode || !buf) return 1;
+
+	int fd = open(inode->path, O_RDONLY);
+	if (fd == -1) {
+		inode->error = errno;
+		return 1;
+	}
+
+	Hash64 h;
+	Hash64Init(&h, 0);
+
+	int error = 0;
+	if (full) {
+#ifdef LINUX
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		error = Hash64ReadFile(fd, 0, inode->size, &h, buf, bufsize);
+	} else {
+		off_t head = inode->size < DUPLICATES_EDGE_SIZE ? inode->size : DUPLICATES_EDGE_SIZE;
+		off_t tail = inode->size - head < DUPLICATES_EDGE_SIZE ? inode->size - head : DUPLICATES_EDGE_SIZE;
+		error = Hash64ReadFile(fd, 0, head, &h, buf, bufsize);
+		if (!error && tail)
+			error = Hash64ReadFile(fd, inode->size - tail, tail, &h, buf, bufsize);
+	}
+	close(fd);
+
+	if (error) {
+		inode->error = error;
+		return 1;
+	}
+
+	if (full) {
+		inode->full = Hash64Digest(&h);
+	} else {
+		inode->partial = Hash64Digest(&h);
+		if (inode->size <= 2 * DUPLICATES_EDGE_SIZE)
+			inode->full = inode->partial;
+	}
+
+	return 0;
+}
+
+/**
+ * inodes for the hashing threads to share out
+ */
+typedef struct {
+	DupInode ** inodes;
+	size_t count;
+	atomic_size_t next;
+	bool full;
+} DupHashJob;
+
+void * DupHashWorker(void * ctx) {
+	DupHashJob * job = (DupHashJob *) ctx;
+
+	char * buf = malloc(HASH_READ_SIZE);
+	if (!buf) return NULL;
+
+	size_t i;
+	while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+		DupInode * inode = job->inodes[i];
+		if (!inode->error && DupInodeHash(inode, job->full, buf, HASH_READ_SIZE)) {
+			fprintf(stderr, "error: couldn't read %s (%s)\n", inode->path, strerror(inode->error));
+		}
+	}
+
+	BFFree(buf);
+	return NULL;
+}
+
+/**
+ * hashes `count` inodes on `nthreads` threads, this one included
+ */
+int DupHashJobRun(DupInode ** inodes, size_t count, bool full, unsigned int nthreads) {
+	DupHashJob job;
+	job.inodes = inodes;
+	job.count = count;
+	job.full = full;
+	atomic_init(&job.next, 0);
+
+	if (nthreads > count) nthreads = count ? (unsigned int) count : 1;
+
+	pthread_t * threads = calloc(nthreads, sizeof(pthread_t));
+	unsigned int started = 0;
+	for (; threads && (started + 1 < nthreads); started++) {
+		if (pthread_create(&threads[started], NULL, DupHashWorker, &job))
+			break;
+	}
+
+	DupHashWorker(&job);
+
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	BFFree(threads);
+
+	return 0;
+}
+
+static int DupInodeCompareSize(const void * a, const void * b) {
+	const DupInode * x = *(const DupInode **) a;
+	const DupInode * y = *(const DupInode **) b;
+	if (x->size != y->size) return x->size > y->size ? -1 : 1;
+	return 0;
+}
+
+static int DupInodeComparePartial(const void * a, const void * b) {
+	const DupInode * x = *(const DupInode **) a;
+	const DupInode * y = *(const DupInode **) b;
+	int cmp = DupInodeCompareSize(a, b);
+	if (cmp) return cmp;
+	if (x->error != y->error) return x->error ? 1 : -1;
+	if (x->partial != y->partial) return x->partial < y->partial ? -1 : 1;
+	return 0;
+}
+
+static int DupInodeCompareFull(const void * a, const void * b) {
+	const DupInode * x = *(const DupInode **) a;
+	const DupInode * y = *(const DupInode **) b;
+	int cmp = DupInodeComparePartial(a, b);
+	if (cmp) return cmp;
+	if (x->full != y->full) return x->full < y->full ? -1 : 1;
+	return 0;
+}
+
+static int DupFileCompare(const void * a, const void * b) {
+	const DupFile * x = (const DupFile *) a;
+	const DupFile * y = (const DupFile *) b;
+	if (x->inode->group != y->inode->group)
+		return x->inode->group < y->inode->group ? -1 : 1;
+
+	// keeps hardlinks together
+	int cmp = strcmp(x->inode->path, y->inode->path);
+	return cmp ? cmp : strcmp(x->path, y->path);
+}
+
+/**
+ * keeps only the inodes in `inodes` that share a run (by `compare`)
+ * with another inode. returns the new count
+ */
+static size_t DupInodeKeepCollisions(DupInode ** inodes, size_t count, int (* compare)(const void *, const void *)) {
+	size_t kept = 0;
+	for (size_t i = 0; i < count;) {
+		size_t j = i + 1;
+		while ((j < count) && !compare(&inodes[i], &inodes[j]))
+			j++;
+
+		if ((j - i > 1) && !inodes[i]->error) {
+			memmove(&inodes[kept], &inodes[i], sizeof(DupInode *) * (j - i));
+			kept += j - i;
+		}
+		i = j;
+	}
+	return kept;
+}
+
+/**
+ * prints groups of files with identical content
+ *
+ * files are bucketed by size, then files sharing a size are told
+ * apart by a hash of their first and last DUPLICATES_EDGE_SIZE
+ * bytes. Only those that still collide are read in full. Hardlinks
+ * are found by (dev, ino) and never read twice
+ */
+int GetDuplicates(const Arguments * args) {
+	DupFinder d;
+	memset(&d, 0, sizeof(d));
+	d.recursive = args->recursive;
+
+	for (size_t i = 0; i < args->paths.sizefile; i++) {
+		const PathListItem * item = &args->paths.arrayfile[i];
+		struct stat st;
+		if (!item->error && !stat(item->path, &st) && S_ISREG(st.st_mode) && (st.st_size > 0))
+			DupFinderAddFile(&d, item->path, &st);
+	}
+	for (size_t i = 0; i < args->paths.sizedir; i++) {
+		const PathListItem * item = &args->paths.arraydir[i];
+		if (item->error) {
+			fprintf(stderr, "error: couldn't scan dir %s\n", item->path);
+			continue;
+		}
+		DupFinderWalk(&d, item->path, item->dev, item->ino);
+	}
+
+	DupInode ** inodes = malloc(sizeof(DupInode *) * (d.inodes.size + 1));
+	size_t count = 0;
+	for (size_t i = 0; inodes && (i < d.inodes.cap); i++) {
+		if (d.inodes.array[i].value)
+			inodes[count++] = d.inodes.array[i].value;
+	}
+
+	unsigned int nthreads = args->threads ? args->threads : 1;
+
+	// only sizes more than one file has can hold duplicates
+	qsort(inodes, count, sizeof(DupInode *), DupInodeCompareSize);
+	size_t ncandidates = DupInodeKeepCollisions(inodes, count, DupInodeCompareSize);
+
+	DupHashJobRun(inodes, ncandidates, false, nthreads);
+	qsort(inodes, ncandidates, sizeof(DupInode *), DupInodeComparePartial);
+	ncandidates = DupInodeKeepCollisions(inodes, ncandidates, DupInodeComparePartial);
+
+	// files that fit in the two edges were fully hashed already
+	size_t nfull = 0;
+	DupInode ** full = malloc(sizeof(DupInode *) * (ncandidates + 1));
+	for (size_t i = 0; full && (i < ncandidates); i++) {
+		if (inodes[i]->size > 2 * DUPLICATES_EDGE_SIZE)
+			full[nfull++] = inodes[i];
+	}
+	DupHashJobRun(full, nfull, true, nthreads);
+	BFFree(full);
+
+	qsort(inodes, ncandidates, sizeof(DupInode *), DupInodeCompareFull);
+	ncandidates = DupInodeKeepCollisions(inodes, ncandidates, DupInodeCompareFull);
+
+	// group 0 is for files with nothing in common. Otherwise
+	// inodes with identical content share a group
+	size_t ngroups = 0;
+	for (size_t i = 0; i < ncandidates; i++) {
+		if ((i == 0) || DupInodeCompareFull(&inodes[i - 1], &inodes[i]))
+			ngroups++;
+		inodes[i]->group = ngroups;
+	}
+	BFFree(inodes);
+
+	// hardlinks to the same inode are duplicates by themselves
+	for (size_t i = 0; i < d.nfiles; i++) {
+		DupInode * inode = d.files[i].inode;
+		if (!inode->group && (inode->path != d.files[i].path))
+			inode->group = ++ngroups;
+	}
+
+	qsort(d.files, d.nfiles, sizeof(DupFile), DupFileCompare);
+
+	uint64_t wasted = 0;
+	size_t printed = 0;
+	for (size_t i = 0; i < d.nfiles;) {
+		size_t j = i + 1;
+		while ((j < d.nfiles) && (d.files[j].inode->group == d.files[i].inode->group))
+			j++;
+
+		if (d.files[i].inode->group && (j - i > 1)) {
+			char sizebuf[64];
+			BFByteGetString(d.files[i].inode->size, 0, sizebuf);
+			printf("%s%zu files, %s each\n", printed ? "\n" : "", j - i, sizebuf);
+			for (size_t k = i; k < j; k++) {
+				bool link = (k > i) && (d.files[k].inode == d.files[k - 1].inode);
+				printf("  %s%s\n", d.files[k].path, link ? " (hardlink)" : "");
+				if (!link && (k > i))
+					wasted += d.files[k].inode->size;
+			}
+			printed++;
+		}
+		i = j;
+	}
+
+	char sizebuf[64];
+	BFByteGetString(wasted, 0, sizebuf);
+	printf("%s%zu group%s of duplicates, %s reclaimable\n", printed ? "\n" : "", printed, printed == 1 ? "" : "s", sizebuf);
+
+	for (size_t i = 0; i < d.nfiles; i++) {
+		BFFree(d.files[i].path);
+	}
+	BFFree(d.files);
+	IdTableRelease(&d.inodes, DupInodeReleaseValue);
+	IdTableRelease(&d.seen, NULL);
+
+	return 0;
+}
+
+/**
+ * one entry of a directory in a snapshot
+ *
+ * the hash covers the entry's name, type and size, mtime and
+ * content digest (files), target (symlinks) or tree hash
+ * (directories)
+ */
+typedef struct {
+	char * name;
+	char type;
+	uint64_t hash;
+} SnapshotEntry;
+
+/**
+ * a directory in a snapshot. Its hash is the hash of its
+ * entries' hashes, in byte order of their names
+ */
+typedef struct {
+	char * path; // relative to the snapshot's root
+	uint64_t hash;
+	SnapshotEntry * entries;
+	size_t size;
+} SnapshotDir;
+
+/**
+ * a snapshot being written or read
+ *
+ * the file holds one record per directory, children before
+ * their parent, each followed by its entries:
+ *
+ *   D <hash> <entries> <len> <path>
+ *   E <type> <hash> <len> <name>
+ */
+typedef struct {
+	FILE * file;
+	bool checksum;
+	size_t ndirs;
+
+	/// directories read back, sorted by path
+	SnapshotDir * dirs;
+	size_t size;
+} Snapshot;
+
+static int SnapshotDirCompare(const void * a, const void * b) {
+	return strcmp(((const SnapshotDir *) a)->path, ((const SnapshotDir *) b)->path);
+}
+
+static uint64_t SnapshotHashEntry(char type, const char * name, const void * data, size_t len) {
+	Hash64 h;
+	Hash64Init(&h, 0);
+	Hash64Update(&h, &type, 1);
+	Hash64Update(&h, name, strlen(name) + 1);
+	Hash64Update(&h, data, len);
+	return Hash64Digest(&h);
+}
+
+static int DirEntryPointerCompareBytes(const void * a, const void * b) {
+	return strcmp((*(const DirEntry **) a)->name, (*(const DirEntry **) b)->name);
+}
+
+/**
+ * a directory SnapshotWalk() is part way through. Its entries
+ * are hashed in byte order, a sub directory once its own walk
+ * is done
+ */
+typedef struct {
+	char * path;
+	char * rel;
+	dev_t dev;
+	ino_t ino;
+
+	DirListing listing;
+	const DirEntry ** sorted;
+	SnapshotEntry * entries;
+	size_t n;
+
+	/// next entry to hash
+	size_t next;
+	Hash64 hash;
+} SnapshotFrame;
+
+/**
+ * lists the directory at `path` on top of `frames`. Takes
+ * `path` and `rel`
+ *
+ * returns 1 if it couldn't be, it then hashes to 0
+ */
+static int SnapshotEnter(SnapshotFrame ** frames, size_t * depth, size_t * capacity, char * path, char * rel, dev_t dev, ino_t ino) {
+	const char * error = NULL;
+	for (size_t i = 0; i < *depth; i++) {
+		if (((*frames)[i].dev == dev) && ((*frames)[i].ino == ino)) {
+			error = "error: %s loops back to a parent directory\n";
+			break;
+		}
+	}
+
+	if (!error && (*depth == *capacity)) {
+		size_t cap = *capacity ? *capacity * 2 : 64;
+		SnapshotFrame * arr = realloc(*frames, sizeof(SnapshotFrame) * cap);
+		if (arr) {
+			*frames = arr;
+			*capacity = cap;
+		} else {
+			error = "error: couldn't scan dir %s\n";
+		}
+	}
+
+	SnapshotFrame * f = error ? NULL : &(*frames)[*depth];
+	if (f && DirListingCreate(&f->listing, path, 0)) {
+		error = "error: couldn't scan dir %s\n";
+	}
+
+	if (error) {
+		fprintf(stderr, error, path);
+		BFFree(path);
+		BFFree(rel);
+		return 1;
+	} else if (f->listing.incomplete) {
+		if (f->listing.error) {
+			fprintf(stderr, "error: couldn't read all of dir %s (%s)\n", path, strerror(f->listing.error));
+		}
+		UnfinishedDirsAdd(&unfinishedDirs, path);
+	}
+
+	f->path = path;
+	f->rel = rel;
+	f->dev = dev;
+	f->ino = ino;
+
+	// the listing is in locale order. Snapshots taken on
+	// different machines have to agree, so hash in byte order
+	f->sorted = malloc(sizeof(DirEntry *) * (f->listing.size + 1));
+	f->entries = malloc(sizeof(SnapshotEntry) * (f->listing.size + 1));
+	f->n = (f->sorted && f->entries) ? f->listing.size : 0;
+	for (size_t i = 0; i < f->n; i++) {
+		f->sorted[i] = &f->listing.entries[i];
+	}
+	qsort(f->sorted, f->n, sizeof(DirEntry *), DirEntryPointerCompareBytes);
+
+	f->next = 0;
+	Hash64Init(&f->hash, 0);
+	(*depth)++;
+
+	return 0;
+}
+
+/// hashes entry `i` of `f` from `size` bytes of `data`
+static void SnapshotFrameSetEntry(SnapshotFrame * f, size_t i, const void * data, size_t size) {
+	const DirEntry * e = f->sorted[i];
+	char type = e->error ? STAT_MOD_TYPE_UNKNOWN : StatGetModeType((struct stat *) &e->st);
+
+	f->entries[i].name = e->name;
+	f->entries[i].type = type;
+	f->entries[i].hash = SnapshotHashEntry(type, e->name, data, size);
+	Hash64Update(&f->hash, &f->entries[i].hash, sizeof(uint64_t));
+}
+
+/**
+ * writes the records for the tree at `path` (children first) and
+ * gets the directory's hash
+ *
+ * directories go on a stack of our own rather than the C
+ * stack, so deep trees don't overflow it
+ */
+int SnapshotWalk(Snapshot * s, const char * path, dev_t dev, ino_t ino, uint64_t * hash) {
+	if (!s || !path || !hash) return 1;
+
+	*hash = 0;
+
+	SnapshotFrame * frames = NULL;
+	size_t depth = 0, capacity = 0;
+
+	char * p = BFStringCopyString(path);
+	char * r = BFStringCopyString(".");
+	if (!p || !r) {
+		BFFree(p);
+		BFFree(r);
+		return 1;
+	}
+	int error = SnapshotEnter(&frames, &depth, &capacity, p, r, dev, ino);
+
+	while (depth) {
+		SnapshotFrame * top = &frames[depth - 1];
+
+		// done, so its hash goes to the entry its parent
+		// left for it
+		if (top->next >= top->n) {
+			uint64_t dirhash = Hash64Digest(&top->hash);
+			fprintf(s->file, "D %016" PRIx64 " %zu %zu %s\n", dirhash, top->n, strlen(top->rel), top->rel);
+			for (size_t i = 0; i < top->n; i++) {
+				fprintf(s->file, "E %c %016" PRIx64 " %zu %s\n", top->entries[i].type, top->entries[i].hash,
+					strlen(top->entries[i].name), top->entries[i].name);
+			}
+			s->ndirs++;
+
+			BFFree(top->sorted);
+			BFFree(top->entries);
+			BFFree(top->path);
+			BFFree(top->rel);
+			DirListingRelease(&top->listing);
+
+			if (--depth) {
+				SnapshotFrame * parent = &frames[depth - 1];
+				SnapshotFrameSetEntry(parent, parent->next - 1, &dirhash, sizeof(uint64_t));
+			} else {
+				*hash = dirhash;
+			}
+			continue;
+		}
+
+		size_t i = top->next++;
+		const DirEntry * e = top->sorted[i];
+		if (e->error) {
+			uint64_t field = e->error;
+			SnapshotFrameSetEntry(top, i, &field, sizeof(field));
+			continue;
+		}
+
+		p = PathJoin(top->path, e->name);
+		if (S_ISDIR(e->st.st_mode)) {
+			// may move the frames, `top` isn't used after
+			r = PathJoin(top->rel, e->name);
+			if (!p || !r || SnapshotEnter(&frames, &depth, &capacity, p, r, e->st.st_dev, e->st.st_ino)) {
+				if (!p || !r) {
+					BFFree(p);
+					BFFree(r);
+				}
+				uint64_t field = 0;
+				SnapshotFrameSetEntry(&frames[depth - 1], i, &field, sizeof(field));
+			}
+			continue;
+		}
+
+		char target[PATH_MAX];
+		ssize_t targetlen = -1;
+		uint64_t fields[3];
+		size_t nfields = 0;
+
+		if (S_ISLNK(e->st.st_mode)) {
+			targetlen = p ? readlink(p, target, sizeof(target)) : -1;
+		} else {
+			fields[nfields++] = e->st.st_size;
+			fields[nfields++] = StatGetModifiedNanoseconds(&e->st);
+			if (s->checksum && p && S_ISREG(e->st.st_mode) && !FileGetChecksum(p, &e->st, &fields[nfields]))
+				nfields++;
+		}
+		BFFree(p);
+
+		if (targetlen >= 0) {
+			SnapshotFrameSetEntry(top, i, target, targetlen);
+		} else {
+			SnapshotFrameSetEntry(top, i, fields, sizeof(uint64_t) * nfields);
+		}
+	}
+
+	BFFree(frames);
+
+	return error;
+}
+
+/**
+ * writes a snapshot of the one input directory and everything
+ * below it to `args->snapshot`, with or without recursion
+ */
+int GetSnapshot(const Arguments * args) {
+	if ((args->paths.sizedir != 1) || args->paths.sizefile) {
+		printf("error: %s takes one directory\n", ARG_SNAPSHOT);
+		return 1;
+	}
+
+	const PathListItem * item = &args->paths.arraydir[0];
+	if (item->error) {
+		printf("error: couldn't scan dir %s\n", item->path);
+		return 1;
+	}
+
+	Snapshot s;
+	memset(&s, 0, sizeof(s));
+	s.checksum = args->checksum;
+	s.file = fopen(args->snapshot, "w");
+	if (!s.file) {
+		printf("error: couldn't open %s (%s)\n", args->snapshot, strerror(errno));
+		return 1;
+	}
+	fputs(SNAPSHOT_HEADER, s.file);
+
+	uint64_t hash = 0;
+	SnapshotWalk(&s, item->path, item->dev, item->ino, &hash);
+
+	if (fclose(s.file)) {
+		printf("error: couldn't write %s (%s)\n", args->snapshot, strerror(errno));
+		return 1;
+	}
+
+	printf("%016" PRIx64 "  %s\n", hash, item->path);
+	printf("%zu directories written to %s\n", s.ndirs, args->snapshot);
+
+	return 0;
+}
+
+int SnapshotRelease(Snapshot * s) {
+	if (!s) return 1;
+
+	for (size_t i = 0; i < s->size; i++) {
+		for (size_t j = 0; j < s->dirs[i].size; j++) {
+			BFFree(s->dirs[i].entries[j].name);
+		}
+		BFFree(s->dirs[i].entries);
+		BFFree(s->dirs[i].path);
+	}
+	BFFree(s->dirs);
+	memset(s, 0, sizeof(Snapshot));
+
+	return 0;
+}
+
+/**
+ * reads the snapshot written to `file`
+ */
+int SnapshotRead(Snapshot * s, const char * file) {
+	if (!s || !file) return 1;
+
+	memset(s, 0, sizeof(Snapshot));
+	FILE * f = fopen(file, "r");
+	if (!f) {
+		printf("error: couldn't open %s (%s)\n", file, strerror(errno));
+		return 1;
+	}
+
+	char header[64];
+	int error = !fgets(header, sizeof(header), f) || strcmp(header, SNAPSHOT_HEADER);
+
+	size_t cap = 0;
+	int type;
+	while (!error && ((type = fgetc(f)) != EOF)) {
+		SnapshotDir d;
+		memset(&d, 0, sizeof(d));
+		size_t len = 0, n = 0;
+		if ((type != 'D') || (fscanf(f, " %" SCNx64 " %zu %zu", &d.hash, &n, &len) != 3) ||
+			!(d.path = ReadCountedString(f, len))) {
+			error = 1;
+			break;
+		}
+
+		d.entries = calloc(n + 1, sizeof(SnapshotEntry));
+		for (; d.entries && (d.size < n); d.size++) {
+			SnapshotEntry * e = &d.entries[d.size];
+			if ((fgetc(f) != 'E') || (fscanf(f, " %c %" SCNx64 " %zu", &e->type, &e->hash, &len) != 3) ||
+				!(e->name = ReadCountedString(f, len)))
+				break;
+		}
+
+		if (s->size == cap) {
+			cap = cap ? cap * 2 : 256;
+			SnapshotDir * arr = realloc(s->dirs, sizeof(SnapshotDir) * cap);
+			if (!arr) cap = 0;
+			else s->dirs = arr;
+		}
+
+		error = !d.entries || (d.size < n) || !cap;
+		if (cap) {
+			s->dirs[s->size++] = d;
+		} else {
+			BFFree(d.entries);
+			BFFree(d.path);
+		}
+	}
+	fclose(f);
+
+	if (error) {
+		printf("error: %s is not a snapshot or is damaged\n", file);
+		SnapshotRelease(s);
+		return 1;
+	}
+
+	qsort(s->dirs, s->size, sizeof(SnapshotDir), SnapshotDirCompare);
+
+	return 0;
+}
+
+const SnapshotDir * SnapshotFind(const Snapshot * s, const char * path) {
+	SnapshotDir key;
+	key.path = (char *) path;
+	return bsearch(&key, s->dirs, s->size, sizeof(SnapshotDir), SnapshotDirCompare);
+}
+
+/**
+ * a directory SnapshotCompareDir() is part way through, walking
+ * the entries of both snapshots at once
+ */
+typedef struct {
+	char * path;
+	const SnapshotDir * x;
+	const SnapshotDir * y;
+	size_t i, j;
+} SnapshotCompareFrame;
+
+/**
+ * puts `path` on top of `frames` if it differs between the
+ * snapshots. Takes `path`
+ */
+static int SnapshotCompareEnter(const Snapshot * a, const Snapshot * b, SnapshotCompareFrame ** frames, size_t * depth, size_t * capacity, char * path, size_t * visited, size_t * changes) {
+	const SnapshotDir * x = SnapshotFind(a, path);
+	const SnapshotDir * y = SnapshotFind(b, path);
+	if (!x || !y) {
+		printf("? %s\n", path);
+		(*changes)++;
+		BFFree(path);
+		return 1;
+	}
+
+	(*visited)++;
+	if (x->hash == y->hash) {
+		BFFree(path);
+		return 0;
+	}
+
+	if (*depth == *capacity) {
+		size_t cap = *capacity ? *capacity * 2 : 64;
+		SnapshotCompareFrame * arr = realloc(*frames, sizeof(SnapshotCompareFrame) * cap);
+		if (!arr) {
+			printf("? %s\n", path);
+			(*changes)++;
+			BFFree(path);
+			return 1;
+		}
+		*frames = arr;
+		*capacity = cap;
+	}
+
+	SnapshotCompareFrame * f = &(*frames)[(*depth)++];
+	f->path = path;
+	f->x = x;
+	f->y = y;
+	f->i = 0;
+	f->j = 0;
+
+	return 0;
+}
+
+/**
+ * prints what differs under `path`, only descending into
+ * directories whose hashes differ
+ *
+ * directories go on a stack of our own so deep trees can't
+ * overflow the C stack
+ *
+ * visited : counts the directories we had to look at
+ */
+int SnapshotCompareDir(const Snapshot * a, const Snapshot * b, const char * path, size_t * visited, size_t * changes) {
+	SnapshotCompareFrame * frames = NULL;
+	size_t depth = 0, capacity = 0;
+
+	char * root = BFStringCopyString(path);
+	if (!root) return 1;
+	int error = SnapshotCompareEnter(a, b, &frames, &depth, &capacity, root, visited, changes);
+
+	while (depth) {
+		SnapshotCompareFrame * top = &frames[depth - 1];
+		const SnapshotDir * x = top->x;
+		const SnapshotDir * y = top->y;
+		if ((top->i >= x->size) && (top->j >= y->size)) {
+			BFFree(top->path);
+			depth--;
+			continue;
+		}
+
+		// entries are stored in byte order so we can walk both at once
+		size_t i = top->i, j = top->j;
+		int cmp = (i == x->size) ? 1 : (j == y->size) ? -1 : strcmp(x->entries[i].name, y->entries[j].name);
+		if (cmp <= 0) top->i++;
+		if (cmp >= 0) top->j++;
+
+		if (!cmp && (x->entries[i].hash == y->entries[j].hash))
+			continue;
+
+		const SnapshotEntry * e = cmp <= 0 ? &x->entries[i] : &y->entries[j];
+		char * p = PathJoin(top->path, e->name);
+		if (!p) {
+			printf("? %s/%s\n", top->path, e->name);
+			(*changes)++;
+		} else if (cmp < 0) {
+			printf("- %s\n", p);
+			(*changes)++;
+		} else if (cmp > 0) {
+			printf("+ %s\n", p);
+			(*changes)++;
+		} else if ((x->entries[i].type == STAT_MOD_TYPE_DIR) && (y->entries[j].type == STAT_MOD_TYPE_DIR)) {
+			// may move the frames, `top` isn't used after
+			SnapshotCompareEnter(a, b, &frames, &depth, &capacity, p, visited, changes);
+			continue;
+		} else {
+			printf("~ %s\n", p);
+			(*changes)++;
+		}
+		BFFree(p);
+	}
+
+	BFFree(frames);
+
+	return error;
+}
+
+/**
+ * prints the differences between two snapshots
+ */
+int CompareSnapshots(const Arguments * args) {
+	Snapshot a, b;
+	if (SnapshotRead(&a, args->compare[0])) return 1;
+	if (SnapshotRead(&b, args->compare[1])) {
+		SnapshotRelease(&a);
+		return 1;
+	}
+
+	size_t visited = 0, changes = 0;
+	SnapshotCompareDir(&a, &b, ".", &visited, &changes);
+
+	if (!changes) {
+		printf("trees are the same\n");
+	} else {
+		printf("\n%zu difference%s, compared %zu of %zu directories\n", changes, changes == 1 ? "" : "s", visited, b.size);
+	}
+
+	SnapshotRelease(&a);
+	SnapshotRelease(&b);
+
+	return changes ? 1 : 0;
+}
+
+int GetInfo(const Arguments * args) {
+	if (!args) {
+		printf("error: args param is empty\n");
+		return 1;
+	}
+
+	if (args->nssfiles) {
+		if (IdNameTableLoad(&userNames, NSS_FILES_PASSWD) || IdNameTableLoad(&groupNames, NSS_FILES_GROUP)) {
+			IdNameTableRelease(&userNames);
+			return 1;
+		}
+	}
+
+	if (ColorTableLoad(&colorTable, args->colors)) {
+		IdNameTableRelease(&userNames);
+		IdNameTableRelease(&groupNames);
+		return 1;
+	}
+
+	// a resumed scan lists what the checkpoint has pending
+	// instead of the paths on the command line
+	Arguments resumed;
+	if (args->resume) {
+		resumed = *args;
+		memset(&resumed.paths, 0, sizeof(PathList));
+		bool recursive = false;
+		if (CheckpointResume(&checkpoint, args->resume, &resumed.paths, &recursive)) {
+			PathListRelease(&resumed.paths);
+			return 1;
+		}
+		resumed.recursive = recursive;
+		args = &resumed;
+	} else if (args->checkpoint && CheckpointCreate(&checkpoint, args->checkpoint, &args->paths, args->recursive)) {
+		return 1;
+	}
+
+	if (PathListMarkSharedDirs(&args->paths, args->recursive, &sharedDirs)) {
+		printf("error: couldn't compare input paths\n");
+	}
+
+	CancelTokenCreate(&cancelToken, args->timeout, args->maxentries);
+
+	// the thread listing a directory is one of them
+	unsigned int statthreads = args->statthreads ? args->statthreads : args->threads;
+	atomic_store(&statHelpersFree, statthreads > 1 ? statthreads - 1 : 0);
+	RateLimiterCreate(&statLimiter, args->maxstatrate);
+
+	// paths alone don't need what lstat has to say
+	if (args->fullpaths) {
+		listingFlags |= DIR_LISTING_NAMES;
+	}
+	SemaphoreCreate(&dirReadSlots, args->maxdirreads);
+	if (args->ioprio) {
+		SetIoPriority(args->ioprio);
+	}
+
+	// slot 0 is this thread, workers take the rest
+	if (args->progress) {
+		size_t nslots = 1 + (args->threads ? args->threads : 1);
+		if (ProgressStart(&progress, nslots, args->paths.sizedir, args->recursive)) {
+			printf("error: couldn't start progress reporting\n");
+		}
+		ProgressAttach(&progress, 0);
+	}
+
+	int result = 0;
+	if (args->compare[0]) {
+		result = CompareSnapshots(args);
+	} else if (args->snapshot) {
+		result = GetSnapshot(args);
+	} else if (args->duplicates) {
+		GetDuplicates(args);
+
+	// only the parallel path can walk away from a
+	// thread stuck on a hung mount
+	} else if ((args->threads > 1) || args->timeout) {
+		GetInfoParallel(args);
+	} else {
+		GetInfoSequential(args);
+	}
+
+	ProgressStop(&progress);
+
+	// paths are read by other programs, so nothing else
+	// may go in between them
+	FILE * report = args->fullpaths ? stderr : stdout;
+
+	// a listing can also be cut short by a failed read
+	bool cancelled = CancelTokenIsCancelled(&cancelToken);
+	if (cancelled || unfinishedDirs.size) {
+		UnfinishedDirsPrint(&unfinishedDirs, &cancelToken, report);
+		result = 1;
+	}
+	UnfinishedDirsRelease(&unfinishedDirs);
+
+	if (checkpoint.fd != -1) {
+		// entries aren't lstat'ed for paths, so there are
+		// no sizes to add up
+		if (!cancelled && args->fullpaths) {
+			fprintf(report, "\ntotal: %" PRIu64 " directories, %" PRIu64 " entries\n",
+				(uint64_t) atomic_load(&checkpoint.dirs),
+				(uint64_t) atomic_load(&checkpoint.entries));
+		} else if (!cancelled) {
+			fprintf(report, "\ntotal: %" PRIu64 " directories, %" PRIu64 " entries, %" PRIu64 " bytes\n",
+				(uint64_t) atomic_load(&checkpoint.dirs),
+				(uint64_t) atomic_load(&checkpoint.entries),
+				(uint64_t) atomic_load(&checkpoint.bytes));
+		}
+		if (CheckpointClose(&checkpoint, !cancelled)) result = 1;
+	}
+	if (args == &resumed) {
+		PathListRelease(&resumed.paths);
+	}
+
+	IdTableRelease(&listingCache, DirListingReleaseValue);
+	IdTableRelease(&sharedDirs, NULL);
+	IdNameTableRelease(&userNames);
+	IdNameTableRelease(&groupNames);
+	ColorTableRelease(&colorTable);
+	LinkCountRelease(&linkCountUnreliable);
+
+	return result;
+}
+
+#ifdef TESTING
+
+#include <bflibc/bftests.h>
+#include <time.h>
+
+int test_ArraySort(void) {
+	UNIT_TEST_START;
+	int result = 0;
+	int max = 1;
+
+	while (!result && max--) {
+		char * arr[] = {"e", "d", "c", "b", "a"};
+		size_t size = sizeof(arr) / sizeof(arr[0]);
+		
+		result = ArraySort(arr, size);
+		if (result) continue;
+
+		for (int i = 0; i < (size-1); i++) {
+			if (strcmp(arr[i], arr[i + 1]) > 0) {
+				result = 2;
+				break;
+			}
+		}
+	}
+
+	UNIT_TEST_END(!result, result);
+	return result;
+}
+
+int test_RemovingTrailingSlashesForRootPath(void) {
+	UNIT_TEST_START;
+	int result = 0;
+	int max = PATH_MAX - 1;
+
+	char buf[PATH_MAX];
+	strncpy(buf, "/", PATH_MAX);
+	while (!result && max--) {
+		RemoveTrailingForwardSlashes(buf);
+		if (strcmp(buf, "/")) {
+			result = max;
+		}
+
+		// add another slash
+		size_t s = strlen(buf);
+		buf[s] = '/';
+		buf[s+1] = '\0';
+	}
+
+	UNIT_TEST_END(!result, result);
+	return result;
+}
+
+int test_RemovingTrailingSlashes(void) {
+	UNIT_TEST_START;
+	int result = 0;
+	int max = 1;
+
+	while (!result && max--) {
+		char buf[PATH_MAX];
+		snprintf(buf, PATH_MAX, "/hello/world/");
+		RemoveTrailingForwardSlashes(buf);
+		if (strcmp(buf, "/hello/world")) {
+			result = max;
+		}
+	}
+
+	UNIT_TEST_END(!result, result);
+	return result;
+}
+
+int test_RemovingLeadingPeriodAndSlashes(void) {
+	UNIT_TEST_START;
+	int result = 0;
+	int max = 2 << 8;
+
+	while (!result && max--) {
+		char buf[PATH_MAX];
+		snprintf(buf, PATH_MAX, "./hello/world");
+		RemoveLeadingPeriodAndForwardSlashes(buf);
+		if (strcmp(buf, "hello/world")) {
+			result = max;
+		}
+	}
+
+	UNIT_TEST_END(!result, result);
+	return result;
+
+}
+
+int test_PathIsAncestor(void) {
+	UNIT_TEST_START;
+	int result = 0;
+	int max = 1;
+
+	while (!result && max--) {
+		if (!PathIsAncestor("/data", "/data/a")) result = 1;
+		else if (!PathIsAncestor("/", "/data")) result = 2;
+		else if (PathIsAncestor("/data", "/data-x")) result = 3;
+		else if (PathIsAncestor("/data", "/data")) result = 4;
+		else if (PathCompareByComponent(
+			(const unsigned char *) "/data/a",
+			(const unsigned char *) "/data-x") >= 0) result = 5;
+	}
+
+	UNIT_TEST_END(!result, result);
+	return result;
+}
+
+int test_DirTaskCompare(void) {
+	UNIT_TEST_START;
+	int result = 0;
+	int max = 1;
+
+	while (!result && max--) {
+		DirTask * a = DirTaskCreate(NULL, 0, 2, "a", NULL);
+		DirTask * b = DirTaskCreate(NULL, 1, 2, "b", NULL);
+		DirTask * a0 = DirTaskCreate(a, 0, 2, "a/x", NULL);
+		DirTask * a1 = DirTaskCreate(a, 1, 2, "a/y", NULL);
+		DirTask * a10 = DirTaskCreate(a1, 0, 1, "a/y/z", NULL);
+
+		if (DirTaskCompare(a, b) >= 0) result = 1;
+		else if (DirTaskCompare(a, a0) >= 0) result = 2;
+		else if (DirTaskCompare(a10, b) >= 0) result = 3;
+		else if (DirTaskCompare(a0, a10) >= 0) result = 4;
+		else if (DirTaskCompare(a10, a1) <= 0) result = 5;
+		else if (DirTaskCompare(a1, a1) != 0) result = 6;
+
+		// wide enough to use up the key range, so the
+		// deepest ones have to be ordered by walking
+		DirTask * w[5];
+		w[0] = DirTaskCreate(a1, 1, 2, "a/y/w", NULL);
+		for (int i = 1; i < 5; i++) {
+			w[i] = DirTaskCreate(w[i - 1], 7, UINT64_MAX / 4, "w", NULL);
+		}
+		DirTask * w5 = DirTaskCreate(w[3], 3, UINT64_MAX / 4, "v", NULL);
+
+		if (!result && w[4]->exact) result = 7;
+		else if (DirTaskCompare(w[4], b) >= 0) result = 8;
+		else if (DirTaskCompare(a10, w[4]) >= 0) result = 9;
+		else if (DirTaskCompare(w[3], w[4]) >= 0) result = 10;
+		else if (DirTaskCompare(w5, w[4]) >= 0) result = 11;
+		else if (DirTaskCompare(w[4], w5) <= 0) result = 12;
+
+		DirTaskRelease(w5);
+		for (int i = 4; i >= 0; i--) {
+			DirTaskRelease(w[i]);
+		}
+		DirTaskRelease(a10);
+		DirTaskRelease(a1);
+		DirTaskRelease(a0);
+		DirTaskRelease(b);
+		DirTaskRelease(a);
+	}
+
+	UNIT_TEST_END(!result, result);
+	return result;
+}
+
+int test_Hash64(void) {
+	UNIT_TEST_START;
+	int result = 0;
+	int max = 1;
+
+	while (!result && max--) {
+		Hash64 h;
+		Hash64Init(&h, 0);
+		if (Hash64Digest(&h) != 0xEF46DB3751D8E999ULL) {
+			result = 1;
+			break;
+		}
 
-	printf("| %-1c-%03o %-21s %10s %s%s%s%s", modetype, m, dt, sizebuf,
-			color,
-			path,
-			ANSI_COLOR_RESET,
-			strlen(linkdesc) == 0 ? "" : linkdesc);
+		Hash64Init(&h, 0);
+		Hash64Update(&h, "abc", 3);
+		if (Hash64Digest(&h) != 0x44BC2CF5AD770999ULL) {
+			result = 2;
+			break;
+		}
 
-	printf("\n");
+		// long input fed in uneven pieces
+		unsigned char buf[768];
+		for (int i = 0; i < sizeof(buf); i++) buf[i] = (unsigned char) i;
+		Hash64Init(&h, 0);
+		Hash64Update(&h, buf, 5);
+		Hash64Update(&h, buf + 5, 100);
+		Hash64Update(&h, buf + 105, sizeof(buf) - 105);
+		if (Hash64Digest(&h) != 0x8E03C838C596036FULL) {
+			result = 3;
+			break;
+		}
+	}
 
-	return 0;
+	UNIT_TEST_END(!result, result);
+	return result;
 }
 
-/**
- * assuming permissions follows = ||||||R|W|X|
- */
-int PermissionsGetStringDescription(const mode_t permissions, char * buf, const size_t bufsize) {
-	if (!buf) return 1;
+int test_LineCount(void) {
+	UNIT_TEST_START;
+	int result = 0;
+	int max = 1;
 
-	memset(buf, 0, bufsize);
-	const char * arr[] = {"Executable", "Writable", "Readable"};
-	const size_t size = sizeof(arr) / sizeof(arr[0]);
+	while (!result && max--) {
+		LineCount c;
+		LineCountInit(&c);
+		LineCountUpdate(&c, "\na\n\nb", 6);
+		if ((c.lines != 3) || (LineCountGetNonEmpty(&c) != 2)) {
+			result = 1;
+			break;
+		}
 
-	for (int i = 0; i < size; i++) {
-		if (permissions & (0x01 << i)) {
-			if (strlen(buf)) {
-				strcat(buf, ", ");
+		// the simd kernels have to agree with the scalar one,
+		// including across block and buffer boundaries
+		char buf[1000];
+		for (int i = 0; i < sizeof(buf); i++)
+			buf[i] = (i % 7 == 0) || (i % 11 == 0) || (i % 31 < 3) ? '\n' : 'x';
+
+		LineCount scalar;
+		LineCountInit(&scalar);
+		LineCountScalar(&scalar, (const unsigned char *) buf, sizeof(buf));
+
+		for (size_t split = 0; split < 70; split++) {
+			LineCountInit(&c);
+			LineCountUpdate(&c, buf, split);
+			LineCountUpdate(&c, buf + split, sizeof(buf) - split);
+			if ((c.lines != scalar.lines) || (c.empty != scalar.empty) || (c.newline != scalar.newline)) {
+				result = 2;
+				break;
 			}
-			strcat(buf, arr[i]);
 		}
 	}
-	
-	return 0;
+
+	UNIT_TEST_END(!result, result);
+	return result;
 }
 
-int PathQueryPrintPathDetail(
-	const char * path,
-	const char modetype,
-	const mode_t m,
-	BFTime modtime,
-	BFTime accesstime,
-	BFTime changetime,
-	const char * sizebuf,
-	const char * color,
-	const char * linkdesc,
-	uid_t owner,
-	gid_t group
-) {
-	char res[2 << 8];
-	char fullpath[PATH_MAX];
-	realpath(path, fullpath);
+int test_ContentTypeSniff(void) {
+	UNIT_TEST_START;
+	int result = 0;
+	int max = 1;
 
-	printf("Information for '%s'\n", path);
-	printf("-----------------------------\n");
+	while (!result && max--) {
+		unsigned char head[32];
 
-	struct passwd * pws = getpwuid(owner);
-	printf("Owner: %s\n", pws->pw_name);
+		memset(head, 0, sizeof(head));
+		memcpy(head, "\x28\xb5\x2f\xfd\x24", 5);
+		if (strcmp(ContentTypeSniff(head, 5), "zstd")) result = 1;
 
-	struct group * g = getgrgid(group);
-	printf("Group: %s\n", g->gr_name);
+		// too short to be a png
+		memset(head, 0, sizeof(head));
+		memcpy(head, "\x89PNG", 4);
+		if (!result && !strcmp(ContentTypeSniff(head, 4), "png")) result = 2;
 
-	printf("Type: %s\n", StatModeTypeGetStringDescription(modetype));
-	printf("Full path: %s%s%s\n", color, fullpath, ANSI_COLOR_RESET);
-	if (strlen(linkdesc) > 0)
-		printf("Link: %s\n", linkdesc);
-	
-	printf("Size: %s\n", sizebuf);
+		memset(head, 0, sizeof(head));
+		memcpy(head, "caf\xc3\xa9\n", 6);
+		if (!result && strcmp(ContentTypeSniff(head, 6), "utf-8")) result = 3;
 
-	TimeGetString(modtime, res, sizeof(res));
-	printf("Date Modified: %s\n", res);
+		// a cut off sequence at the end is still text
+		memset(head, 0, sizeof(head));
+		memcpy(head, "ab\xe2\x82", 4);
+		if (!result && strcmp(ContentTypeSniff(head, 4), "utf-8")) result = 4;
 
-	TimeGetString(accesstime, res, sizeof(res));
-	printf("Date Access: %s\n", res);
+		memset(head, 0, sizeof(head));
+		memcpy(head, "ab\x00" "cd", 5);
+		if (!result && strcmp(ContentTypeSniff(head, 5), "binary")) result = 5;
 
-	TimeGetString(changetime, res, sizeof(res));
-	printf("Date Metadata Changed: %s\n", res);
+		if (!result && strcmp(ContentTypeSniff(head, 0), "empty")) result = 6;
+	}
 
-	printf("Permissions:\n");
+	UNIT_TEST_END(!result, result);
+	return result;
+}
 
-	// recall mode_t is an octal variable
-	PermissionsGetStringDescription((m & S_IRWXU) >> (3 * 2), res, sizeof(res));
-	printf("  Owner: %s\n", res);
+int test_IdNameTable(void) {
+	UNIT_TEST_START;
+	int result = 0;
+	int max = 1;
 
-	PermissionsGetStringDescription((m & S_IRWXG) >> (3 * 1), res, sizeof(res));
-	printf("  Group: %s\n", res);
+	while (!result && max--) {
+		const char * passwd =
+			"root:x:0:0:root:/root:/bin/bash\n"
+			"# comment:x:5:5\n"
+			"+nis::::::\n"
+			"daemon:x:1:1::/:/sbin/nologin\n"
+			"broken:x:12a:1\n"
+			"toor:x:0:0::/root:/bin/sh\n"
+			"nobody:x:65534:65534::/:/sbin/nologin";
 
-	PermissionsGetStringDescription((m & S_IRWXO) >> (3 * 0), res, sizeof(res));
-	printf("  Other: %s\n", res);
+		IdNameTable t;
+		if (IdNameTableParse(&t, passwd, strlen(passwd))) result = 1;
 
-	return 0;
-}
+		if (!result && (t.size != 4)) result = 2;
 
-int PathQueryPrintPath(const PathQuery * path, const Arguments * args) {
-	if (!args || !path) return false;
+		// first line with an id wins
+		const char * name = IdNameTableFind(&t, 0);
+		if (!result && (!name || strcmp(name, "root"))) result = 3;
 
-	char p[PATH_MAX];
-	PathQueryGetPath(path, p);
+		name = IdNameTableFind(&t, 65534);
+		if (!result && (!name || strcmp(name, "nobody"))) result = 4;
 
-	// get info
-	struct stat st;
+		if (!result && IdNameTableFind(&t, 5)) result = 5;
+		if (!result && IdNameTableFind(&t, 12)) result = 6;
 
-	// see if file is a symlink
-	if (lstat(p, &st) == -1) {
-		printf("error: (path: %s) lstat %d\n", p, errno);
-		return 1;
+		IdNameTableRelease(&t);
 	}
 
-	char buf[PATH_MAX];
-	char linkdesc[PATH_MAX];
-	memset(linkdesc, 0, sizeof(linkdesc));
-	memset(buf, 0, sizeof(buf));
+	UNIT_TEST_END(!result, result);
+	return result;
+}
 
-	// if the file isn't a symlink, default to 
-	// reading it as a reg entry
-	//
-	// if link, then we will describe what
-	// it is pointing to
-	if (!S_ISLNK(st.st_mode)) {
-		if (stat(p, &st) == -1) {
-			printf("error: stat %d\n", errno);
-			return 1;
-		}
-	} else {
-		snprintf(linkdesc, PATH_MAX, " -> %s", 
-				readlink(p, buf, sizeof(buf)) == -1 ? 
-				"?" : buf);
-	}
+int test_ColorTable(void) {
+	UNIT_TEST_START;
+	int result = 0;
+	int max = 1;
 
-	// get size of entry
-	// will not do recursion
-	size_t size = st.st_size;
-	char sizebuf[64];
-	int error = BFByteGetString(size, 0, sizebuf);
-	if (error)
-		return error;
+	while (!result && max--) {
+		ColorTable t = {0};
+		if (ColorTableParse(&t, "di=01;34:ex=01;32:*.tar=01;31:*.GZ=01;31\n# comment:fi=0\n*README=33:*.jpg=35:*.JPG=36"))
+			result = 1;
 
-	// get permissions
-	const mode_t m = st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO);
+		struct stat st;
+		memset(&st, 0, sizeof(st));
 
-	// Get type of item this is at path
-	const char modetype = StatGetModeType(&st);
+		st.st_mode = S_IFDIR | 0755;
+		if (!result && strcmp(ColorTableGet(&t, &st, "src"), "\x1b[01;34m")) result = 2;
 
-	// color we will use to print
-	const char * color = StatGetModeTypeColor(&st);
+		// sticky, world writable dirs fall back to di
+		st.st_mode = S_IFDIR | S_ISVTX | 0777;
+		if (!result && strcmp(ColorTableGet(&t, &st, "tmp"), "\x1b[01;34m")) result = 3;
 
-	// get printable path
-	// making sure there are no redundant characters
-	char item[PATH_MAX];
-	if (GetPrintablePath(path, item, args)) {
-		printf("error: couldn't get printable path\n");
-		return 1;
-	}
+		st.st_mode = S_IFREG | 0644;
+		if (!result && strcmp(ColorTableGet(&t, &st, "a.tar"), "\x1b[01;31m")) result = 4;
+		if (!result && strcmp(ColorTableGet(&t, &st, "a.gz"), "\x1b[01;31m")) result = 5;
+		if (!result && strcmp(ColorTableGet(&t, &st, "README"), "\x1b[33m")) result = 6;
 
-	// will only do it if the user asked for information for
-	// ONE file
-	bool shouldPrintInDetail = PathListGetSize(&args->paths) == 1 &&
-		PathQueryGetLevel(path) == 0;
+		// later patterns win, whatever the case
+		if (!result && strcmp(ColorTableGet(&t, &st, "a.jpg"), "\x1b[36m")) result = 7;
 
-	if (shouldPrintInDetail) {
-		return PathQueryPrintPathDetail(
-			item,
-			modetype, m,
-			st.st_mtime,
-			st.st_atime,
-			st.st_ctime,
-			sizebuf,
-			color,
-			strlen(linkdesc) == 0 ? "" : linkdesc,
-			st.st_uid, st.st_gid);
-	} else {
-		return PathQueryPrintPathBrief(
-			item,
-			modetype, m,
-			st.st_mtime,
-			sizebuf,
-			color,
-			strlen(linkdesc) == 0 ? "" : linkdesc);
+		// the comment swallowed fi, so this is the built in color
+		if (!result && strcmp(ColorTableGet(&t, &st, "a.c"), StatGetModeTypeColor(&st))) result = 8;
+
+		st.st_mode = S_IFREG | 0755;
+		if (!result && strcmp(ColorTableGet(&t, &st, "run.tar"), "\x1b[01;32m")) result = 9;
+
+		ColorTableRelease(&t);
 	}
+
+	UNIT_TEST_END(!result, result);
+	return result;
 }
 
-int PathQueryPrintDir(const PathQuery * dir, const Arguments * args) {
-	if (!dir || !args) return 1;
+int test_SizeGetString(void) {
+	UNIT_TEST_START;
+	int result = 0;
+	int max = 1;
 
-	char p[PATH_MAX];
-	PathQueryGetPath(dir, p);
+	while (!result && max--) {
+		char buf[SIZE_STRING_MAX];
+		SizeFormat f = { SIZE_FORMAT_BYTES, 0 };
 
-	struct dirent ** namelist = NULL;
-	int n = scandir(p, &namelist, NULL, alphasort);
-	if (n == -1) {
-		printf("error: couldn't scan dir %s\n", p);
-		return 1;
-	}
+		SizeGetString(0, f, buf);
+		if (strcmp(buf, "0")) result = 1;
 
-	bool shouldLabel = PathListGetSize(&args->paths) > 1;
+		SizeGetString(UINT64_MAX, f, buf);
+		if (!result && strcmp(buf, "18446744073709551615")) result = 2;
 
-	if (shouldLabel) {
-		printf("\n%s:\n", p);
-	}
+		f.kind = SIZE_FORMAT_IEC;
+		SizeGetString(1023, f, buf);
+		if (!result && strcmp(buf, "1023 B")) result = 3;
 
-	for (int i = 0; i < n; i++) {
-		if (strcmp(namelist[i]->d_name, ".") && strcmp(namelist[i]->d_name, "..")) {
-			char p[PATH_MAX];
-			snprintf(p, PATH_MAX, "%s/%s", p, namelist[i]->d_name);
+		SizeGetString(1536, f, buf);
+		if (!result && strcmp(buf, "1.50 KiB")) result = 4;
 
-			PathQuery path;
-			if (PathQueryCreateChild(dir, &path, namelist[i]->d_name)) {
-				printf("error: couldn't create path query for %s\n", p);
-				continue;
-			}
+		// 1048575 is 1023.999 KiB, which rounds up
+		SizeGetString(1048575, f, buf);
+		if (!result && strcmp(buf, "1024.00 KiB")) result = 5;
 
-			if (args->recursive && (namelist[i]->d_type == DT_DIR)) { // is dir
-				// TODO: make some recursive thing
-			} else {
-				if (PathQueryPrintPath(&path, args)) {
-					printf("error: path couldn't be worked on %s\n", p);
-				}
-			}
+		SizeGetString(UINT64_MAX, f, buf);
+		if (!result && strcmp(buf, "16.00 EiB")) result = 6;
 
-			PathQueryRelease(&path);
-		}
-		free(namelist[i]);
+		f.kind = SIZE_FORMAT_SI;
+		SizeGetString(999, f, buf);
+		if (!result && strcmp(buf, "999 B")) result = 7;
+
+		SizeGetString(1234567, f, buf);
+		if (!result && strcmp(buf, "1.23 MB")) result = 8;
+
+		f.kind = SIZE_FORMAT_FIXED_IEC;
+		f.unit = 2;
+		SizeGetString(5 << 10, f, buf);
+		if (!result && strcmp(buf, "0.00 MiB")) result = 9;
+
+		SizeGetString(3 << 20, f, buf);
+		if (!result && strcmp(buf, "3.00 MiB")) result = 10;
 	}
-	free(namelist);
 
-	return 0;
+	UNIT_TEST_END(!result, result);
+	return result;
 }
 
-int GetInfo(const Arguments * args) {
-	if (!args) {
-		printf("error: args param is empty\n");
-		return 1;
-	}
+int test_PermissionsGetSymbolic(void) {
+	UNIT_TEST_START;
+	int result = 0;
+	int max = 1;
 
-	for (int i = 0; i < PathListGetSize(&args->paths); i++) {
-		char currpath[PATH_MAX];
+	while (!result && max--) {
+		char buf[PERMISSIONS_SYMBOLIC_SIZE];
 
-		if (PathListGetPathAtIndex(&args->paths, i, currpath)) {
-			printf("error: couldn't get path at index\n");
-			continue;
-		}
+		PermissionsGetSymbolic(0644, buf);
+		if (strcmp(buf, "rw-r--r--")) result = 1;
 
-		PathQuery path;
-		if (PathQueryCreate(&path, currpath)) {
-			printf("error: couldn't create the path struct\n");
-			continue;
-		}
+		PermissionsGetSymbolic(S_ISUID | 0755, buf);
+		if (!result && strcmp(buf, "rwsr-xr-x")) result = 2;
 
-		int err = 0;
-		if (PathQueryIsFile(&path)) {
-			err = PathQueryPrintPath(&path, args);
-		} else {
-			err = PathQueryPrintDir(&path, args);
-		}
+		PermissionsGetSymbolic(S_ISGID | 0640, buf);
+		if (!result && strcmp(buf, "rw-r-S---")) result = 3;
 
-		if (err) {
-			printf("error: code - %d, path couldn't be worked on %s\n", err, currpath);
-		}
+		PermissionsGetSymbolic(S_ISVTX | 0777, buf);
+		if (!result && strcmp(buf, "rwxrwxrwt")) result = 4;
 
-		PathQueryRelease(&path);
+		char desc[PERMISSIONS_DESCRIPTION_SIZE];
+		PermissionsGetStringDescription(05, desc, sizeof(desc));
+		if (!result && strcmp(desc, "Executable, Readable")) result = 5;
 	}
 
-	return 0;
+	UNIT_TEST_END(!result, result);
+	return result;
 }
 
-#ifdef TESTING
-
-#include <bflibc/bftests.h>
-#include <time.h>
-
-int test_ArraySort(void) {
+int test_ArgumentsParseNumbers(void) {
 	UNIT_TEST_START;
 	int result = 0;
 	int max = 1;
 
 	while (!result && max--) {
-		char * arr[] = {"e", "d", "c", "b", "a"};
-		size_t size = sizeof(arr) / sizeof(arr[0]);
-		
-		result = ArraySort(arr, size);
-		if (result) continue;
+		size_t n = 0;
 
-		for (int i = 0; i < (size-1); i++) {
-			if (strcmp(arr[i], arr[i + 1]) > 0) {
-				result = 2;
-				break;
-			}
-		}
+		if (ArgumentsParseSize("2K", &n) || (n != 2048)) result = 1;
+		if (!result && !ArgumentsParseSize("18446744073709551615G", &n)) result = 2;
+		if (!result && !ArgumentsParseSize("-1", &n)) result = 3;
+
+		if (!result && (ArgumentsParseCount("64", 1024, &n) || (n != 64))) result = 4;
+		if (!result && !ArgumentsParseCount("1K", 1024, &n)) result = 5;
+		if (!result && !ArgumentsParseCount("1025", 1024, &n)) result = 6;
+		if (!result && !ArgumentsParseCount("-1", SIZE_MAX, &n)) result = 7;
+		if (!result && !ArgumentsParseCount(" 1", SIZE_MAX, &n)) result = 8;
 	}
 
 	UNIT_TEST_END(!result, result);
 	return result;
 }
 
-int test_RemovingTrailingSlashesForRootPath(void) {
+int test_PathQueryGetPath(void) {
 	UNIT_TEST_START;
 	int result = 0;
-	int max = PATH_MAX - 1;
+	int max = 1;
 
-	char buf[PATH_MAX];
-	strncpy(buf, "/", PATH_MAX);
 	while (!result && max--) {
-		RemoveTrailingForwardSlashes(buf);
-		if (strcmp(buf, "/")) {
-			result = max;
+		char buf[PATH_MAX];
+		DirStack stack = {0};
+
+		DirFrame * f = DirStackPush(&stack);
+		if (!f || PathQueryCreate(&f->own, "dir/")) result = 1;
+		if (!result) f->dir = &f->own;
+
+		// deeper than PATH_MAX allows, so the path gets cut short
+		for (int i = 0; !result && (i < 3000); i++) {
+			DirFrame * parent = stack.frames[stack.depth - 1];
+			f = DirStackPush(&stack);
+			if (!f || PathQueryCreateChild(parent->dir, &f->own, "a")) result = 2;
+			if (!result) f->dir = &f->own;
+
+			if (!result && (i == 1)) {
+				PathQueryGetPath(f->dir, buf);
+				if (strcmp(buf, "dir/a/a")) result = 3;
+			}
 		}
 
-		// add another slash
-		size_t s = strlen(buf);
-		buf[s] = '/';
-		buf[s+1] = '\0';
+		if (!result) {
+			char * full = PathQueryCopyPath(f->dir);
+			if (!PathQueryGetPath(f->dir, buf)) result = 4;
+			else if (strlen(buf) != PATH_MAX - 1) result = 4;
+			else if (strncmp(buf, "dir/a/a/", 8)) result = 5;
+			else if (!full || (strlen(full) != 3 + 3000 * 2)) result = 5;
+			BFFree(full);
+		}
+
+		DirStackRelease(&stack);
+
+		PathQuery root;
+		if (!result && PathQueryCreate(&root, "/")) result = 6;
+		if (!result) {
+			PathQueryGetPath(&root, buf);
+			if (strcmp(buf, "/")) result = 7;
+
+			PathQuery child;
+			if (PathQueryCreateChild(&root, &child, "a")) result = 8;
+			if (!result) {
+				char * full = PathQueryCopyPath(&child);
+				PathQueryGetPath(&child, buf);
+				if (strcmp(buf, "/a") || !full || strcmp(full, "/a")) result = 9;
+				BFFree(full);
+				PathQueryRelease(&child);
+			}
+
+			PathQueryRelease(&root);
+		}
 	}
 
 	UNIT_TEST_END(!result, result);
 	return result;
 }
 
-int test_RemovingTrailingSlashes(void) {
+int test_PathQueryPrintListingPaths(void) {
 	UNIT_TEST_START;
 	int result = 0;
 	int max = 1;
 
 	while (!result && max--) {
-		char buf[PATH_MAX];
-		snprintf(buf, PATH_MAX, "/hello/world/");
-		RemoveTrailingForwardSlashes(buf);
-		if (strcmp(buf, "/hello/world")) {
-			result = max;
-		}
+		DirEntry entries[2];
+		memset(entries, 0, sizeof(entries));
+		entries[0].name = "a";
+		entries[1].name = "bc";
+
+		DirListing listing;
+		memset(&listing, 0, sizeof(listing));
+		listing.entries = entries;
+		listing.size = 2;
+
+		Arguments args;
+		memset(&args, 0, sizeof(args));
+		args.fullpaths = true;
+
+		OutputBuffer out;
+		memset(&out, 0, sizeof(out));
+
+		if (PathQueryPrintListingPaths("x/y", &listing, &args, &out, NULL)) result = 1;
+		if (!result && ((out.size != 13) || memcmp(out.data, "x/y/a\nx/y/bc\n", 13))) result = 2;
+
+		out.size = 0;
+		args.nul = true;
+		if (!result && PathQueryPrintListingPaths("x/y", &listing, &args, &out, NULL)) result = 3;
+		if (!result && ((out.size != 13) || memcmp(out.data, "x/y/a\0x/y/bc\0", 13))) result = 4;
+
+		// no doubled separator after the root directory
+		out.size = 0;
+		args.nul = false;
+		if (!result && PathQueryPrintListingPaths("/", &listing, &args, &out, NULL)) result = 5;
+		if (!result && ((out.size != 7) || memcmp(out.data, "/a\n/bc\n", 7))) result = 6;
+
+		OutputBufferRelease(&out);
 	}
 
 	UNIT_TEST_END(!result, result);
 	return result;
 }
 
-int test_RemovingLeadingPeriodAndSlashes(void) {
+int test_DirStackOpen(void) {
 	UNIT_TEST_START;
 	int result = 0;
-	int max = 2 << 8;
+	int max = 1;
 
 	while (!result && max--) {
+		// deeper than PATH_MAX / 2 levels, so the full path
+		// can't be used below the middle
+		const int levels = PATH_MAX / 2 + 64;
+
+		char root[] = "/tmp/listdir-test-XXXXXX";
+		if (!mkdtemp(root)) {
+			result = 1;
+			break;
+		}
+
+		int fd = open(root, O_RDONLY | O_DIRECTORY);
+		for (int i = 0; (fd != -1) && (i < levels); i++) {
+			int next = -1;
+			if (!mkdirat(fd, "a", 0755))
+				next = openat(fd, "a", O_RDONLY | O_DIRECTORY);
+			close(fd);
+			fd = next;
+		}
+
+		int file = fd == -1 ? -1 : openat(fd, "f", O_WRONLY | O_CREAT, 0644);
+		if (file == -1) result = 2;
+		else close(file);
+		if (fd != -1) close(fd);
+
+		DirStack stack = {0};
+		DirFrame * f = DirStackPush(&stack);
+		if (!result && (!f || PathQueryCreate(&f->own, root))) result = 3;
+		if (!result) {
+			f->dir = &f->own;
+			if (DirStackOpen(&stack)) result = 4;
+		}
+
+		for (int i = 0; !result && (i < levels); i++) {
+			DirFrame * parent = stack.frames[stack.depth - 1];
+			f = DirStackPush(&stack);
+			if (!f || PathQueryCreateChild(parent->dir, &f->own, "a")) result = 5;
+			if (!result) {
+				f->dir = &f->own;
+				if (DirStackOpen(&stack)) result = 6;
+				else if (stack.open > DIR_STACK_OPEN_MAX) result = 7;
+			}
+		}
+
+		// the bottom is read through its descriptor, not by a
+		// path cut short to one of its ancestors
+		DirListing listing;
+		memset(&listing, 0, sizeof(listing));
+		if (!result && DirListingCreateFromFd(&listing, f->dir->fd, "?", 0)) result = 8;
+		if (!result && ((listing.size != 1) || strcmp(listing.entries[0].name, "f"))) result = 9;
+		if (!result && (listing.entries[0].error || !S_ISREG(listing.entries[0].st.st_mode))) result = 10;
+		DirListingRelease(&listing);
+
 		char buf[PATH_MAX];
-		snprintf(buf, PATH_MAX, "./hello/world");
-		RemoveLeadingPeriodAndForwardSlashes(buf);
-		if (strcmp(buf, "hello/world")) {
-			result = max;
+		PathQuery entry;
+		if (!result && PathQueryCreateChild(f->dir, &entry, "f")) result = 11;
+		if (!result) {
+			struct stat st;
+			if (!PathQueryGetPath(&entry, buf)) result = 12;
+#ifdef LINUX
+			else if (PathQueryGetAccessPath(&entry, buf) || lstat(buf, &st) || !S_ISREG(st.st_mode)) result = 13;
+#endif
+			PathQueryRelease(&entry);
+		}
+
+		// frames near the top were closed on the way down and
+		// have to be opened again
+		while (!result && (stack.depth > 3)) {
+			DirStackPop(&stack);
+		}
+		if (!result && (stack.frames[1]->dir->fd != -1)) result = 14;
+		if (!result) {
+			DirFrame * parent = stack.frames[stack.depth - 1];
+			f = DirStackPush(&stack);
+			if (!f || PathQueryCreateChild(parent->dir, &f->own, "a")) result = 15;
+			if (!result) {
+				f->dir = &f->own;
+				if (DirStackOpen(&stack)) result = 16;
+			}
+		}
+
+		DirStackRelease(&stack);
+
+		// moves each level up in its parent's place, so the
+		// tree is removed without any long path
+		int rootfd = open(root, O_RDONLY | O_DIRECTORY);
+		while ((rootfd != -1) && !renameat(rootfd, "a/a", rootfd, "b")) {
+			unlinkat(rootfd, "a", AT_REMOVEDIR);
+			renameat(rootfd, "b", rootfd, "a");
 		}
+		if (rootfd != -1) {
+			unlinkat(rootfd, "a/f", 0);
+			unlinkat(rootfd, "a", AT_REMOVEDIR);
+			close(rootfd);
+		}
+		rmdir(root);
 	}
 
 	UNIT_TEST_END(!result, result);
 	return result;
-
 }
 
 int TOOL_TEST(int argc, char ** argv) {
@@ -909,6 +8554,19 @@ int TOOL_TEST(int argc, char ** argv) {
 	LAUNCH_TEST(test_RemovingTrailingSlashes, p, f);
 	LAUNCH_TEST(test_RemovingLeadingPeriodAndSlashes, p, f);
 	LAUNCH_TEST(test_RemovingTrailingSlashesForRootPath, p, f);
+	LAUNCH_TEST(test_PathIsAncestor, p, f);
+	LAUNCH_TEST(test_DirTaskCompare, p, f);
+	LAUNCH_TEST(test_Hash64, p, f);
+	LAUNCH_TEST(test_LineCount, p, f);
+	LAUNCH_TEST(test_ContentTypeSniff, p, f);
+	LAUNCH_TEST(test_IdNameTable, p, f);
+	LAUNCH_TEST(test_ColorTable, p, f);
+	LAUNCH_TEST(test_SizeGetString, p, f);
+	LAUNCH_TEST(test_PermissionsGetSymbolic, p, f);
+	LAUNCH_TEST(test_ArgumentsParseNumbers, p, f);
+	LAUNCH_TEST(test_PathQueryGetPath, p, f);
+	LAUNCH_TEST(test_PathQueryPrintListingPaths, p, f);
+	LAUNCH_TEST(test_DirStackOpen, p, f);
 
 	PRINT_GRADE(p, f);
 